@@ -0,0 +1,101 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "annexb.h"
+
+//
+// Start code search for Annex B byte streams.
+//
+// The helper pipes are searched for every start code to find where
+// access units end, so this is the hot loop of the pipe path. Sixteen
+// positions are tested at once by comparing the block with itself
+// shifted by one and two bytes. Without NEON or SSE2 it falls back to
+// the usual skip search, which looks at about one byte in three of
+// typical slice data.
+//
+
+// Returns the first 00 00 01 wholly inside [p,end), or end
+const uint8_t *AnnexBFindStartScalar(const uint8_t *p,const uint8_t *end) {
+    while(end - p >= ANNEXB_START_LENGTH) {
+      if(p[2] > 1)
+        p += 3;
+      else if(p[2] == 0)
+        p++;
+      else if(p[1] == 0 && p[0] == 0)
+        return p;
+      else
+        p += 3;
+    }
+    return end;
+}
+#if defined(__ARM_NEON)
+const uint8_t *AnnexBFindStart(const uint8_t *p,const uint8_t *end) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    // Each block reads two bytes past its sixteen positions
+    while(end - p >= 16 + ANNEXB_START_LENGTH - 1) {
+      uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(p),zero),vceqq_u8(vld1q_u8(p + 1),zero));
+      m = vandq_u8(m,vceqq_u8(vld1q_u8(p + 2),one));
+      uint64x2_t w = vreinterpretq_u64_u8(m);
+      uint64_t lo = vgetq_lane_u64(w,0);
+      uint64_t hi = vgetq_lane_u64(w,1);
+      if(lo)
+        return p + __builtin_ctzll(lo) / 8;
+      if(hi)
+        return p + 8 + __builtin_ctzll(hi) / 8;
+      p += 16;
+    }
+    return AnnexBFindStartScalar(p,end);
+}
+const char *AnnexBScanner(void) {
+    return "NEON";
+}
+#elif defined(__SSE2__)
+const uint8_t *AnnexBFindStart(const uint8_t *p,const uint8_t *end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    // Each block reads two bytes past its sixteen positions
+    while(end - p >= 16 + ANNEXB_START_LENGTH - 1) {
+      __m128i m = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p),zero),
+                                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)),zero));
+      m = _mm_and_si128(m,_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 2)),one));
+      int mask = _mm_movemask_epi8(m);
+      if(mask)
+        return p + __builtin_ctz(mask);
+      p += 16;
+    }
+    return AnnexBFindStartScalar(p,end);
+}
+const char *AnnexBScanner(void) {
+    return "SSE2";
+}
+#else
+const uint8_t *AnnexBFindStart(const uint8_t *p,const uint8_t *end) {
+    return AnnexBFindStartScalar(p,end);
+}
+const char *AnnexBScanner(void) {
+    return "scalar";
+}
+#endif
@@ -0,0 +1,25 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _ANNEXB_H_INCLUDED_
+#define _ANNEXB_H_INCLUDED_
+
+#define ANNEXB_START_LENGTH 3           // 00 00 01, a four byte code has another zero in front
+
+const uint8_t *AnnexBFindStart(const uint8_t *,const uint8_t *);
+const uint8_t *AnnexBFindStartScalar(const uint8_t *,const uint8_t *);
+const char    *AnnexBScanner(void);
+#endif
@@ -10,8 +10,15 @@ typedef struct _Plexer        *Plexer;
 typedef struct _KeyMap        *KeyMap;
 typedef struct _RemoteControl *RemoteControl;
 typedef struct _PTZController *PTZController;
+typedef struct _RtspStats     *RtspStats;
+typedef struct _HelperStats   *HelperStats;
 typedef enum   _OpCode        OpCode;
 typedef enum   _HttpMethod    HttpMethod;
+typedef enum   _EventLoop     EventLoop;
+typedef enum   _IngestMethod  IngestMethod;
+typedef enum   _RtpTransport  RtpTransport;
+typedef enum   _VideoCodec    VideoCodec;
+typedef enum   _RtspPhase     RtspPhase;
 
 enum _OpCode {
     Op_None = 0,
@@ -47,23 +54,147 @@ enum _HttpMethod {
     HTTP_PUT,
     HTTP_DELETE
 };
+enum _EventLoop {
+    EVENT_LOOP_EPOLL,
+    EVENT_LOOP_SELECT
+};
+enum _IngestMethod {
+    INGEST_READ,
+    INGEST_URING,
+    INGEST_URING_SQPOLL,
+    INGEST_DRAIN
+};
+enum _RtpTransport {
+    RTP_TCP,
+    RTP_UDP,
+    RTP_MULTICAST
+};
+enum _VideoCodec {
+    CODEC_H264,
+    CODEC_H265
+};
+// Where the time goes starting a stream
+enum _RtspPhase {
+    PHASE_QUEUED,               // Waiting for a startup slot
+    PHASE_CONNECT,              // Name lookup and connect, native client only
+    PHASE_DESCRIBE,
+    PHASE_SETUP,
+    PHASE_PLAY,
+    PHASE_FIRST_PACKET,         // PLAY reply to the first RTP packet
+    RTSP_PHASES
+};
+struct _RtspStats {
+    uint64_t Connects;          // Times the session reached PLAY
+    uint64_t Failures;          // Sessions that failed or were lost
+    uint64_t Timeouts;          // Failures because nothing arrived for Timeout ms
+    uint64_t KeepAlives;        // Keepalive requests sent
+    uint64_t Reconnects;        // Times the session was restored after a failure
+    uint64_t LastReconnectMS;   // From the first failure to playing again
+    uint64_t MaxReconnectMS;
+    uint64_t TotalReconnectMS;
+    uint64_t DownSince;         // Monotonic ms of the first failure, 0 when playing
+    uint32_t PhaseMS[RTSP_PHASES];  // How long each phase of the last start took
+    uint32_t StartMS;           // Queued to first packet for the last start
+    uint32_t MaxStartMS;
+    uint64_t Switches;          // Changes of stream for the view
+    uint32_t LastSwitchMS;      // From asking for the new stream to its key frame
+    uint64_t WarmSwitches;      // Switches to a stream that was already warm
+};
+struct _HelperStats {
+    uint64_t Starts;            // Times the helper was run
+    uint64_t Exits;             // Times it went by itself
+    uint64_t Stalls;            // Times it was killed for sending nothing
+    uint64_t Failovers;         // Times the standby took over
+    int32_t  LastStatus;        // From waitpid for the last one reaped
+    uint64_t DownSince;         // Monotonic ms it last went, 0 while data flows
+    uint64_t LastDownMS;        // From going to data flowing again
+    uint64_t MaxDownMS;
+    uint64_t TotalDownMS;
+};
+// Supervision of the stream helper
+#define HELPER_REAPING  8       // Helpers gone but not yet waited for, per camera
+struct _Helper {
+    int32_t  RespawnDelay;      // Milliseconds before the first restart
+    int32_t  RespawnMax;        // Milliseconds the backoff stops doubling at
+    int32_t  StallTimeout;      // Milliseconds without data before it is killed, 0 = never
+    uint32_t Failures;          // Since data last arrived, sets the backoff
+    pid_t    Reaping[HELPER_REAPING]; // Killed and left for the watchdog to wait for
+    int32_t  Dying;             // Child has gone or been killed, Gone has been called
+    int      PidFD;             // Readable when the helper exits, -1 without pidfd
+    void    *Monitor;           // MonitorHandle for PidFD
+    void    *Watchdog;          // MonitorTimer checking data arrives
+    void   (*Gone)(Camera);     // Called to close the stream of a dead or stalled helper
+    uint64_t LastBytes;         // Read from the helper at LastData
+    uint64_t LastData;          // Monotonic ms data last arrived
+    int32_t  Standby;           // Keep a second helper connected to take over
+    pid_t    StandbyChild;      // 0 if there isn't one
+    int      StandbyFD;         // Its stdout, read and thrown away until it takes over
+    uint64_t StandbyData;       // Monotonic ms it last sent anything
+    void    *StandbyMonitor;    // MonitorHandle for StandbyFD
+    struct _HelperStats Stats;
+};
 struct _RTSP {
     char    *URL;
     char    *Control;
-    char    *Buffer;
-    uint32_t BufferLength;
-    uint32_t BufferUsed;
-    int32_t  ContentLength;
+    char    *ContentBase;       // From the DESCRIBE reply (curl)
+    void    *Sdp;               // SDP parser (curl)
+    int32_t  Native;            // Use the native client rather than curl
+    void    *Session;           // Native client state
+    void    *Standby;           // Native session for a stream being switched to or kept warm
+    void    *Depack;            // RTP depacketizer
+    void    *Rtcp;              // RTCP statistics and reports
+    RtpTransport Transport;     // How the RTP is received (native client only)
+    int32_t  Latency;           // Milliseconds to wait for out of order UDP packets
+    int32_t  Conceal;           // Pass frames damaged by loss on for the decoder to cover up
+    int32_t  Timeout;           // Milliseconds without data before reconnecting
+    uint32_t KeepAliveDelay;    // Milliseconds between keepalives, from the session timeout
+    void    *Easy;              // curl handle for the current request
+    void    *Watchdog;          // MonitorTimer checking the session is alive
+    uint32_t Failures;          // Since data last arrived, sets the backoff
+    uint64_t LastActivity;      // Monotonic ms of the last progress
+    uint64_t LastPackets;       // Depacketizer packet count at LastActivity
+    uint64_t KeepAliveDue;      // Monotonic ms the next keepalive is due (curl)
+    int32_t  Pipeline;          // Send requests without waiting for replies (native only)
+    int32_t  Starting;          // Holds a startup slot
+    int32_t  Queued;            // Waiting for a startup slot
+    void   (*Start)(Camera);    // Called when the slot is granted
+    uint64_t PhaseStart;        // Monotonic ms the current phase started
+    uint64_t StartTime;         // Monotonic ms the start was queued
+    struct _RtspStats Stats;
+};
+// One of the streams a camera offers, smallest first
+struct _Stream {
+    char    *URL;
+    int32_t  Width;
+    int32_t  Height;
+    int32_t  Bitrate;           // kbit/s, for the prewarm budget
 };
 struct _Camera {
     char    *Name;
     int32_t ControlID;
     PTZController PTZ;
     struct _RTSP RTSP;
+    int32_t StreamCount;
+    Stream  Stream;             // RTSP streams, RTSP.URL is the one playing
+    int32_t StreamIndex;        // The one wanted for the current view
+    int32_t WarmIndex;          // The one kept warm for another view, -1 for none
     char    **StreamCommand;
     int     StreamPipe[2];
     void    *RenderHandle;
+    VideoCodec Codec;           // What the decoder is set up for
     pid_t   Child;
+    int32_t IngestThread;       // Read the stream on its own thread
+    int32_t IngestCPU;          // CPU to pin the ingest thread to, -1 for any
+    void    *Ingest;
+    void    *Gate;              // Holds the helper output until a key frame
+    void    *Framer;            // Splits the helper output into access units
+    int32_t ShmSize;            // Bytes of shared memory ring for the helper, 0 for a pipe
+    void    *Shm;               // The ring the helper writes access units into
+    void    *ShmMonitor;        // MonitorHandle for the ring's eventfd
+    int32_t ShmKeyed;           // A key frame has come out of the ring
+    void    *Fanout;            // Copies of the video for anything besides the decoder
+    void    *Monitor;           // MonitorHandle for the stream
+    struct _Helper Helper;
 };
 struct _CameraView {
     int32_t Camera;
@@ -106,6 +237,14 @@ struct _Plexer {
     RemoteControl RemoteControl;
     int32_t       BackgroundColour;
     char         *BackgroundImage;
+    EventLoop     EventLoop;
+    IngestMethod  IngestMethod;         // How stream helper pipes are read
+    int32_t       DrainBudget;          // Bytes read per wakeup in drain mode
+    int32_t       DrainInterval;        // Milliseconds between reads in drain mode
+    int32_t       PipeSize;             // Bytes, for stream helper pipes, 0 = default
+    int32_t       StatsInterval;        // Seconds between statistics dumps, 0 = never
+    int32_t       StartupConcurrency;   // RTSP sessions starting at once, 0 = no limit
+    int32_t       PrewarmBandwidth;     // kbit/s for streams kept warm for other views
 };
 struct _PTZController {
     char *Name;
@@ -117,6 +256,23 @@ struct _PTZController {
     } Control[Op_PTZ_Max];
 };
 Plexer LoadConfig(char *);
-void MonitorInitialise(void);
+void MonitorInitialise(EventLoop);
 void RtspStartStream(Camera);
+void RtspStopStream(Camera);
+uint32_t RtspSessionFailed(Camera);
+void RtspSessionPlaying(Camera);
+void RtspSessionActive(Camera);
+int  RtspSessionIdle(Camera);
+uint32_t RtspKeepAliveDelay(const char *);
+void RtspSetStartupConcurrency(int32_t);
+void RtspStartupQueue(Camera,void (*)(Camera));
+void RtspStartupCancel(Camera);
+void RtspPhaseDone(Camera,RtspPhase);
+void RtspSwitchStream(Camera,int32_t);
+void RtspSwitchFailed(Camera);
+void RtspPrewarmStream(Camera,int32_t);
+void RtspNativeStartStream(Camera);
+void RtspNativeStopStream(Camera);
+void RtspNativeSwitchStream(Camera,const char *);
+void RtspNativePrewarmStream(Camera,const char *);
 #endif
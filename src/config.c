@@ -21,6 +21,7 @@
 #include <libconfig.h>
 #include <math.h>
 #include "cctvplexer.h"
+#include "helper.h"
 
 #define WARN(cfg,fmt,...)   do { \
   printf("WARNING: %s(%i): " fmt,config_setting_source_file(cfg), \
@@ -30,6 +31,13 @@
 #define MAX_PATH_LENGTH     256
 #define MAX_STRING_LENGTH   1024
 #define MAX_PARSE_COUNT     10
+#define DEFAULT_LATENCY     100     // Milliseconds, UDP reorder wait
+#define DEFAULT_SHM_SIZE    (4*1024*1024) // Bytes, stream helper ring
+#define DEFAULT_TIMEOUT     5000    // Milliseconds without video before reconnecting
+#define MIN_TIMEOUT         100
+#define DEFAULT_RESPAWN     10      // Seconds before restarting a stream helper
+#define DEFAULT_RESPAWN_MAX 300     // Seconds, the most backing off will wait
+#define DEFAULT_STALL       10000   // Milliseconds without data before killing a helper
 
 #define INDEX_NAME  "IndexBLahBlah"
 // If (va) isn't a number use (de) else use (va)/(sc) if sc is number otherwise use (va)
@@ -290,6 +298,45 @@ static char *StringParser(config_t *cfg,config_setting_t *context,const char *in
 
     return NULL;
 }
+// The streams a camera offers, each with a URL, its resolution and
+// optionally its bit rate. Without one it is guessed from the size,
+// about 4Mbit/s for 1080p. They are kept smallest first. Returns how
+// many were loaded.
+static int LoadStreams(config_t *cfg,config_setting_t *camera,config_setting_t *streams,Camera cam) {
+    int count = config_setting_length(streams);
+
+    cam->Stream = calloc(count,sizeof(struct _Stream));
+    for(int idx = 0; idx < count; idx++) {
+      config_setting_t *stream = config_setting_get_elem(streams,idx);
+      const char *url = NULL;
+      int width = 0,height = 0,bitrate = 0;
+
+      config_setting_lookup_string(stream,"URL",&url);
+      config_setting_lookup_int(stream,"Width",&width);
+      config_setting_lookup_int(stream,"Height",&height);
+      config_setting_lookup_int(stream,"Bitrate",&bitrate);
+      if(url == NULL || strncmp(url,"rtsp://",7) || width <= 0 || height <= 0) {
+        WARN(stream,"Stream %i of camera %s needs an rtsp URL, Width and Height, ignoring\n",
+             idx,config_setting_name(camera));
+        continue;
+      }
+      // Insert in order of size
+      int n = cam->StreamCount++;
+      while(n > 0 && (int64_t) cam->Stream[n-1].Width * cam->Stream[n-1].Height > (int64_t) width * height) {
+        cam->Stream[n] = cam->Stream[n-1];
+        n--;
+      }
+      cam->Stream[n].URL = strdup(StringParser(cfg,camera,url));
+      cam->Stream[n].Width = width;
+      cam->Stream[n].Height = height;
+      cam->Stream[n].Bitrate = bitrate > 0 ? bitrate : (int64_t) width * height / 512;
+    }
+    if(cam->StreamCount == 0) {
+      free(cam->Stream);
+      cam->Stream = NULL;
+    }
+    return cam->StreamCount;
+}
 static PTZController LoadPTZ(config_t *cfg,config_setting_t *context,config_setting_t *ptz) {
     if(ptz == NULL)
       return NULL;
@@ -354,9 +401,20 @@ static int LoadCameras(Plexer plx,config_t *cfg,config_setting_t *camdefs) {
       config_setting_lookup_string(camera,"URL",&url);
       config_setting_lookup_string(camera,"Command",&command);
       comargs = config_setting_lookup(camera,"Arguments");
-      //Stream command and arguments or URL
-      if(url && strncmp(url,"rtsp://",7) == 0) {
+      config_setting_t *streams = config_setting_lookup(camera,"Streams");
+      plx->Camera[i].WarmIndex = -1;
+      //Stream command and arguments, streams or URL
+      if(streams && LoadStreams(cfg,camera,streams,&plx->Camera[i])) {
+        if(url)
+          WARN(camera,"Camera %s has both URL and Streams, using Streams\n",config_setting_name(camera));
+        // Start small, the view decides
+        plx->Camera[i].RTSP.URL = plx->Camera[i].Stream[0].URL;
+      }
+      else if(url && strncmp(url,"rtsp://",7) == 0) {
         plx->Camera[i].RTSP.URL = strdup(StringParser(cfg,camera,url));
+        plx->Camera[i].Stream = calloc(1,sizeof(struct _Stream));
+        plx->Camera[i].Stream[0].URL = plx->Camera[i].RTSP.URL;
+        plx->Camera[i].StreamCount = 1;
       }
       else {
         if(url)
@@ -379,6 +437,93 @@ static int LoadCameras(Plexer plx,config_t *cfg,config_setting_t *camdefs) {
           }
         }
       }
+      // RTSP client
+      const char *client = NULL;
+      if(config_setting_lookup_string(camera,"RTSPClient",&client)) {
+        if(strcasecmp(client,"native") == 0)
+          plx->Camera[i].RTSP.Native = 1;
+        else if(strcasecmp(client,"curl"))
+          WARN(camera,"Unknown RTSPClient %s, using curl\n",client);
+      }
+      // RTP transport
+      const char *transport = NULL;
+      plx->Camera[i].RTSP.Latency = DEFAULT_LATENCY;
+      if(config_setting_lookup_string(camera,"Transport",&transport)) {
+        if(strcasecmp(transport,"udp") == 0 || strcasecmp(transport,"multicast") == 0) {
+          plx->Camera[i].RTSP.Transport = strcasecmp(transport,"udp") ? RTP_MULTICAST : RTP_UDP;
+          if(plx->Camera[i].RTSP.URL && plx->Camera[i].RTSP.Native == 0) {
+            WARN(camera,"%s transport needs the native RTSP client, using it\n",transport);
+            plx->Camera[i].RTSP.Native = 1;
+          }
+        }
+        else if(strcasecmp(transport,"tcp"))
+          WARN(camera,"Unknown Transport %s, using tcp\n",transport);
+      }
+      // Video codec
+      const char *codec = NULL;
+      if(config_setting_lookup_string(camera,"Codec",&codec)) {
+        if(strcasecmp(codec,"h265") == 0 || strcasecmp(codec,"hevc") == 0)
+          plx->Camera[i].Codec = CODEC_H265;
+        else if(strcasecmp(codec,"h264"))
+          WARN(camera,"Unknown Codec %s, using h264\n",codec);
+      }
+      // Threaded ingest
+      int value;
+      plx->Camera[i].IngestCPU = -1;
+      if(config_setting_lookup_bool(camera,"IngestThread",&value))
+        plx->Camera[i].IngestThread = value;
+      if(config_setting_lookup_int(camera,"IngestCPU",&value))
+        plx->Camera[i].IngestCPU = value;
+      // How the stream helper hands over the video
+      const char *helper = NULL;
+      if(config_setting_lookup_string(camera,"HelperTransport",&helper)) {
+        if(strcasecmp(helper,"shm") == 0) {
+          plx->Camera[i].ShmSize = DEFAULT_SHM_SIZE;
+          if(config_setting_lookup_int(camera,"ShmSize",&value) && value > 0)
+            plx->Camera[i].ShmSize = value;
+        }
+        else if(strcasecmp(helper,"pipe"))
+          WARN(camera,"Unknown HelperTransport %s, using pipe\n",helper);
+      }
+      // Stream helper supervision
+      plx->Camera[i].Helper.RespawnDelay = DEFAULT_RESPAWN * 1000;
+      plx->Camera[i].Helper.RespawnMax = DEFAULT_RESPAWN_MAX * 1000;
+      plx->Camera[i].Helper.StallTimeout = DEFAULT_STALL;
+      if(config_setting_lookup_int(camera,"RespawnDelay",&value)) {
+        if(value * 1000 < HELPER_MIN_RESPAWN)
+          WARN(camera,"RespawnDelay %i too short, using %i\n",value,HELPER_MIN_RESPAWN/1000);
+        plx->Camera[i].Helper.RespawnDelay = value * 1000 < HELPER_MIN_RESPAWN ? HELPER_MIN_RESPAWN : value * 1000;
+      }
+      if(config_setting_lookup_int(camera,"RespawnMax",&value) && value >= 0)
+        plx->Camera[i].Helper.RespawnMax = value * 1000;
+      if(plx->Camera[i].Helper.RespawnMax < plx->Camera[i].Helper.RespawnDelay) {
+        WARN(camera,"RespawnMax is less than RespawnDelay, using %i\n",plx->Camera[i].Helper.RespawnDelay/1000);
+        plx->Camera[i].Helper.RespawnMax = plx->Camera[i].Helper.RespawnDelay;
+      }
+      if(config_setting_lookup_int(camera,"StallTimeout",&value))
+        plx->Camera[i].Helper.StallTimeout = value > 0 ? value : 0;
+      if(config_setting_lookup_bool(camera,"StandbyHelper",&value) && value) {
+        if(plx->Camera[i].ShmSize)
+          WARN(camera,"StandbyHelper needs HelperTransport pipe, ignoring it\n");
+        else
+          plx->Camera[i].Helper.Standby = 1;
+      }
+      if(config_setting_lookup_int(camera,"Latency",&value))
+        plx->Camera[i].RTSP.Latency = value;
+      if(config_setting_lookup_bool(camera,"Conceal",&value))
+        plx->Camera[i].RTSP.Conceal = value;
+      if(config_setting_lookup_bool(camera,"Pipeline",&value) && value) {
+        if(plx->Camera[i].RTSP.Native)
+          plx->Camera[i].RTSP.Pipeline = 1;
+        else
+          WARN(camera,"Pipeline needs the native RTSP client, ignoring it\n");
+      }
+      plx->Camera[i].RTSP.Timeout = DEFAULT_TIMEOUT;
+      if(config_setting_lookup_int(camera,"Timeout",&value)) {
+        if(value < MIN_TIMEOUT)
+          WARN(camera,"Timeout %i too short, using %i\n",value,MIN_TIMEOUT);
+        plx->Camera[i].RTSP.Timeout = value < MIN_TIMEOUT ? MIN_TIMEOUT : value;
+      }
       // PTZ control
       if(ptzcontroller) {
         config_setting_t *control = ptzdefs ? config_setting_lookup(ptzdefs,ptzcontroller) : NULL;
@@ -622,6 +767,41 @@ Plexer LoadConfig(char *file) {
     config_lookup_string(&cfg,"BackgroundImage",&image);
     if(image)
       plexer->BackgroundImage = strdup(image);
+    // How to wait for events
+    const char *eventloop = NULL;
+    plexer->EventLoop = EVENT_LOOP_EPOLL;
+    if(config_lookup_string(&cfg,"EventLoop",&eventloop)) {
+      if(strcasecmp(eventloop,"select") == 0)
+        plexer->EventLoop = EVENT_LOOP_SELECT;
+      else if(strcasecmp(eventloop,"epoll") != 0)
+        printf("WARNING: Unknown EventLoop %s, using epoll\n",eventloop);
+    }
+    // How to read the stream helper pipes
+    const char *ingest = NULL;
+    plexer->IngestMethod = INGEST_READ;
+    if(config_lookup_string(&cfg,"IngestMethod",&ingest)) {
+      if(strcasecmp(ingest,"uring") == 0)
+        plexer->IngestMethod = INGEST_URING;
+      else if(strcasecmp(ingest,"uring-sqpoll") == 0)
+        plexer->IngestMethod = INGEST_URING_SQPOLL;
+      else if(strcasecmp(ingest,"drain") == 0)
+        plexer->IngestMethod = INGEST_DRAIN;
+      else if(strcasecmp(ingest,"read") != 0)
+        printf("WARNING: Unknown IngestMethod %s, using read\n",ingest);
+    }
+    plexer->DrainBudget = 512 * 1024;
+    plexer->DrainInterval = 20;
+    config_lookup_int(&cfg,"DrainBudget",&plexer->DrainBudget);
+    config_lookup_int(&cfg,"DrainInterval",&plexer->DrainInterval);
+    if(plexer->DrainBudget <= 0)
+      plexer->DrainBudget = 1;
+    // Drain mode needs room for what arrives between reads
+    plexer->PipeSize = plexer->IngestMethod == INGEST_DRAIN ? 1024 * 1024 : 0;
+    config_lookup_int(&cfg,"PipeSize",&plexer->PipeSize);
+    // How often to dump statistics
+    config_lookup_int(&cfg,"StatsInterval",&plexer->StatsInterval);
+    config_lookup_int(&cfg,"StartupConcurrency",&plexer->StartupConcurrency);
+    config_lookup_int(&cfg,"PrewarmBandwidth",&plexer->PrewarmBandwidth);
     // CAMERAS
     config_setting_t *cams = config_lookup(&cfg,"Camera");
     LoadCameras(plexer,&cfg,cams);
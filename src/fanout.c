@@ -0,0 +1,296 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "monitor.h"
+#include "fanout.h"
+
+//
+// Access unit fan out for recording, relaying and analysis.
+//
+// The decoder gets each camera's video straight into its own buffers
+// and that doesn't change. Anything else that wants the video
+// subscribes a sink to the camera's fanout. While there are sinks
+// each access unit is copied once into a pooled, reference counted
+// unit and queued for every one of them, so the cost doesn't grow
+// with the number of sinks and there is none without any.
+//
+// Every sink has its own bounded queue. One that falls behind loses
+// units, by its own policy, rather than holding up the decoder or
+// the other sinks. Sinks can be read from any thread, and one can be
+// unsubscribed while another thread is waiting on it; the queue's
+// eventfd is readable while there is something in it so they can
+// also be read from the main loop.
+//
+// Everything is published as whole access units with key frames
+// marked: the RTSP clients' depacketizer, the framer for helper pipes
+// and the shared memory ring all do that. A unit published without
+// FANOUT_FRAMED is just part of the stream, so nothing says where the
+// key frames are and FANOUT_DROP_TO_KEY carries on straight away.
+//
+
+typedef struct _Unit *Unit;
+struct _Unit {
+    struct _AccessUnit Public;      // Must be first
+    Fanout   Owner;
+    Unit     Next;                  // In the pool
+    int32_t  Refs;
+    int32_t  Size;
+    uint8_t *Buffer;
+};
+struct _FanoutSink {
+    const char *Name;
+    Fanout     Owner;
+    FanoutSink Next;
+    FanoutPolicy Policy;
+    int        FD;                  // eventfd, readable while Queue isn't empty
+    int32_t    Depth;
+    int32_t    Head;                // Next to be taken
+    int32_t    Count;
+    int32_t    Skipping;            // Dropping up to a key frame
+    int32_t    Refs;                // The subscription and each FanoutNext under way
+    int32_t    Closed;              // Unsubscribed
+    struct _FanoutStats Stats;
+    Unit      *Queue;
+};
+struct _Fanout {
+    const char *Name;
+    pthread_mutex_t Lock;           // For the sinks, their queues and the pool
+    FanoutSink Sinks;
+    Unit       Pool;
+};
+
+// A unit from the pool with room for Length bytes, Lock held
+static Unit Take(Fanout f,int32_t length) {
+    Unit u = f->Pool;
+
+    if(u)
+      f->Pool = u->Next;
+    else if((u = calloc(1,sizeof(struct _Unit))) == NULL)
+      return NULL;
+    if(u->Size < length) {
+      uint8_t *buffer = realloc(u->Buffer,length);
+      if(buffer == NULL) {
+        u->Next = f->Pool;
+        f->Pool = u;
+        return NULL;
+      }
+      u->Buffer = buffer;
+      u->Size = length;
+    }
+    u->Owner = f;
+    u->Public.Data = u->Buffer;
+    return u;
+}
+// Queues u for s if its policy allows, Lock held
+static int Queue(FanoutSink s,Unit u,int32_t framed) {
+    uint64_t one = 1;
+    int32_t key = u->Public.Flags & FANOUT_KEY;
+
+    if(s->Skipping && framed && !key) {
+      s->Stats.Dropped++;
+      return 0;
+    }
+    if(s->Count == s->Depth) {
+      if(!s->Skipping)
+        s->Stats.Overflows++;
+      s->Skipping = s->Policy == FANOUT_DROP_TO_KEY;
+      s->Stats.Dropped++;
+      return 0;
+    }
+    s->Skipping = 0;
+    s->Queue[(s->Head + s->Count) % s->Depth] = u;
+    s->Count++;
+    s->Stats.Units++;
+    if(write(s->FD,&one,sizeof(one)) < 0 && errno != EAGAIN)
+      perror("Fanout wake");
+    return 1;
+}
+
+// Gives a unit back to the pool once nothing has it, Lock held
+static void Drop(Unit u) {
+    if(__atomic_sub_fetch(&u->Refs,1,__ATOMIC_ACQ_REL) > 0)
+      return;
+    u->Next = u->Owner->Pool;
+    u->Owner->Pool = u;
+}
+// Frees the sink once it has been unsubscribed and nothing is
+// waiting on it, Lock held
+static void Put(FanoutSink s) {
+    if(--s->Refs > 0)
+      return;
+    close(s->FD);
+    free(s->Queue);
+    free(s);
+}
+//
+// Public interface
+//
+
+Fanout FanoutNew(const char *Name) {
+    Fanout f = calloc(1,sizeof(struct _Fanout));
+    if(f == NULL)
+      return NULL;
+    f->Name = Name;
+    pthread_mutex_init(&f->Lock,NULL);
+    return f;
+}
+// Whether anything has subscribed, so whether publishing does anything
+int FanoutWanted(Fanout f) {
+    return f && __atomic_load_n(&f->Sinks,__ATOMIC_RELAXED) != NULL;
+}
+// Copies Length bytes at Data, with Flags, to every sink that has room
+void FanoutPublish(Fanout f,const uint8_t *Data,int32_t Length,uint32_t Flags) {
+    Unit u;
+
+    if(!FanoutWanted(f) || Length <= 0)
+      return;
+    pthread_mutex_lock(&f->Lock);
+    if((u = Take(f,Length)) == NULL) {
+      pthread_mutex_unlock(&f->Lock);
+      printf("Fanout %s: no memory for a %i byte unit\n",f->Name,Length);
+      return;
+    }
+    memcpy(u->Buffer,Data,Length);
+    u->Public.Length = Length;
+    u->Public.Flags = Flags;
+    u->Public.Published = MonitorNow();
+    u->Refs = 0;
+    for(FanoutSink s = f->Sinks; s; s = s->Next)
+      u->Refs += Queue(s,u,Flags & FANOUT_FRAMED);
+    if(u->Refs == 0) {
+      u->Next = f->Pool;
+      f->Pool = u;
+    }
+    pthread_mutex_unlock(&f->Lock);
+}
+// Adds a sink that queues up to Depth units, losing them by Policy
+// when it is full
+FanoutSink FanoutSubscribe(Fanout f,const char *Name,int32_t Depth,FanoutPolicy Policy) {
+    FanoutSink s = calloc(1,sizeof(struct _FanoutSink));
+
+    if(s == NULL || Depth <= 0 || (s->Queue = calloc(Depth,sizeof(Unit))) == NULL ||
+       (s->FD = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+      printf("Fanout %s: unable to add sink %s\n",f->Name,Name);
+      if(s)
+        free(s->Queue);
+      free(s);
+      return NULL;
+    }
+    s->Name = Name;
+    s->Owner = f;
+    s->Depth = Depth;
+    s->Policy = Policy;
+    s->Refs = 1;
+    // Start at a key frame
+    s->Skipping = Policy == FANOUT_DROP_TO_KEY;
+    pthread_mutex_lock(&f->Lock);
+    s->Next = f->Sinks;
+    __atomic_store_n(&f->Sinks,s,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&f->Lock);
+    return s;
+}
+// Removes a sink, releasing anything still queued for it. A
+// FanoutNext waiting on another thread returns NULL and the sink is
+// freed when it has. FanoutNext mustn't be called again after this.
+void FanoutUnsubscribe(FanoutSink s) {
+    Fanout f;
+    uint64_t one = 1;
+
+    if(s == NULL)
+      return;
+    f = s->Owner;
+    pthread_mutex_lock(&f->Lock);
+    for(FanoutSink *p = &f->Sinks; *p; p = &(*p)->Next)
+      if(*p == s) {
+        __atomic_store_n(p,s->Next,__ATOMIC_RELAXED);
+        break;
+      }
+    for(; s->Count; s->Count--) {
+      Drop(s->Queue[s->Head]);
+      s->Head = (s->Head + 1) % s->Depth;
+    }
+    s->Closed = 1;
+    // Left readable to wake anything waiting
+    if(write(s->FD,&one,sizeof(one)) < 0 && errno != EAGAIN)
+      perror("Fanout wake");
+    printf("Fanout %s: sink %s had %llu units, dropped %llu in %llu overflows\n",f->Name,s->Name,
+           (unsigned long long) s->Stats.Units,(unsigned long long) s->Stats.Dropped,
+           (unsigned long long) s->Stats.Overflows);
+    Put(s);
+    pthread_mutex_unlock(&f->Lock);
+}
+// The next unit for the sink, waiting up to Wait ms (-1 for ever) for
+// one. NULL if there isn't one. Give it back with FanoutRelease.
+AccessUnit FanoutNext(FanoutSink s,int32_t Wait) {
+    Fanout f = s->Owner;
+    Unit u = NULL;
+    uint64_t count;
+
+    pthread_mutex_lock(&f->Lock);
+    s->Refs++;
+    for(int tries = 0; ; tries++) {
+      if(s->Count) {
+        u = s->Queue[s->Head];
+        s->Head = (s->Head + 1) % s->Depth;
+        s->Count--;
+      }
+      // Keep the eventfd in step with the queue
+      if(s->Count == 0 && !s->Closed && read(s->FD,&count,sizeof(count)) < 0 && errno != EAGAIN)
+        perror("Fanout read");
+      if(u || Wait == 0 || tries || s->Closed)
+        break;
+      pthread_mutex_unlock(&f->Lock);
+      struct pollfd pfd = { .fd = s->FD,.events = POLLIN };
+      poll(&pfd,1,Wait);
+      pthread_mutex_lock(&f->Lock);
+    }
+    Put(s);
+    pthread_mutex_unlock(&f->Lock);
+    return u ? &u->Public : NULL;
+}
+// Readable while the sink has units waiting
+int FanoutSinkFD(FanoutSink s) {
+    return s->FD;
+}
+FanoutStats FanoutSinkStats(FanoutSink s) {
+    return &s->Stats;
+}
+// Keep a unit for longer, say to pass it on. Each needs a FanoutRelease.
+void FanoutRetain(AccessUnit au) {
+    __atomic_add_fetch(&((Unit) au)->Refs,1,__ATOMIC_RELAXED);
+}
+void FanoutRelease(AccessUnit au) {
+    Unit u = (Unit) au;
+
+    if(au == NULL || __atomic_sub_fetch(&u->Refs,1,__ATOMIC_ACQ_REL) > 0)
+      return;
+    pthread_mutex_lock(&u->Owner->Lock);
+    u->Next = u->Owner->Pool;
+    u->Owner->Pool = u;
+    pthread_mutex_unlock(&u->Owner->Lock);
+}
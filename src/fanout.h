@@ -0,0 +1,58 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _FANOUT_H_INCLUDED_
+#define _FANOUT_H_INCLUDED_
+
+typedef struct _Fanout      *Fanout;
+typedef struct _FanoutSink  *FanoutSink;
+typedef struct _AccessUnit  *AccessUnit;
+typedef struct _FanoutStats *FanoutStats;
+typedef enum   _FanoutPolicy FanoutPolicy;
+
+#define FANOUT_KEY      1           // Starts with a key frame
+#define FANOUT_FRAMED   2           // Whole access units rather than pieces of the stream
+
+// What a sink loses when its queue is full
+enum _FanoutPolicy {
+    FANOUT_DROP_NEWEST,             // The units that don't fit
+    FANOUT_DROP_TO_KEY              // Everything up to the next key frame that fits
+};
+
+// Shared, read only, until the last FanoutRelease
+struct _AccessUnit {
+    const uint8_t *Data;
+    int32_t  Length;
+    uint32_t Flags;
+    uint64_t Published;             // Monotonic ms
+};
+struct _FanoutStats {
+    uint64_t Units;                 // Queued for the sink
+    uint64_t Dropped;               // Lost to a full queue
+    uint64_t Overflows;             // Times the queue filled
+};
+
+Fanout     FanoutNew(const char *);
+int        FanoutWanted(Fanout);
+void       FanoutPublish(Fanout,const uint8_t *,int32_t,uint32_t);
+FanoutSink FanoutSubscribe(Fanout,const char *,int32_t,FanoutPolicy);
+void       FanoutUnsubscribe(FanoutSink);
+AccessUnit FanoutNext(FanoutSink,int32_t);
+int        FanoutSinkFD(FanoutSink);
+FanoutStats FanoutSinkStats(FanoutSink);
+void       FanoutRetain(AccessUnit);
+void       FanoutRelease(AccessUnit);
+#endif
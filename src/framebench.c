@@ -0,0 +1,130 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+//
+// Benchmark for the start code search and access unit framing used
+// on stream helper pipes, run over a captured Annex B stream, e.g.
+//
+//   ffmpeg -rtsp_transport tcp -i rtsp://camera/stream -c copy -t 60 -f h264 capture.h264
+//   framebench capture.h264 [h264|h265] [passes] [chunk]
+//
+// Reports GB/s for the plain and vector searches on the whole file,
+// then for the framer fed in chunk sized reads as from the pipe.
+//
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "render.h"
+#include "annexb.h"
+#include "framer.h"
+
+#define BUFFER_SIZE   (80*1024)       // About the size of a decoder buffer
+
+// Stands in for the decoder and the fanout
+static uint8_t Decoder[BUFFER_SIZE];
+static uint64_t Buffers, Frames, Bytes;
+
+void *RenderReserveBuffer(void *handle,int32_t *length) {
+    if(length)
+      *length = BUFFER_SIZE;
+    return Decoder;
+}
+void RenderUnreserveBuffer(void *handle,void *data) {
+}
+int32_t RenderBufferSize(void *handle) {
+    return BUFFER_SIZE;
+}
+void *RenderProcessBuffer(void *handle,void *data,int32_t length,int32_t flag) {
+    Buffers++;
+    Bytes += length;
+    if(flag & RENDER_ENDOFFRAME)
+      Frames++;
+    return handle;
+}
+void FanoutPublish(void *f,const uint8_t *Data,int32_t Length,uint32_t Flags) {
+}
+
+static uint64_t NowNS(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static void Search(const char *name,const uint8_t *(*find)(const uint8_t *,const uint8_t *),
+                   const uint8_t *data,long length,int passes) {
+    uint64_t starts = 0;
+    uint64_t start = NowNS();
+    for(int i=0; i < passes; i++) {
+      const uint8_t *p = data, *end = data + length;
+      while((p = find(p,end)) != end) {
+        starts++;
+        p += ANNEXB_START_LENGTH;
+      }
+    }
+    double elapsed = (NowNS() - start) / 1e9;
+    printf("%-8s search: %8.2f GB/s %10llu start codes\n",name,
+           (double) length * passes / elapsed / 1e9,(unsigned long long) starts / passes);
+}
+int main(int ac,char *av[]) {
+    if(ac < 2) {
+      printf("usage: framebench capture [h264|h265] [passes] [chunk]\n");
+      return 1;
+    }
+    VideoCodec codec = ac > 2 && strcmp(av[2],"h265") == 0 ? CODEC_H265 : CODEC_H264;
+    int passes = ac > 3 ? atoi(av[3]) : 20;
+    int chunk  = ac > 4 ? atoi(av[4]) : 65536;
+
+    FILE *fp = fopen(av[1],"rb");
+    if(fp == NULL) {
+      perror(av[1]);
+      return 1;
+    }
+    fseek(fp,0,SEEK_END);
+    long length = ftell(fp);
+    rewind(fp);
+    uint8_t *data = malloc(length);
+    if(data == NULL || fread(data,1,length,fp) != length) {
+      printf("Can't read %s\n",av[1]);
+      return 1;
+    }
+    fclose(fp);
+    if(chunk > BUFFER_SIZE)
+      chunk = BUFFER_SIZE;
+
+    Search("scalar",AnnexBFindStartScalar,data,length,passes);
+    Search(AnnexBScanner(),AnnexBFindStart,data,length,passes);
+
+    uint8_t *read = malloc(BUFFER_SIZE);
+    Framer f = FramerNew(av[1],codec,NULL);
+    uint64_t start = NowNS();
+    for(int i=0; i < passes; i++) {
+      FramerReset(f);
+      for(long at = 0; at < length; at += chunk) {
+        int32_t n = length - at < chunk ? length - at : chunk;
+        memcpy(read,data + at,n);
+        FramerSubmit(f,NULL,read,n);
+      }
+    }
+    double elapsed = (NowNS() - start) / 1e9;
+    printf("framer   %6i byte reads: %8.2f GB/s %10llu access units %6.1f buffers per unit\n",
+           chunk,(double) length * passes / elapsed / 1e9,(unsigned long long) Frames / passes,
+           Frames ? (double) Buffers / Frames : 0.0);
+    return 0;
+}
@@ -0,0 +1,249 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "render.h"
+#include "nal.h"
+#include "annexb.h"
+#include "fanout.h"
+#include "framer.h"
+
+//
+// Access unit framing for cameras fed by a stream helper.
+//
+// A read from a helper pipe returns however much the pipe holds, so
+// passing reads straight on leaves buffer boundaries in the middle of
+// NAL units and the decoder has to guess where frames end. Here the
+// reads are gathered up and split at start codes, the NAL units are
+// grouped into access units and each decoder buffer is filled with
+// a whole unit and marked as ending a frame. A unit bigger than a
+// buffer is split across as many as it takes, only the last marked.
+//
+// A unit is only known to be complete when the first NAL unit of the
+// next one arrives, which costs up to a frame interval of latency.
+// Complete units are also published to the camera's fanout.
+//
+
+#define FRAMER_INITIAL  (256*1024)
+#define FRAMER_MAX      (4*1024*1024)   // Much more than any real access unit
+#define FRAMER_UNITS    64              // Complete units waiting for a buffer
+
+struct _Framer {
+    const char *Name;
+    VideoCodec Codec;
+    Fanout     Fanout;
+    void     (*Output)(void *,void *,int32_t,int32_t);  // Instead of RenderProcessBuffer
+    void      *OutputData;
+    uint8_t   *Data;
+    int32_t    Size;
+    int32_t    Length;
+    int32_t    Sent;                // Bytes at the front already with the decoder
+    int32_t    Scanned;             // Where the next start code search begins
+    int32_t    Current;             // Start of the unit in progress
+    int32_t    Picture;             // It has a slice
+    int32_t    Key;                 // It can be decoded from
+    int32_t    Partial;             // Part of the first complete unit has been sent
+    int32_t    Units;
+    int32_t    Ends[FRAMER_UNITS];  // Of the complete units still to send
+    struct {
+      uint64_t Units;
+      uint64_t Split;               // Units too big for a buffer
+      uint64_t Merged;              // Units merged while waiting for buffers
+      uint64_t Overflows;           // Times data was dropped for want of room
+    } Stats;
+};
+
+// The unit in progress ends at At
+static void EndUnit(Framer f,int32_t At) {
+    if(At == f->Current)
+      return;
+    FanoutPublish(f->Fanout,f->Data + f->Current,At - f->Current,
+                  FANOUT_FRAMED | (f->Key ? FANOUT_KEY : 0));
+    if(f->Units == FRAMER_UNITS) {
+      f->Ends[f->Units-1] = At;
+      f->Stats.Merged++;
+    }
+    else
+      f->Ends[f->Units++] = At;
+    f->Stats.Units++;
+    f->Current = At;
+    f->Picture = 0;
+    f->Key = 0;
+}
+// Looks at every NAL unit header since the last time
+static void Scan(Framer f) {
+    int32_t header = NalHeaderLength(f->Codec);
+    const uint8_t *end = f->Data + f->Length;
+
+    for(;;) {
+      const uint8_t *p = AnnexBFindStart(f->Data + f->Scanned,end);
+      // Wait for the header and first body byte
+      if(end - p < ANNEXB_START_LENGTH + header + 1) {
+        int32_t next = p - f->Data;
+        if(p == end)
+          // There could be part of a start code on the end
+          next = f->Length - (ANNEXB_START_LENGTH - 1);
+        if(next > f->Scanned)
+          f->Scanned = next;
+        return;
+      }
+      const uint8_t *nal = p + ANNEXB_START_LENGTH;
+      int32_t at = p - f->Data;
+      // A four byte start code and any trailing zeros go with the next unit
+      while(at > f->Current && f->Data[at-1] == 0)
+        at--;
+      if(f->Picture && NalStartsAccessUnit(f->Codec,nal,nal + header,1))
+        EndUnit(f,at);
+      if(NalPicture(f->Codec,nal))
+        f->Picture = 1;
+      if(NalRandomAccess(f->Codec,nal,nal + header,1))
+        f->Key = 1;
+      f->Scanned = nal + header - f->Data;
+    }
+}
+// Copies complete units into decoder buffers, one each, starting
+// with Buffer. When no more buffers can be had as many as fit go into
+// the last one so the decoder keeps up. Whatever doesn't fit waits for
+// the next read.
+static void Emit(Framer f,void *Renderer,void *Buffer) {
+    int32_t size = RenderBufferSize(Renderer);
+
+    while(f->Units && Buffer) {
+      void *next = NULL;
+      int32_t length = f->Ends[0] - f->Sent;
+      int32_t done = 0;
+      int32_t flags = 0;
+      if(f->Units > 1 || length > size)
+        next = RenderReserveBuffer(Renderer,NULL);
+      if(length > size) {
+        if(!f->Partial)
+          f->Stats.Split++;
+        f->Partial = 1;
+        length = size;
+      }
+      else {
+        done = 1;
+        while(next == NULL && done < f->Units && f->Ends[done] - f->Sent <= size)
+          done++;
+        length = f->Ends[done-1] - f->Sent;
+        flags = RENDER_ENDOFFRAME;
+        f->Partial = 0;
+      }
+      memcpy(Buffer,f->Data + f->Sent,length);
+      if(f->Output)
+        f->Output(f->OutputData,Buffer,length,flags);
+      else
+        RenderProcessBuffer(Renderer,Buffer,length,flags);
+      f->Sent += length;
+      f->Units -= done;
+      memmove(f->Ends,f->Ends + done,f->Units * sizeof(f->Ends[0]));
+      Buffer = next;
+    }
+    if(Buffer)
+      RenderUnreserveBuffer(Renderer,Buffer);
+}
+// Moves what's left to the front
+static void Compact(Framer f) {
+    if(f->Sent == 0)
+      return;
+    memmove(f->Data,f->Data + f->Sent,f->Length - f->Sent);
+    f->Length -= f->Sent;
+    f->Scanned -= f->Sent;
+    f->Current -= f->Sent;
+    for(int32_t i = 0; i < f->Units; i++)
+      f->Ends[i] -= f->Sent;
+    f->Sent = 0;
+}
+// Makes room for Length more bytes
+static int Room(Framer f,int32_t Length) {
+    int32_t size = f->Size;
+
+    while(f->Length + Length > size && size < FRAMER_MAX)
+      size *= 2;
+    if(size > FRAMER_MAX)
+      size = FRAMER_MAX;
+    if(f->Length + Length > size)
+      return 0;
+    if(size != f->Size) {
+      uint8_t *data = realloc(f->Data,size);
+      if(data == NULL)
+        return 0;
+      f->Data = data;
+      f->Size = size;
+    }
+    return 1;
+}
+// Creates a framer for a Codec stream, complete units are published
+// to Fanout
+Framer FramerNew(const char *Name,VideoCodec Codec,void *Fanout) {
+    Framer f = calloc(1,sizeof(*f));
+    if(f == NULL)
+      return NULL;
+    f->Data = malloc(FRAMER_INITIAL);
+    if(f->Data == NULL) {
+      free(f);
+      return NULL;
+    }
+    f->Name = Name;
+    f->Codec = Codec;
+    f->Fanout = Fanout;
+    f->Size = FRAMER_INITIAL;
+    return f;
+}
+// Filled buffers go to Output rather than straight to the decoder,
+// for a framer run off the main loop
+void FramerSetOutput(Framer f,void (*Output)(void *,void *,int32_t,int32_t),void *Data) {
+    f->OutputData = Data;
+    f->Output = Output;
+}
+// Forget everything, call when the helper is (re)started
+void FramerReset(Framer f) {
+    f->Length = 0;
+    f->Sent = 0;
+    f->Scanned = 0;
+    f->Current = 0;
+    f->Picture = 0;
+    f->Key = 0;
+    f->Partial = 0;
+    f->Units = 0;
+}
+// Takes a buffer from RenderReserveBuffer with Length bytes from the
+// helper. The buffer is either reused for complete units or given back.
+// Returns the number of access units completed.
+int32_t FramerSubmit(Framer f,void *Renderer,void *Buffer,int32_t Length) {
+    if(f == NULL) {
+      RenderProcessBuffer(Renderer,Buffer,Length,0);
+      return 0;
+    }
+    uint64_t units = f->Stats.Units;
+    if(!Room(f,Length)) {
+      f->Stats.Overflows++;
+      printf("Camera %s: no access unit ends in %d bytes, dropping them\n",f->Name,f->Length);
+      FramerReset(f);
+    }
+    memcpy(f->Data + f->Length,Buffer,Length);
+    f->Length += Length;
+    Scan(f);
+    Emit(f,Renderer,Buffer);
+    Compact(f);
+    return f->Stats.Units - units;
+}
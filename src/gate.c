@@ -0,0 +1,211 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "render.h"
+#include "monitor.h"
+#include "nal.h"
+#include "framer.h"
+#include "gate.h"
+
+//
+// Key frame gate for cameras fed by a stream helper.
+//
+// A helper that has just started, or restarted, passes on whatever
+// the camera sends, usually starting part way through a group of
+// pictures. The decoder makes a mess of the P slices until the next
+// IDR so while the gate is closed the Annex B stream is scanned and
+// dropped, keeping only the latest parameter sets. At the first
+// picture the decoder can start from the sets go in ahead of it and
+// the gate opens. The scan works a byte at a time as start codes and
+// NAL headers can be split across reads.
+//
+// What gets through goes on to the camera's framer.
+//
+
+#define GATE_SETS           1024    // Parameter sets kept while closed
+#define START_CODE_LENGTH   4
+#define PEEK_LENGTH         3       // NAL header and the first body byte
+
+static const uint8_t StartCode[START_CODE_LENGTH] = { 0, 0, 0, 1 };
+
+struct _Gate {
+    const char *Name;
+    VideoCodec Codec;
+    Framer     Framer;
+    int32_t    Open;
+    int32_t    Zeros;               // Zero bytes just seen
+    int32_t    Peeked;              // Bytes of Peek filled, Needed when not looking
+    int32_t    Needed;              // Bytes of Peek to decide about a NAL unit
+    uint8_t    Peek[PEEK_LENGTH];
+    int32_t    Keeping;             // Bytes are going into Sets
+    int32_t    SetStart;            // Where the one being kept starts
+    int32_t    SetsLength;
+    uint8_t    Sets[GATE_SETS];     // With start codes
+    uint64_t   ClosedSince;         // Monotonic ms
+    uint64_t   Discarded;           // Bytes dropped since then
+    struct {
+      uint64_t Opens;
+      uint64_t Discarded;
+      uint32_t LastCleanMS;
+    } Stats;
+};
+
+// Sets are appended to as they arrive, dropping any that won't fit
+static void Keep(Gate g,const uint8_t *data,int32_t length) {
+    if(g->SetsLength + length > GATE_SETS) {
+      g->SetsLength = g->SetStart;
+      g->Keeping = 0;
+      return;
+    }
+    memcpy(g->Sets + g->SetsLength,data,length);
+    g->SetsLength += length;
+}
+// A whole NAL unit header has been seen. Returns non zero to open.
+static int Decide(Gate g) {
+    int32_t header = NalHeaderLength(g->Codec);
+
+    if(NalParameterSet(g->Codec,g->Peek)) {
+      if(NalFirstSet(g->Codec,g->Peek))
+        g->SetsLength = 0;
+      g->SetStart = g->SetsLength;
+      g->Keeping = 1;
+      Keep(g,StartCode,START_CODE_LENGTH);
+      Keep(g,g->Peek,g->Peeked);
+      return 0;
+    }
+    return NalRandomAccess(g->Codec,g->Peek,g->Peek + header,g->Peeked - header);
+}
+// Passes a buffer on to be framed for the decoder
+static int32_t Submit(Gate g,void *Renderer,void *Buffer,int32_t Length) {
+    return FramerSubmit(g ? g->Framer : NULL,Renderer,Buffer,Length);
+}
+// Opens the gate at a NAL unit whose header was just read, the rest
+// of it starts Rest bytes into Buffer. Returns the access units
+// completed.
+static int32_t Open(Gate g,void *Renderer,uint8_t *Buffer,int32_t Length,int32_t Rest) {
+    int32_t prefix = g->SetsLength + START_CODE_LENGTH + g->Peeked;
+    int32_t units = 0;
+
+    if(prefix > Rest) {
+      // No room in front so the sets and header need a buffer of their own
+      int32_t room;
+      uint8_t *sets = RenderReserveBuffer(Renderer,&room);
+      if(sets == NULL || room < prefix) {
+        printf("No buffer to start camera %s, waiting for the next key frame\n",g->Name);
+        if(sets)
+          RenderUnreserveBuffer(Renderer,sets);
+        g->Peeked = g->Needed;
+        return 0;
+      }
+      memcpy(sets,g->Sets,g->SetsLength);
+      memcpy(sets + g->SetsLength,StartCode,START_CODE_LENGTH);
+      memcpy(sets + g->SetsLength + START_CODE_LENGTH,g->Peek,g->Peeked);
+      units = Submit(g,Renderer,sets,prefix);
+      prefix = 0;
+    }
+    else {
+      memcpy(Buffer + Rest - prefix,g->Sets,g->SetsLength);
+      memcpy(Buffer + Rest - prefix + g->SetsLength,StartCode,START_CODE_LENGTH);
+      memcpy(Buffer + Rest - prefix + g->SetsLength + START_CODE_LENGTH,g->Peek,g->Peeked);
+    }
+    g->Open = 1;
+    g->Discarded += Rest - g->Peeked;
+    g->Stats.Opens++;
+    g->Stats.Discarded += g->Discarded;
+    g->Stats.LastCleanMS = MonitorNow() - g->ClosedSince;
+    printf("Camera %s: first clean frame after %u ms, %llu bytes discarded\n",
+           g->Name,g->Stats.LastCleanMS,(unsigned long long) g->Discarded);
+    // The decoder wants the data at the start of the buffer
+    if(Length - Rest + prefix == 0) {
+      RenderUnreserveBuffer(Renderer,Buffer);
+      return units;
+    }
+    memmove(Buffer,Buffer + Rest - prefix,Length - Rest + prefix);
+    return units + Submit(g,Renderer,Buffer,Length - Rest + prefix);
+}
+// Creates a gate, open until the first GateClose. What gets through
+// goes to Framer.
+Gate GateNew(const char *Name,VideoCodec Codec,void *Framer) {
+    Gate g = calloc(1,sizeof(*g));
+    if(g == NULL)
+      return NULL;
+    g->Name = Name;
+    g->Codec = Codec;
+    g->Framer = Framer;
+    g->Open = 1;
+    g->Needed = NalHeaderLength(Codec) + 1;
+    return g;
+}
+// Drop everything until the next picture the decoder can start from,
+// call when the helper is (re)started
+void GateClose(Gate g) {
+    g->Open = 0;
+    g->Zeros = 0;
+    g->Peeked = g->Needed;
+    g->Keeping = 0;
+    g->SetsLength = 0;
+    g->ClosedSince = MonitorNow();
+    g->Discarded = 0;
+}
+// Takes a buffer from RenderReserveBuffer with Length bytes from the
+// helper and passes it to the decoder once the gate is open. Returns
+// the access units completed.
+int32_t GateSubmit(Gate g,void *Renderer,void *Buffer,int32_t Length) {
+    uint8_t *data = Buffer;
+
+    if(g == NULL || g->Open) {
+      return Submit(g,Renderer,Buffer,Length);
+    }
+    for(int32_t i = 0; i < Length; i++) {
+      uint8_t b = data[i];
+      if(g->Peeked < g->Needed) {
+        g->Peek[g->Peeked++] = b;
+        if(g->Peeked == g->Needed && Decide(g)) {
+          int32_t units = Open(g,Renderer,data,Length,i + 1);
+          if(g->Open)
+            return units;
+        }
+        continue;
+      }
+      if(g->Keeping)
+        Keep(g,&b,1);
+      if(b == 0) {
+        g->Zeros++;
+        continue;
+      }
+      if(b == 1 && g->Zeros >= 2) {
+        // A start code, which ends any set being kept
+        if(g->Keeping) {
+          g->SetsLength--;
+          while(g->SetsLength > g->SetStart && g->Sets[g->SetsLength-1] == 0)
+            g->SetsLength--;
+          g->Keeping = 0;
+        }
+        g->Peeked = 0;
+      }
+      g->Zeros = 0;
+    }
+    g->Discarded += Length;
+    RenderUnreserveBuffer(Renderer,Buffer);
+    return 0;
+}
@@ -0,0 +1,25 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _GATE_H_INCLUDED_
+#define _GATE_H_INCLUDED_
+
+typedef struct _Gate *Gate;
+
+Gate GateNew(const char *,VideoCodec,void *);
+void GateClose(Gate);
+int32_t GateSubmit(Gate,void *,void *,int32_t);
+#endif
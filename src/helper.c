@@ -0,0 +1,232 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "monitor.h"
+#include "helper.h"
+
+//
+// Stream helper supervision.
+//
+// The helper is watched three ways. Its output closing is noticed by
+// whatever reads it. Its exit is noticed through a pidfd, which also
+// catches a helper whose children still hold the pipe open. And a
+// watchdog kills it when nothing has been read for StallTimeout. It
+// is then restarted after RespawnDelay, doubling with each failure in
+// a row up to RespawnMax, until data flows again.
+//
+// Helpers that have been killed are only ever waited for without
+// blocking, by the watchdog, so a new one never waits for the last.
+// Without pidfd (Linux before 5.3) the watchdog also polls for the
+// running helper exiting.
+//
+
+#define WATCHDOG_MIN        250     // Milliseconds between checks, at least
+#define WATCHDOG_IDLE       1000    // When there's no stall timeout
+
+static inline uint32_t WatchdogDelay(struct _Helper *h) {
+    if(h->StallTimeout <= 0)
+      return WATCHDOG_IDLE;
+    return h->StallTimeout / 4 > WATCHDOG_MIN ? h->StallTimeout / 4 : WATCHDOG_MIN;
+}
+// Everything read from the helper, however it is read
+static uint64_t BytesRead(Camera cam) {
+    struct _MonitorStats st;
+    uint64_t bytes = 0;
+
+    if(cam->Monitor) {
+      MonitorGetStats(cam->Monitor,&st);
+      bytes += st.Bytes;
+    }
+    if(cam->ShmMonitor) {
+      MonitorGetStats(cam->ShmMonitor,&st);
+      bytes += st.Bytes;
+    }
+    return bytes;
+}
+static void ClosePidFD(struct _Helper *h) {
+    if(h->PidFD < 0)
+      return;
+    MonitorClearReadFD((MonitorHandle) h->Monitor);
+    close(h->PidFD);
+    h->PidFD = -1;
+}
+// Waits for Pid if it has gone, without blocking. Returns non zero
+// if it has.
+static int Reap(Camera cam,pid_t Pid) {
+    struct _Helper *h = &cam->Helper;
+    int status;
+
+    if(Pid <= 0 || waitpid(Pid,&status,WNOHANG) != Pid)
+      return 0;
+    h->Stats.LastStatus = status;
+    if(WIFSIGNALED(status))
+      printf("Camera %s: helper %i killed by signal %i\n",cam->Name,Pid,WTERMSIG(status));
+    else
+      printf("Camera %s: helper %i exited with status %i\n",cam->Name,Pid,WEXITSTATUS(status));
+    for(int i = 0; i < HELPER_REAPING; i++)
+      if(h->Reaping[i] == Pid)
+        h->Reaping[i] = 0;
+    if(Pid == cam->Child) {
+      cam->Child = 0;
+      h->Dying = 0;
+      ClosePidFD(h);
+    }
+    return 1;
+}
+static void ReapAll(Camera cam) {
+    for(int i = 0; i < HELPER_REAPING; i++)
+      Reap(cam,cam->Helper.Reaping[i]);
+}
+// The helper has gone by itself. Its process group is shut down
+// while it is still a zombie, so the id can't have been reused.
+static void Exited(Camera cam) {
+    struct _Helper *h = &cam->Helper;
+    pid_t pid = cam->Child;
+
+    h->Stats.Exits++;
+    printf("Camera %s: helper %i has gone\n",cam->Name,pid);
+    h->Dying = 1;
+    h->Gone(cam);
+    Reap(cam,pid);
+}
+// The pidfd is readable
+static void PidFDReadable(MonitorHandle Handle,void *Data) {
+    Camera cam = Data;
+
+    if(cam->Child && !cam->Helper.Dying)
+      Exited(cam);
+    else
+      Reap(cam,cam->Child);
+}
+static void Watchdog(MonitorTimer t,void *data) {
+    Camera cam = data;
+    struct _Helper *h = &cam->Helper;
+    uint64_t bytes = BytesRead(cam);
+    uint64_t now = MonitorNow();
+    siginfo_t info;
+
+    ReapAll(cam);
+    if(h->PidFD < 0 && cam->Child) {
+      info.si_pid = 0;
+      if(h->Dying)
+        Reap(cam,cam->Child);
+      // Look without reaping, the zombie has to stay until Gone is done
+      else if(waitid(P_PID,cam->Child,&info,WEXITED|WNOHANG|WNOWAIT) == 0 && info.si_pid == cam->Child)
+        Exited(cam);
+    }
+    if(bytes != h->LastBytes) {
+      h->LastBytes = bytes;
+      h->LastData = now;
+      h->Failures = 0;
+      if(h->Stats.DownSince) {
+        h->Stats.LastDownMS = now - h->Stats.DownSince;
+        h->Stats.TotalDownMS += h->Stats.LastDownMS;
+        if(h->Stats.LastDownMS > h->Stats.MaxDownMS)
+          h->Stats.MaxDownMS = h->Stats.LastDownMS;
+        h->Stats.DownSince = 0;
+        printf("Camera %s: helper back after %llu ms (%llu starts, %llu exits, %llu stalls, %llu failovers)\n",
+               cam->Name,(unsigned long long) h->Stats.LastDownMS,
+               (unsigned long long) h->Stats.Starts,(unsigned long long) h->Stats.Exits,
+               (unsigned long long) h->Stats.Stalls,(unsigned long long) h->Stats.Failovers);
+      }
+    }
+    else if(cam->Child && !h->Dying && h->StallTimeout > 0 &&
+            now - h->LastData >= h->StallTimeout) {
+      h->Stats.Stalls++;
+      printf("Camera %s: nothing from the helper for %i ms\n",cam->Name,h->StallTimeout);
+      h->Dying = 1;
+      h->Gone(cam);
+    }
+    MonitorTimerReschedule(t,WatchdogDelay(h));
+}
+// Sets up supervision of the camera's helper. Gone is called to kill
+// the helper and close its stream.
+void HelperInit(Camera cam,void (*Gone)(Camera)) {
+    struct _Helper *h = &cam->Helper;
+
+    h->Gone = Gone;
+    h->PidFD = -1;
+    h->Monitor = MonitorNew(cam->Name);
+    MonitorClearReadFD((MonitorHandle) h->Monitor);
+    MonitorSetReadData((MonitorHandle) h->Monitor,cam);
+    MonitorSetReadCB((MonitorHandle) h->Monitor,PidFDReadable);
+    h->Watchdog = MonitorTimerAdd(WatchdogDelay(h),Watchdog,cam);
+}
+// Pid has been killed, wait for it from the watchdog
+void HelperReap(Camera cam,pid_t Pid) {
+    struct _Helper *h = &cam->Helper;
+
+    if(Reap(cam,Pid))
+      return;
+    for(int i = 0; i < HELPER_REAPING; i++)
+      if(h->Reaping[i] == 0) {
+        h->Reaping[i] = Pid;
+        return;
+      }
+    // Can't happen with RespawnDelay above the watchdog interval
+    printf("Camera %s: too many helpers exiting, %i left as a zombie\n",cam->Name,Pid);
+}
+// A new helper is running as cam->Child
+void HelperStarted(Camera cam) {
+    struct _Helper *h = &cam->Helper;
+
+    ReapAll(cam);
+    h->Dying = 0;
+    h->Stats.Starts++;
+    h->LastData = MonitorNow();
+    h->LastBytes = BytesRead(cam);
+#ifdef SYS_pidfd_open
+    h->PidFD = syscall(SYS_pidfd_open,cam->Child,0);
+#endif
+    if(h->PidFD >= 0)
+      MonitorSetReadFD((MonitorHandle) h->Monitor,h->PidFD);
+}
+// The helper's stream has been closed and it has been killed, or it
+// couldn't be started. Returns the milliseconds to wait before
+// starting another.
+uint32_t HelperStopped(Camera cam) {
+    struct _Helper *h = &cam->Helper;
+    uint32_t delay = h->RespawnDelay > HELPER_MIN_RESPAWN ? h->RespawnDelay : HELPER_MIN_RESPAWN;
+
+    for(uint32_t i = 0; i < h->Failures && delay < h->RespawnMax; i++)
+      delay *= 2;
+    if(delay > h->RespawnMax)
+      delay = h->RespawnMax;
+    h->Failures++;
+    // Its pidfd is for telling it has gone, it is waited for from now on
+    if(cam->Child) {
+      ClosePidFD(h);
+      HelperReap(cam,cam->Child);
+    }
+    h->Dying = 0;
+    if(h->Stats.DownSince == 0)
+      h->Stats.DownSince = MonitorNow();
+    // A little extra so cameras that went together don't come back together
+    return delay + rand() % (delay / 4 + 1);
+}
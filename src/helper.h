@@ -0,0 +1,26 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _HELPER_H_INCLUDED_
+#define _HELPER_H_INCLUDED_
+
+#define HELPER_MIN_RESPAWN  1000    // Milliseconds, the least RespawnDelay can be
+
+void     HelperInit(Camera,void (*)(Camera));
+void     HelperStarted(Camera);
+uint32_t HelperStopped(Camera);
+void     HelperReap(Camera,pid_t);
+#endif
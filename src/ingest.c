@@ -0,0 +1,284 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "render.h"
+#include "monitor.h"
+#include "gate.h"
+#include "framer.h"
+#include "ingest.h"
+
+//
+// Threaded ingest for cameras fed by a stream helper.
+//
+// Each camera gets a thread that reads the pipe straight into
+// decoder buffers and runs them through the camera's gate and
+// framer, which is where the per byte work is. The buffers of
+// whole access units are passed back to the main loop through a
+// lock free single producer/single consumer ring and the main loop
+// submits them to the decoder. This keeps a slow or bursting camera
+// from delaying every other camera and the remote control handling.
+// The gate and framer are only used by the main loop while the
+// thread isn't running.
+//
+// When there is no free decoder buffer, or the ring is full, the
+// thread sleeps on an eventfd of its own. The decoder freeing a
+// buffer or the main loop emptying the ring writes to it, but only
+// when the thread says it is waiting.
+//
+
+#define RING_SIZE     64            // Must be a power of 2
+#define RING_MASK     (RING_SIZE-1)
+
+typedef struct _RingEntry *RingEntry;
+struct _RingEntry {
+    void    *Buffer;
+    int32_t  Length;                // <= 0 means the stream has ended
+    int32_t  Flags;                 // For RenderProcessBuffer
+};
+struct _Ingest {
+    Camera    Camera;
+    int32_t   CPU;                  // CPU to pin the thread to, -1 for any
+    int       FD;
+    int       SpaceFD;              // eventfd the thread sleeps on
+    int32_t   Waiting;              // The thread is, or is about to be, asleep
+    pthread_t Thread;
+    int32_t   Running;
+    void    (*Closed)(Camera, void *);
+    void     *ClosedData;
+    Ingest    Next;
+    // Counted by the thread, and how much of that the main loop has
+    // added to the camera's monitor stats
+    uint64_t  Bytes, Reads, Frames;
+    uint64_t  Counted[3];
+    // The ring. Head is only written by the ingest thread
+    // and Tail only by the main loop
+    __attribute__((__aligned__(64)))
+    uint32_t  Head;
+    __attribute__((__aligned__(64)))
+    uint32_t  Tail;
+    struct _RingEntry Ring[RING_SIZE];
+};
+
+static Ingest        IngestList = NULL;
+static int           WakeFD = -1;
+static MonitorHandle WakeHandle = NULL;
+
+// Called by the ingest thread. Returns 0 if the ring is full
+static int RingPush(Ingest in,void *buffer,int32_t length,int32_t flags) {
+    uint32_t head = in->Head;
+    if(head - __atomic_load_n(&in->Tail,__ATOMIC_ACQUIRE) >= RING_SIZE)
+      return 0;
+    in->Ring[head & RING_MASK].Buffer = buffer;
+    in->Ring[head & RING_MASK].Length = length;
+    in->Ring[head & RING_MASK].Flags = flags;
+    __atomic_store_n(&in->Head,head+1,__ATOMIC_RELEASE);
+    return 1;
+}
+// Called by the main loop. Returns NULL if the ring is empty
+static RingEntry RingPeek(Ingest in) {
+    uint32_t tail = in->Tail;
+    if(tail == __atomic_load_n(&in->Head,__ATOMIC_ACQUIRE))
+      return NULL;
+    return &in->Ring[tail & RING_MASK];
+}
+static void RingPop(Ingest in) {
+    __atomic_store_n(&in->Tail,in->Tail+1,__ATOMIC_RELEASE);
+}
+static void Wake(void) {
+    uint64_t one = 1;
+    if(write(WakeFD,&one,sizeof(one)) < 0 && errno != EAGAIN)
+      perror("Ingest wake");
+}
+// There may be room for the thread now, called from any thread
+static void Space(void *arg) {
+    Ingest in = arg;
+    uint64_t one = 1;
+
+    // Pairs with the thread setting Waiting before its last try
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&in->Waiting,__ATOMIC_RELAXED) &&
+       write(in->SpaceFD,&one,sizeof(one)) < 0 && errno != EAGAIN)
+      perror("Ingest space");
+}
+// Called by the ingest thread once it has set Waiting and tried
+// again, so a wakeup in between can't be missed
+static void Sleep(Ingest in) {
+    uint64_t count;
+    if(read(in->SpaceFD,&count,sizeof(count)) < 0 && errno != EINTR)
+      perror("Ingest sleep");
+}
+static void *ReserveBuffer(Ingest in,int32_t *length) {
+    void *handle = in->Camera->RenderHandle;
+    void *buffer;
+
+    while( (buffer = RenderReserveBuffer(handle,length)) == NULL ) {
+      __atomic_store_n(&in->Waiting,1,__ATOMIC_SEQ_CST);
+      if( (buffer = RenderReserveBuffer(handle,length)) != NULL )
+        break;
+      Sleep(in);
+    }
+    __atomic_store_n(&in->Waiting,0,__ATOMIC_RELAXED);
+    return buffer;
+}
+static void Push(Ingest in,void *buffer,int32_t length,int32_t flags) {
+    while( !RingPush(in,buffer,length,flags) ) {
+      __atomic_store_n(&in->Waiting,1,__ATOMIC_SEQ_CST);
+      if(RingPush(in,buffer,length,flags))
+        break;
+      Sleep(in);
+    }
+    __atomic_store_n(&in->Waiting,0,__ATOMIC_RELAXED);
+}
+// The framer has filled a buffer, called on the ingest thread
+static void Output(void *arg,void *buffer,int32_t length,int32_t flags) {
+    Push(arg,buffer,length,flags);
+}
+static void *IngestThread(void *arg) {
+    Ingest in = arg;
+    Camera cam = in->Camera;
+    int32_t length = 0;
+
+    if(in->CPU >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(in->CPU,&cpus);
+      if( (errno = pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus)) != 0 )
+        printf("%s: unable to pin ingest to CPU %i: %s\n",cam->Name,in->CPU,strerror(errno));
+    }
+    for(;;) {
+      void *buffer = ReserveBuffer(in,&length);
+      length = read(in->FD,buffer,length);
+      if(length <= 0) {
+        RenderUnreserveBuffer(cam->RenderHandle,buffer);
+        break;
+      }
+      uint32_t head = in->Head;
+      int32_t frames = GateSubmit(cam->Gate,cam->RenderHandle,buffer,length);
+      __atomic_add_fetch(&in->Bytes,length,__ATOMIC_RELAXED);
+      __atomic_add_fetch(&in->Reads,1,__ATOMIC_RELAXED);
+      __atomic_add_fetch(&in->Frames,frames,__ATOMIC_RELAXED);
+      // Only wake the main loop when there is something for it
+      if(in->Head != head)
+        Wake();
+    }
+    // Tell the main loop the stream has ended
+    Push(in,NULL,length ? length : -1,0);
+    Wake();
+    return NULL;
+}
+// Submit everything the ingest threads have queued up
+static void IngestDrain(MonitorHandle Handle,void *Data) {
+    uint64_t count;
+    if(read(WakeFD,&count,sizeof(count)) < 0 && errno != EAGAIN)
+      perror("Ingest drain");
+    for(Ingest in = IngestList; in; in = in->Next) {
+      MonitorHandle h = in->Camera->Monitor;
+      uint64_t count[3] = { __atomic_load_n(&in->Bytes,__ATOMIC_RELAXED),
+                            __atomic_load_n(&in->Reads,__ATOMIC_RELAXED),
+                            __atomic_load_n(&in->Frames,__ATOMIC_RELAXED) };
+      MonitorAddBytes(h,count[0] - in->Counted[0]);
+      MonitorAddReads(h,count[1] - in->Counted[1]);
+      MonitorAddFrames(h,count[2] - in->Counted[2]);
+      memcpy(in->Counted,count,sizeof(count));
+      RingEntry re;
+      int popped = 0;
+      while( (re = RingPeek(in)) != NULL ) {
+        void   *buffer = re->Buffer;
+        int32_t length = re->Length;
+        int32_t flags = re->Flags;
+        RingPop(in);
+        popped = 1;
+        if(length > 0) {
+          RenderProcessBuffer(in->Camera->RenderHandle,buffer,length,flags);
+          continue;
+        }
+        // The thread has finished
+        printf("Read %i length something is wrong...\n",length);
+        pthread_join(in->Thread,NULL);
+        in->Running = 0;
+        in->FD = -1;
+        if(in->Closed)
+          in->Closed(in->Camera,in->ClosedData);
+        break;
+      }
+      // The thread may be waiting for room in the ring
+      if(popped)
+        Space(in);
+    }
+}
+// Create an ingest for a camera. Closed is called from the
+// main loop when the stream ends and the thread has exited.
+// The camera has to have a decoder to read into.
+Ingest IngestNew(Camera Cam,int32_t CPU,void (*Closed)(Camera, void *),void *Data) {
+    if(Cam->RenderHandle == NULL)
+      return NULL;
+    if(WakeFD < 0) {
+      if( (WakeFD = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ) {
+        printf("Unable to create ingest eventfd: %s\n",strerror(errno));
+        return NULL;
+      }
+      WakeHandle = MonitorNew("Ingest");
+      MonitorSetReadData(WakeHandle,NULL);
+      MonitorSetReadCB(WakeHandle,IngestDrain);
+      MonitorSetReadFD(WakeHandle,WakeFD);
+    }
+    Ingest in = calloc(1,sizeof(struct _Ingest));
+    if(in == NULL)
+      return NULL;
+    if( (in->SpaceFD = eventfd(0,EFD_CLOEXEC)) < 0 ) {
+      printf("Unable to create ingest eventfd: %s\n",strerror(errno));
+      free(in);
+      return NULL;
+    }
+    in->Camera = Cam;
+    in->CPU = CPU;
+    in->FD = -1;
+    in->Closed = Closed;
+    in->ClosedData = Data;
+    in->Next = IngestList;
+    IngestList = in;
+    RenderSetBufferFreed(Cam->RenderHandle,Space,in);
+    if(Cam->Framer)
+      FramerSetOutput(Cam->Framer,Output,in);
+    return in;
+}
+// Start reading from fd on the ingest thread
+int IngestStart(Ingest In,int FD) {
+    if(In == NULL || In->Running)
+      return -1;
+    In->FD = FD;
+    In->Head = In->Tail = 0;
+    if( (errno = pthread_create(&In->Thread,NULL,IngestThread,In)) != 0 ) {
+      printf("%s: unable to start ingest thread: %s\n",In->Camera->Name,strerror(errno));
+      In->FD = -1;
+      return -1;
+    }
+    In->Running = 1;
+    return 0;
+}
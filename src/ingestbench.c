@@ -0,0 +1,192 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+//
+// Benchmark comparing the ways of reading stream helper pipes:
+// epoll plus a read() per chunk, io_uring, and draining big pipes
+// with one readv() every DRAIN_INTERVAL ms.
+//
+// Each simulated camera is a thread writing to a pipe at a fixed
+// bitrate. The main thread reads them all and reports wakeups and
+// syscalls per second and CPU time per camera.
+//
+//   ingestbench [read|uring|sqpoll|drain] [cameras] [seconds] [kbit/s] [chunk]
+//
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#include "uring.h"
+
+#define BUFFER_SIZE   (80*1024)       // About the size of a decoder buffer
+#define BUFFER_COUNT  20
+#define DRAIN_BUFFERS 8
+#define DRAIN_INTERVAL 20             // ms
+#define PIPE_SIZE     (1024*1024)
+
+typedef struct _Camera *Camera;
+struct _Camera {
+    int       Pipe[2];
+    pthread_t Thread;
+    int32_t   Rate;                     // Bytes per second
+    int32_t   Chunk;                    // Bytes per write
+    volatile int Stop;
+    uint64_t  Bytes;
+    char      Buffer[BUFFER_COUNT][BUFFER_SIZE];
+    int32_t   Next;
+};
+
+static uint64_t NowNS(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static double ThreadCPU(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD,&ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+// Pretend to be ffmpeg
+static void *Writer(void *arg) {
+    Camera cam = arg;
+    char *chunk = calloc(1,cam->Chunk);
+    uint64_t start = NowNS();
+    uint64_t sent = 0;
+    while(!cam->Stop) {
+      uint64_t due = (NowNS() - start) * cam->Rate / 1000000000;
+      if(sent >= due) {
+        usleep(1000);
+        continue;
+      }
+      int n = write(cam->Pipe[1],chunk,cam->Chunk);
+      if(n <= 0)
+        break;
+      sent += n;
+    }
+    close(cam->Pipe[1]);
+    free(chunk);
+    return NULL;
+}
+// Decoder buffers are simulated by a small rotating pool
+static void *GetBuffer(void *data,int32_t *length) {
+    Camera cam = data;
+    *length = BUFFER_SIZE;
+    cam->Next = (cam->Next + 1) % BUFFER_COUNT;
+    return cam->Buffer[cam->Next];
+}
+static void Complete(void *data,void *buffer,int32_t length) {
+    Camera cam = data;
+    if(length > 0)
+      cam->Bytes += length;
+}
+int main(int ac,char *av[]) {
+    const char *mode = ac > 1 ? av[1] : "read";
+    int cameras  = ac > 2 ? atoi(av[2]) : 16;
+    int seconds  = ac > 3 ? atoi(av[3]) : 10;
+    int kbits    = ac > 4 ? atoi(av[4]) : 8000;
+    int chunk    = ac > 5 ? atoi(av[5]) : 4096;
+    uint64_t syscalls = 0, wakeups = 0;
+    int drain = strcmp(mode,"drain") == 0;
+    Uring ring = NULL;
+
+    Camera cam = calloc(cameras,sizeof(struct _Camera));
+    int epfd = epoll_create1(0);
+    if(strcmp(mode,"read") != 0 && !drain) {
+      if( (ring = UringNew(cameras*2,strcmp(mode,"sqpoll") == 0)) == NULL )
+        return 1;
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+      epoll_ctl(epfd,EPOLL_CTL_ADD,UringGetFD(ring),&ev);
+    }
+    for(int i=0; i < cameras; i++) {
+      if(pipe(cam[i].Pipe) < 0) {
+        perror("pipe");
+        return 1;
+      }
+      if(drain) {
+        fcntl(cam[i].Pipe[0],F_SETPIPE_SZ,PIPE_SIZE);
+        fcntl(cam[i].Pipe[0],F_SETFL,O_NONBLOCK);
+      }
+      cam[i].Rate  = kbits * 1000 / 8;
+      cam[i].Chunk = chunk;
+      if(ring)
+        UringAddSource(ring,cam[i].Pipe[0],GetBuffer,Complete,&cam[i]);
+      else {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &cam[i] };
+        epoll_ctl(epfd,EPOLL_CTL_ADD,cam[i].Pipe[0],&ev);
+      }
+      pthread_create(&cam[i].Thread,NULL,Writer,&cam[i]);
+    }
+    struct epoll_event events[cameras+1];
+    double cpu = ThreadCPU();
+    uint64_t start = NowNS(), end = start + (uint64_t) seconds * 1000000000;
+    while(NowNS() < end) {
+      int n = epoll_wait(epfd,events,cameras+1,100);
+      syscalls++;
+      if(n > 0)
+        wakeups++;
+      for(int i=0; i < n; i++) {
+        Camera c = events[i].data.ptr;
+        if(c == NULL) {
+          UringProcess(ring);
+          continue;
+        }
+        int32_t length;
+        if(drain) {
+          struct iovec iov[DRAIN_BUFFERS];
+          for(int j=0; j < DRAIN_BUFFERS; j++) {
+            iov[j].iov_base = GetBuffer(c,&length);
+            iov[j].iov_len = length;
+          }
+          ssize_t got = readv(c->Pipe[0],iov,DRAIN_BUFFERS);
+          syscalls++;
+          for(int j=0; got > 0 && j < DRAIN_BUFFERS; j++, got -= BUFFER_SIZE)
+            Complete(c,iov[j].iov_base,got < BUFFER_SIZE ? got : BUFFER_SIZE);
+          continue;
+        }
+        void *buffer = GetBuffer(c,&length);
+        length = read(c->Pipe[0],buffer,length);
+        syscalls++;
+        Complete(c,buffer,length);
+      }
+      // Let the pipes fill
+      if(drain)
+        usleep(DRAIN_INTERVAL * 1000);
+    }
+    cpu = ThreadCPU() - cpu;
+    double elapsed = (NowNS() - start) / 1e9;
+    syscalls += UringSyscalls(ring);
+    uint64_t bytes = 0;
+    for(int i=0; i < cameras; i++) {
+      bytes += cam[i].Bytes;
+      cam[i].Stop = 1;
+    }
+    printf("%-6s %3i cameras %6i kbit/s %6i byte chunks: %7.0f wakeups/s %9.0f syscalls/s "
+           "%7.1f syscalls/MB CPU %5.2f%% per camera (%.1f MB/s)\n",
+           mode,cameras,kbits,chunk,wakeups/elapsed,syscalls/elapsed,syscalls/(bytes/1e6),
+           cpu*100/elapsed/cameras,bytes/1e6/elapsed);
+    return 0;
+}
@@ -14,6 +14,7 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,19 +25,33 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <signal.h>
 #include <termios.h>
 #include <errno.h>
 #include <ctype.h>
+#include <spawn.h>
+#include <sys/syscall.h>
 #include <lirc_client.h>
 #include <curl/curl.h>
 
 #include "cctvplexer.h"
 #include "render.h"
 #include "monitor.h"
+#include "gate.h"
+#include "framer.h"
+#include "fanout.h"
+#include "ingest.h"
+#include "uring.h"
+#include "shmring.h"
+#include "helper.h"
 int Stop = 0;
 extern CURLM *CurlHandle;
+static Uring Ring = NULL;
+static int32_t DrainBudget;     // Bytes a wakeup may read in drain mode
+static int32_t DrainInterval;   // Milliseconds the pipe is left to fill
+static int32_t PipeSize;        // For stream helper pipes, 0 for the default
 
 static void sighandler(int iSignal) {
   printf("signal caught: %d - exiting\n", iSignal);
@@ -82,39 +97,177 @@ static void PTZOperation(Plexer p,KeyMap k) {
     }
     curl_multi_add_handle(CurlHandle,easy);
 }
-static pid_t RunStream(Camera cam) {
-    if(pipe(cam->StreamPipe) < 0) {
+// posix_spawn can close the descriptors a helper shouldn't have
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define SPAWN_CLOSEFROM
+#else
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+// Marks every descriptor from First up to be closed when a helper
+// starts, for C libraries whose posix_spawn can't close them itself
+static void CloseOnExec(int First) {
+#ifdef SYS_close_range
+    if(syscall(SYS_close_range,First,~0U,CLOSE_RANGE_CLOEXEC) == 0)
+      return;
+#endif
+    for(int i = First; i < 1000; i++)
+      fcntl(i,F_SETFD,FD_CLOEXEC);
+}
+#endif
+// The environment plus where to find the ring, freed with free()
+static char **ShmEnvironment(void) {
+    static char fd[] = SHM_ENV_FD "=3", efd[] = SHM_ENV_EVENTFD "=4";
+    int count = 0, i = 0;
+
+    while(environ[count])
+      count++;
+    char **env = calloc(count + 3,sizeof(char *));
+    if(env == NULL)
+      return NULL;
+    for(char **e = environ; *e; e++)
+      if(strncmp(*e,SHM_ENV_FD "=",sizeof(SHM_ENV_FD)) && strncmp(*e,SHM_ENV_EVENTFD "=",sizeof(SHM_ENV_EVENTFD)))
+        env[i++] = *e;
+    env[i++] = fd;
+    env[i++] = efd;
+    return env;
+}
+// Starts a helper with its stdout on a new pipe and returns its pid,
+// with the read end of the pipe in *FD. It gets stdin from /dev/null,
+// keeps stderr, has the ring (if any) as 3 and its eventfd as 4 and
+// nothing else. posix_spawn does this without copying the page tables
+// of the plexer and all its decoder buffers the way fork did.
+static pid_t SpawnHelper(Camera cam,ShmRing Shm,int *FD) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    char **env = environ;
+    int fds[2], shm = -1, efd = -1, first = 3, err;
+    pid_t pid = -1;
+
+    if(pipe2(fds,O_CLOEXEC) < 0) {
       printf("Error: Couldn't create pipe: %s\n",strerror(errno));
       return -1;
     }
-    if( (cam->Child = fork()) != 0 ) {
-      // Main process
-      if( cam->Child < 0 ) {
-        printf("Error: Couldn't fork process: %s\n",strerror(errno));
-        return -1;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    // In a group of its own so anything it starts goes with it
+    posix_spawnattr_setflags(&attr,POSIX_SPAWN_USEVFORK | POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr,0);
+    posix_spawn_file_actions_adddup2(&actions,fds[1],1);
+    posix_spawn_file_actions_addopen(&actions,0,"/dev/null",O_RDONLY,0);
+    if(Shm) {
+      // Copies above 4 so putting them in place can't clobber either
+      shm = fcntl(ShmRingFD(Shm),F_DUPFD_CLOEXEC,5);
+      efd = fcntl(ShmRingEventFD(Shm),F_DUPFD_CLOEXEC,5);
+      if(shm < 0 || efd < 0 || (env = ShmEnvironment()) == NULL) {
+        printf("Error: Couldn't pass the ring to %s: %s\n",cam->Name,strerror(errno));
+        env = NULL;
+        goto done;
       }
-      // Close the write end of the pipe
-      close(cam->StreamPipe[1]);
-      return cam->Child;
+      posix_spawn_file_actions_adddup2(&actions,shm,3);
+      posix_spawn_file_actions_adddup2(&actions,efd,4);
+      first = 5;
+    }
+#ifdef SPAWN_CLOSEFROM
+    posix_spawn_file_actions_addclosefrom_np(&actions,first);
+#else
+    CloseOnExec(first);
+#endif
+    if( (err = posix_spawn(&pid,cam->StreamCommand[0],&actions,&attr,cam->StreamCommand,env)) != 0 ) {
+      printf("Error: Couldn't run %s: %s\n",cam->StreamCommand[0],strerror(err));
+      pid = -1;
+    }
+done:
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if(env != environ)
+      free(env);
+    if(shm >= 0)
+      close(shm);
+    if(efd >= 0)
+      close(efd);
+    close(fds[1]);
+    if(pid < 0) {
+      close(fds[0]);
+      return -1;
     }
-    // This is the child process
-    // Close the read end
-    close(cam->StreamPipe[0]);
-    // close stdin
-    close(0);
-    // Set the stdout to write end of pipe
-    dup2(cam->StreamPipe[1],1);
-    // Set stdin as /dev/null
-    int infd = open("/dev/null",O_RDONLY);
-    // Close all other file descriptors (leave stderr)
-    for(int i = 3; i < 1000; i++)
-      close(i);
-    if(infd != 0)
-      dup2(infd,0);
-    execv(cam->StreamCommand[0],cam->StreamCommand);
-    fprintf(stderr,"Failed to execute %s: %s\n",cam->StreamCommand[0],strerror(errno));
-    exit(0);
-    return 0;
+    // Room for the helper to run ahead while the pipe isn't being read
+    if(PipeSize > 0 && fcntl(fds[0],F_SETPIPE_SZ,PipeSize) < 0)
+      printf("Couldn't make the pipe for %s %i bytes: %s\n",cam->Name,PipeSize,strerror(errno));
+    *FD = fds[0];
+    return pid;
+}
+static pid_t RunStream(Camera cam) {
+    // A new ring each time, the last helper may not be quite dead
+    if(cam->ShmSize && (cam->Shm = ShmRingNew(cam->Name,cam->ShmSize)) == NULL)
+      return -1;
+    cam->ShmKeyed = 0;
+    if( (cam->Child = SpawnHelper(cam,cam->Shm,&cam->StreamPipe[0])) < 0 ) {
+      ShmRingClose(cam->Shm);
+      cam->Shm = NULL;
+      return -1;
+    }
+    return cam->Child;
+}
+// The smallest of a camera's streams that fills its tile without
+// being scaled up, or the biggest if none of them do
+static int32_t PickStream(Camera c,CameraView v) {
+    int32_t width,height,i;
+
+    RenderGetDisplaySize(&width,&height);
+    if(!v->FullScreen) {
+      width = width * v->W + 0.5;
+      height = height * v->H + 0.5;
+    }
+    for(i=0; i < c->StreamCount-1; i++)
+      if(c->Stream[i].Width >= width && c->Stream[i].Height >= height)
+        break;
+    return i;
+}
+// Adds view to the list if it isn't the current one or already there
+static int32_t AddView(Plexer p,int32_t *views,int32_t count,int32_t view) {
+    if(view < 0 || view >= p->ViewCount || view == p->CurrentView)
+      return count;
+    for(int i=0; i < count; i++)
+      if(views[i] == view)
+        return count;
+    views[count] = view;
+    return count + 1;
+}
+// Keeps the streams that the views one key press away would switch
+// cameras to playing but not decoded, so switching to them is quick.
+// The next and previous views come first then those a remote has a
+// key for, as far as PrewarmBandwidth goes.
+static void Prewarm(Plexer p) {
+    int32_t views[p->ViewCount],warm[p->CameraCount];
+    int32_t count = 0,budget = p->PrewarmBandwidth;
+
+    count = AddView(p,views,count,(p->CurrentView+1) % p->ViewCount);
+    count = AddView(p,views,count,(p->CurrentView-1+p->ViewCount) % p->ViewCount);
+    for(int i=0; i < p->RemoteControlCount; i++)
+      for(int k=0; k < p->RemoteControl[i].KeyCount; k++)
+        if(p->RemoteControl[i].Key[k].OpCode == Op_SetView)
+          count = AddView(p,views,count,p->RemoteControl[i].Key[k].OpData1);
+    for(int i=0; i < p->CameraCount; i++)
+      warm[i] = -1;
+    for(int n=0; n < count && budget > 0; n++) {
+      Camera c = p->Camera;
+      CameraView v = p->View[views[n]].View;
+      for(int i=0; i < p->CameraCount; i++, v++, c++) {
+        if(!v->Visible || warm[i] >= 0 || c->StreamCount < 2 || !c->RTSP.Native)
+          continue;
+        // Already on the stream the view wants
+        int32_t index = PickStream(c,v);
+        if(index == c->StreamIndex || c->Stream[index].Bitrate > budget)
+          continue;
+        warm[i] = index;
+        budget -= c->Stream[index].Bitrate;
+      }
+    }
+    for(int i=0; i < p->CameraCount; i++)
+      if(p->Camera[i].StreamCount > 1)
+        RtspPrewarmStream(&p->Camera[i],warm[i]);
 }
 static void SetView(Plexer p,int32_t view) {
     if(p == NULL || view < 0 || view >= p->ViewCount)
@@ -147,14 +300,126 @@ static void SetView(Plexer p,int32_t view) {
       else {
         RendererSetRectangle(c->RenderHandle,v->X,v->Y,v->W,v->H,v->KeepAspect,v->Layer,v->Alpha);
       }
+      // Cameras that aren't shown stay on whatever they had
+      if(c->StreamCount > 1)
+        RtspSwitchStream(c,PickStream(c,v));
+    }
+    Prewarm(p);
+}
+//
+// Standby helpers. With StandbyHelper set a second helper is kept
+// connected to the camera with its output thrown away, so when the
+// one being shown goes it can take over straight away instead of
+// after a respawn delay and a fresh connection.
+//
+#define STANDBY_DELAY   1000    // Milliseconds after a helper starts before its standby does
+
+static void StandbyStop(Camera cam) {
+    struct _Helper *h = &cam->Helper;
+
+    if(h->StandbyChild) {
+      kill(-h->StandbyChild,SIGKILL);
+      HelperReap(cam,h->StandbyChild);
+      h->StandbyChild = 0;
+    }
+    if(h->StandbyFD >= 0) {
+      MonitorClearReadFD((MonitorHandle) h->StandbyMonitor);
+      close(h->StandbyFD);
+      h->StandbyFD = -1;
     }
 }
+static void ReadFromStandby(MonitorHandle Handle,void *Data) {
+    Camera cam = Data;
+    static char buffer[65536];
+
+    ssize_t length = read(cam->Helper.StandbyFD,buffer,sizeof(buffer));
+    if(length <= 0) {
+      printf("Camera %s: standby helper has gone\n",cam->Name);
+      StandbyStop(cam);
+      MonitorSetHouseKeepingDelay(Handle,cam->Helper.RespawnDelay);
+      return;
+    }
+    cam->Helper.StandbyData = MonitorNow();
+}
+static void HouseKeepStandby(MonitorHandle Handle,void *Data) {
+    Camera cam = Data;
+    struct _Helper *h = &cam->Helper;
+
+    // Only worth having while there's a helper to stand by for
+    if(h->StandbyChild || cam->Child == 0)
+      return;
+    if( (h->StandbyChild = SpawnHelper(cam,NULL,&h->StandbyFD)) < 0 ) {
+      h->StandbyChild = 0;
+      MonitorSetHouseKeepingDelay(Handle,h->RespawnDelay);
+      return;
+    }
+    h->StandbyData = MonitorNow();
+    MonitorSetReadFD(Handle,h->StandbyFD);
+}
+// Hands the stream to the standby, returns zero if there isn't a live one
+static int StandbyTakeOver(Camera cam) {
+    struct _Helper *h = &cam->Helper;
+
+    if(h->StandbyChild == 0)
+      return 0;
+    if(h->StallTimeout > 0 && MonitorNow() - h->StandbyData >= (uint64_t) h->StallTimeout) {
+      printf("Camera %s: standby helper has stalled\n",cam->Name);
+      StandbyStop(cam);
+      return 0;
+    }
+    MonitorClearReadFD((MonitorHandle) h->StandbyMonitor);
+    cam->Child = h->StandbyChild;
+    cam->StreamPipe[0] = h->StandbyFD;
+    h->StandbyChild = 0;
+    h->StandbyFD = -1;
+    h->Stats.Failovers++;
+    printf("Camera %s: standby helper %i taking over\n",cam->Name,cam->Child);
+    return 1;
+}
+// The stream from the helper has ended so clean up
+// and arrange for it to be respawned
+static void CameraStreamClosed(MonitorHandle Handle,Camera cam) {
+    // Show no mercy to the recalcitrant child, or its children
+    if(cam->Child)
+      kill(-cam->Child,SIGKILL);
+    // The supervisor reaps it and says when to try again
+    uint32_t delay = HelperStopped(cam);
+    // Close the pipe
+    close(cam->StreamPipe[0]);
+    cam->StreamPipe[0] = -1;
+    cam->Child = 0;
+    // Make sure dont get a readcallback
+    MonitorClearReadFD(Handle);
+    if(cam->Shm) {
+      MonitorClearReadFD((MonitorHandle) cam->ShmMonitor);
+      MonitorCancelHouseKeeping((MonitorHandle) cam->ShmMonitor);
+      ShmRingClose(cam->Shm);
+      cam->Shm = NULL;
+    }
+    // Set up a callback to respawn, or switch to the standby
+    MonitorSetHouseKeepingDelay(Handle,cam->Helper.StandbyChild ? 0 : delay);
+}
+// Called from the main loop when an ingest thread finishes
+static void IngestClosed(Camera cam,void *Data) {
+    CameraStreamClosed(Data,cam);
+}
+// The supervisor has found the helper dead or stuck. Readers on other
+// threads or in io_uring still have the pipe, so for those killing
+// the helper is enough and the end of the stream closes it.
+static void HelperGone(Camera cam) {
+    if(cam->Ingest || (Ring && cam->Shm == NULL)) {
+      if(cam->Child)
+        kill(-cam->Child,SIGKILL);
+    }
+    else
+      CameraStreamClosed(cam->Monitor,cam);
+}
 static void ReadFromCamera(MonitorHandle Handle,void *Data) {
     Camera cam = Data;
     char *buffer;
-    int  length;
+    int32_t length;
 
-    buffer = RenderGetBuffer(cam->RenderHandle,&length);
+    buffer = RenderReserveBuffer(cam->RenderHandle,&length);
     if(buffer == NULL) {
       printf("Error getting buffer for camera %s\n",cam->Name);
       return;
@@ -162,22 +427,184 @@ static void ReadFromCamera(MonitorHandle Handle,void *Data) {
     length=read(cam->StreamPipe[0],buffer,length);
     if(length <= 0) {
       printf("Read %i length something is wrong...\n",length);
-      // Show no mercy to the recalcitrant child
-      if(cam->Child)
-        kill(cam->Child,SIGKILL);
-      // Close the pipe
-      close(cam->StreamPipe[0]);
-      cam->StreamPipe[0] = -1;
-      cam->Child = 0;
-      // Make sure dont get a readcallback
-      MonitorClearReadFD(Handle);
-      // Set up a callback to respawn
-      MonitorSetHouseKeepingTime(Handle,time(NULL) + 10);
+      RenderUnreserveBuffer(cam->RenderHandle,buffer);
+      CameraStreamClosed(Handle,cam);
     }
     else {
-      RenderProcessBuffer(cam->RenderHandle,buffer,length,0);
+      MonitorAddBytes(Handle,length);
+      MonitorAddReads(Handle,1);
+      MonitorAddFrames(Handle,GateSubmit(cam->Gate,cam->RenderHandle,buffer,length));
     }
 }
+//
+// Drain mode. A wakeup reads everything the pipe holds, up to the
+// budget, into as many free decoder buffers as there are with one
+// readv(). The pipe is then left alone for DrainInterval so the next
+// wakeup finds several writes from the helper waiting, rather than
+// waking for every one. The pipe is made big enough in RunStream to
+// hold what arrives in the meantime.
+//
+#define DRAIN_BUFFERS   16
+
+static void DrainCamera(MonitorHandle Handle,void *Data) {
+    Camera cam = Data;
+    struct iovec iov[DRAIN_BUFFERS];
+    int32_t count = 0, total = 0, length;
+    ssize_t got;
+
+    while(count < DRAIN_BUFFERS && total < DrainBudget) {
+      iov[count].iov_base = RenderReserveBuffer(cam->RenderHandle,&length);
+      if(iov[count].iov_base == NULL)
+        break;
+      iov[count].iov_len = length;
+      total += length;
+      count++;
+    }
+    if(count == 0) {
+      printf("Error getting buffer for camera %s\n",cam->Name);
+      got = 0;
+    }
+    else {
+      // A signal isn't the helper going away
+      while((got = readv(cam->StreamPipe[0],iov,count)) < 0 && errno == EINTR)
+        ;
+      MonitorAddReads(Handle,1);
+      if(got == 0 || (got < 0 && errno != EAGAIN)) {
+        printf("Read %i length something is wrong...\n",(int) got);
+        for(int i = 0; i < count; i++)
+          RenderUnreserveBuffer(cam->RenderHandle,iov[i].iov_base);
+        CameraStreamClosed(Handle,cam);
+        return;
+      }
+    }
+    if(got > 0)
+      MonitorAddBytes(Handle,got);
+    for(int i = 0; i < count; i++) {
+      length = got < (ssize_t) iov[i].iov_len ? got : (ssize_t) iov[i].iov_len;
+      if(length <= 0) {
+        RenderUnreserveBuffer(cam->RenderHandle,iov[i].iov_base);
+        continue;
+      }
+      MonitorAddFrames(Handle,GateSubmit(cam->Gate,cam->RenderHandle,iov[i].iov_base,length));
+      got -= length;
+    }
+    if(DrainInterval > 0) {
+      MonitorClearReadFD(Handle);
+      MonitorSetHouseKeepingDelay(Handle,DrainInterval);
+    }
+}
+// io_uring wants a buffer for the next read
+static void *UringCameraBuffer(void *Data,int32_t *length) {
+    Camera cam = Data;
+    return RenderReserveBuffer(cam->RenderHandle,length);
+}
+// io_uring has completed a read
+static void UringCameraRead(void *Data,void *buffer,int32_t length) {
+    Camera cam = Data;
+    if(length <= 0) {
+      printf("Read %i length something is wrong...\n",length);
+      RenderUnreserveBuffer(cam->RenderHandle,buffer);
+      CameraStreamClosed(cam->Monitor,cam);
+      return;
+    }
+    MonitorAddBytes((MonitorHandle) cam->Monitor,length);
+    GateSubmit(cam->Gate,cam->RenderHandle,buffer,length);
+}
+//
+// Shared memory transport. The helper writes whole access units into
+// the ring and the stream pipe only tells us when it has gone, so
+// anything it does write is thrown away.
+//
+#define SHM_MAX_BUFFERS 16      // Decoder buffers one unit may take
+
+static void ReadFromHelper(MonitorHandle Handle,void *Data) {
+    Camera cam = Data;
+    char buffer[4096];
+
+    ssize_t length = read(cam->StreamPipe[0],buffer,sizeof(buffer));
+    if(length <= 0) {
+      printf("Read %i length something is wrong...\n",(int) length);
+      CameraStreamClosed(Handle,cam);
+    }
+}
+// Copies a unit into as many decoder buffers as it takes, all or none.
+// Returns zero if there aren't enough free.
+static int SubmitUnit(Camera cam,ShmUnit unit) {
+    void *buffers[SHM_MAX_BUFFERS];
+    int32_t size = RenderBufferSize(cam->RenderHandle);
+    int32_t count = 0;
+
+    for(int32_t left = unit->Length; left > 0; left -= size) {
+      if(count == SHM_MAX_BUFFERS || size <= 0 ||
+         (buffers[count] = RenderReserveBuffer(cam->RenderHandle,NULL)) == NULL) {
+        while(count)
+          RenderUnreserveBuffer(cam->RenderHandle,buffers[--count]);
+        return 0;
+      }
+      count++;
+    }
+    for(int32_t i = 0; i < count; i++) {
+      int32_t offset = i * size;
+      int32_t length = unit->Length - offset < size ? unit->Length - offset : size;
+      memcpy(buffers[i],unit->Data + offset,length);
+      RenderSetTimeStamp(cam->RenderHandle,buffers[i],unit->PTS);
+      RenderProcessBuffer(cam->RenderHandle,buffers[i],length,i == count - 1 ? RENDER_ENDOFFRAME : 0);
+    }
+    return 1;
+}
+// The helper has written to the ring
+static void ReadFromShm(MonitorHandle Handle,void *Data) {
+    Camera cam = Data;
+    struct _ShmUnit unit;
+    uint64_t count;
+    int got;
+
+    if(cam->Shm == NULL)
+      return;
+    if(read(ShmRingEventFD(cam->Shm),&count,sizeof(count)) > 0)
+      MonitorAddReads(Handle,1);
+    while( (got = ShmRingPeek(cam->Shm,&unit)) != 0 ) {
+      if(got < 0) {
+        // Treated like the helper going, it gets restarted
+        printf("Camera %s: the helper has corrupted its ring\n",cam->Name);
+        CameraStreamClosed(cam->Monitor,cam);
+        return;
+      }
+      // The decoder starts at a key frame
+      if(!cam->ShmKeyed && !(unit.Flags & SHM_KEY)) {
+        MonitorAddBytes(Handle,unit.Length);
+        ShmRingPop(cam->Shm);
+        continue;
+      }
+      if(unit.Length > SHM_MAX_BUFFERS * RenderBufferSize(cam->RenderHandle)) {
+        printf("Camera %s: dropping a %i byte frame\n",cam->Name,unit.Length);
+        MonitorAddBytes(Handle,unit.Length);
+        ShmRingPop(cam->Shm);
+        continue;
+      }
+      if(!SubmitUnit(cam,&unit)) {
+        // Nothing else will wake us up for what's left
+        MonitorSetHouseKeepingDelay(Handle,5);
+        return;
+      }
+      cam->ShmKeyed = 1;
+      FanoutPublish(cam->Fanout,unit.Data,unit.Length,
+                    FANOUT_FRAMED | (unit.Flags & SHM_KEY ? FANOUT_KEY : 0));
+      MonitorAddBytes(Handle,unit.Length);
+      MonitorAddFrames(Handle,1);
+      ShmRingPop(cam->Shm);
+    }
+}
+// The ring has completions
+static void ReadFromUring(MonitorHandle Handle,void *Data) {
+    // If a camera is waiting for a decoder buffer come back
+    // shortly, nothing else will wake us up for it
+    if(UringProcess(Ring))
+      MonitorSetHouseKeepingDelay(Handle,5);
+}
+static void HouseKeepUring(MonitorHandle Handle,void *Data) {
+    ReadFromUring(Handle,Data);
+}
 static void ReadImage(MonitorHandle Handle,void *Data) {
     char *buffer;
     int  length,maxlength;
@@ -195,6 +622,7 @@ static void ReadImage(MonitorHandle Handle,void *Data) {
       RenderProcessBuffer(Data,buffer,0,1);
     }
     else {
+      MonitorAddBytes(Handle,length);
       RenderProcessBuffer(Data,buffer,length,length < maxlength ? 1 : 0);
     }
 }
@@ -203,13 +631,40 @@ static void HouseKeepCamera(MonitorHandle Handle,void *Data) {
     printf("Housekeeping for %s\n",cam->Name);
     // Why have I been called?
     if( cam->StreamPipe[0] < 0 ) {
-      // Its to (re)connect to the camera
-      RunStream(cam);
+      // Its to (re)connect to the camera, which starts anywhere
+      // in the stream
+      if(cam->Gate)
+        GateClose(cam->Gate);
+      if(cam->Framer)
+        FramerReset(cam->Framer);
+      if(!StandbyTakeOver(cam))
+        RunStream(cam);
       // Child will be zero on error so try again later
-      if(cam->Child == 0)
-        MonitorSetHouseKeepingTime(Handle,time(NULL) + 10);
-      else
+      if(cam->Child <= 0) {
+        cam->Child = 0;
+        MonitorSetHouseKeepingDelay(Handle,HelperStopped(cam));
+        return;
+      }
+      HelperStarted(cam);
+      if(cam->Helper.StandbyMonitor && cam->Helper.StandbyChild == 0)
+        MonitorSetHouseKeepingDelay((MonitorHandle) cam->Helper.StandbyMonitor,STANDBY_DELAY);
+      if(cam->Shm) {
+        MonitorSetReadFD((MonitorHandle) cam->ShmMonitor,ShmRingEventFD(cam->Shm));
         MonitorSetReadFD(Handle,cam->StreamPipe[0]);
+      }
+      else if(cam->Ingest)
+        IngestStart(cam->Ingest,cam->StreamPipe[0]);
+      else if(Ring)
+        UringAddSource(Ring,cam->StreamPipe[0],UringCameraBuffer,UringCameraRead,cam);
+      else {
+        if(DrainBudget)
+          fcntl(cam->StreamPipe[0],F_SETFL,fcntl(cam->StreamPipe[0],F_GETFL) | O_NONBLOCK);
+        MonitorSetReadFD(Handle,cam->StreamPipe[0]);
+      }
+    }
+    else if(DrainBudget && MonitorGetReadFD(Handle) < 0) {
+      // The drain interval is up
+      MonitorSetReadFD(Handle,cam->StreamPipe[0]);
     }
     else {
       printf("Dont know why HouseKeep called for %s\n",cam->Name);
@@ -225,7 +680,7 @@ static void ReadFromLirc(MonitorHandle Handle,void *Data) {
       // to reopen it later
       close(MonitorGetReadFD(Handle));
       MonitorClearReadFD(Handle);
-      MonitorSetHouseKeepingTime(Handle,time(NULL) + 10);
+      MonitorSetHouseKeepingDelay(Handle,10000);
       return;
     }
     if(lirccode == NULL) {
@@ -331,7 +786,7 @@ static void HouseKeepLirc(MonitorHandle Handle,void *Data) {
       int fd = lirc_init("cctvplexer",0);
       if(fd < 0) {
         perror("Error initialising lirc");
-        MonitorSetHouseKeepingTime(Handle,time(NULL) + 10);
+        MonitorSetHouseKeepingDelay(Handle,10000);
       }
       else {
         MonitorSetReadFD(Handle,fd);
@@ -388,10 +843,31 @@ int main(int ac, char *av[]) {
       return -1;
     }
     // Initialiase FD monitoring
-    MonitorInitialise();
+    MonitorInitialise(plexer->EventLoop);
+    if(plexer->StatsInterval > 0)
+      MonitorSetStatsInterval(plexer->StatsInterval * 1000);
+    PipeSize = plexer->PipeSize;
+    if(plexer->IngestMethod == INGEST_DRAIN) {
+      DrainBudget = plexer->DrainBudget;
+      DrainInterval = plexer->DrainInterval;
+    }
+    // Use io_uring for the stream helpers if wanted and available
+    if(plexer->IngestMethod == INGEST_URING || plexer->IngestMethod == INGEST_URING_SQPOLL) {
+      Ring = UringNew(plexer->CameraCount * 2 + 2,plexer->IngestMethod == INGEST_URING_SQPOLL);
+      if(Ring == NULL) {
+        printf("Using read for stream helpers\n");
+      }
+      else {
+        h = MonitorNew("io_uring");
+        MonitorSetReadCB(h,ReadFromUring);
+        MonitorSetHouseKeepingCB(h,HouseKeepUring);
+        MonitorSetReadFD(h,UringGetFD(Ring));
+      }
+    }
     // Assign each camera a render handle
     for(int i=0; i < plexer->CameraCount; i++) {
-      plexer->Camera[i].RenderHandle = RenderNew(plexer->Camera[i].Name,0);
+      plexer->Camera[i].RenderHandle = RenderNew(plexer->Camera[i].Name,0,plexer->Camera[i].Codec);
+      plexer->Camera[i].Fanout = FanoutNew(plexer->Camera[i].Name);
       if( plexer->Camera[i].RenderHandle == NULL ) {
         printf("Unable to assign render handle to %s(%i). Camera will not display\n",
                                   plexer->Camera[i].Name,i);
@@ -416,25 +892,64 @@ int main(int ac, char *av[]) {
     // Set the initial view
     SetView(plexer,0);
     // Set up the CCTV streams
+    RtspSetStartupConcurrency(plexer->StartupConcurrency);
     for(int i=0; i < plexer->CameraCount; i++) {
       if(plexer->Camera[i].RTSP.URL) {
         printf("RTSP Method for %s\n",plexer->Camera[i].Name);
-        RtspStartStream(&plexer->Camera[i]);
+        if(plexer->Camera[i].RTSP.Native)
+          RtspNativeStartStream(&plexer->Camera[i]);
+        else
+          RtspStartStream(&plexer->Camera[i]);
       }
       else if(plexer->Camera[i].StreamCommand) {
+        // There's nothing to take the video from a helper
+        if(plexer->Camera[i].RenderHandle == NULL) {
+          printf("No decoder for camera %s, its stream helper won't be started\n",plexer->Camera[i].Name);
+          continue;
+        }
         plexer->Camera[i].StreamPipe[0] = -1;
         h = MonitorNew(plexer->Camera[i].Name);
+        plexer->Camera[i].Monitor = h;
         MonitorClearReadFD(h);
         MonitorSetReadData(h,&plexer->Camera[i]);
-        MonitorSetReadCB(h,ReadFromCamera);
-        MonitorSetHouseKeepingTime(h,time(NULL));
+        MonitorSetReadCB(h,DrainBudget ? DrainCamera : ReadFromCamera);
+        MonitorSetHouseKeepingDelay(h,0);
         MonitorSetHouseKeepingData(h,&plexer->Camera[i]);
         MonitorSetHouseKeepingCB(h,HouseKeepCamera);
+        HelperInit(&plexer->Camera[i],HelperGone);
+        if(plexer->Camera[i].Helper.Standby) {
+          plexer->Camera[i].Helper.StandbyFD = -1;
+          h = MonitorNew(plexer->Camera[i].Name);
+          plexer->Camera[i].Helper.StandbyMonitor = h;
+          MonitorClearReadFD(h);
+          MonitorSetReadData(h,&plexer->Camera[i]);
+          MonitorSetReadCB(h,ReadFromStandby);
+          MonitorSetHouseKeepingData(h,&plexer->Camera[i]);
+          MonitorSetHouseKeepingCB(h,HouseKeepStandby);
+          h = plexer->Camera[i].Monitor;
+        }
+        if(plexer->Camera[i].ShmSize) {
+          MonitorSetReadCB(h,ReadFromHelper);
+          h = MonitorNew(plexer->Camera[i].Name);
+          plexer->Camera[i].ShmMonitor = h;
+          MonitorClearReadFD(h);
+          MonitorSetReadData(h,&plexer->Camera[i]);
+          MonitorSetReadCB(h,ReadFromShm);
+          MonitorSetHouseKeepingData(h,&plexer->Camera[i]);
+          MonitorSetHouseKeepingCB(h,ReadFromShm);
+          continue;
+        }
+        plexer->Camera[i].Framer = FramerNew(plexer->Camera[i].Name,plexer->Camera[i].Codec,plexer->Camera[i].Fanout);
+        plexer->Camera[i].Gate = GateNew(plexer->Camera[i].Name,plexer->Camera[i].Codec,plexer->Camera[i].Framer);
+        if(plexer->Camera[i].IngestThread)
+          plexer->Camera[i].Ingest = IngestNew(&plexer->Camera[i],plexer->Camera[i].IngestCPU,IngestClosed,h);
       }
       else {
         printf("No Stream method defined for camera %s\n",plexer->Camera[i].Name);
       }
     }
+    // Now there are sessions to keep warm
+    Prewarm(plexer);
     // Setup stdin for one character at a time 
     struct termios backup, raw;
     tcgetattr(STDIN_FILENO, &backup);
@@ -451,7 +966,7 @@ int main(int ac, char *av[]) {
     MonitorClearReadFD(h);
     MonitorSetReadData(h,plexer);
     MonitorSetReadCB(h,ReadFromLirc);
-    MonitorSetHouseKeepingTime(h,time(NULL));
+    MonitorSetHouseKeepingDelay(h,0);
     MonitorSetHouseKeepingData(h,plexer);
     MonitorSetHouseKeepingCB(h,HouseKeepLirc);
     // Loop forever displaying the cameras
@@ -463,6 +978,10 @@ int main(int ac, char *av[]) {
     tcsetattr(STDIN_FILENO, TCSANOW, &backup);
     // Release everything
     for(int i=0; i < plexer->CameraCount; i++) {
+      if(plexer->Camera[i].RTSP.Native)
+        RtspNativeStopStream(&plexer->Camera[i]);
+      else if(plexer->Camera[i].RTSP.URL)
+        RtspStopStream(&plexer->Camera[i]);
       RenderRelease(plexer->Camera[i].RenderHandle);
     }
     RenderDeInitialise();
@@ -0,0 +1,91 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#include "md5.h"
+
+//
+// MD5 (RFC 1321). Only needed for RTSP digest authentication
+// so it just does a whole message at once.
+//
+
+#define ROTL(x,n)   (((x) << (n)) | ((x) >> (32-(n))))
+
+static const uint32_t K[64] = {
+    0xd76aa478,0xe8c7b756,0x242070db,0xc1bdceee,0xf57c0faf,0x4787c62a,0xa8304613,0xfd469501,
+    0x698098d8,0x8b44f7af,0xffff5bb1,0x895cd7be,0x6b901122,0xfd987193,0xa679438e,0x49b40821,
+    0xf61e2562,0xc040b340,0x265e5a51,0xe9b6c7aa,0xd62f105d,0x02441453,0xd8a1e681,0xe7d3fbc8,
+    0x21e1cde6,0xc33707d6,0xf4d50d87,0x455a14ed,0xa9e3e905,0xfcefa3f8,0x676f02d9,0x8d2a4c8a,
+    0xfffa3942,0x8771f681,0x6d9d6122,0xfde5380c,0xa4beea44,0x4bdecfa9,0xf6bb4b60,0xbebfbc70,
+    0x289b7ec6,0xeaa127fa,0xd4ef3085,0x04881d05,0xd9d4d039,0xe6db99e5,0x1fa27cf8,0xc4ac5665,
+    0xf4292244,0x432aff97,0xab9423a7,0xfc93a039,0x655b59c3,0x8f0ccc92,0xffeff47d,0x85845dd1,
+    0x6fa87e4f,0xfe2ce6e0,0xa3014314,0x4e0811a1,0xf7537e82,0xbd3af235,0x2ad7d2bb,0xeb86d391
+};
+static const uint8_t R[64] = {
+    7,12,17,22,7,12,17,22,7,12,17,22,7,12,17,22,
+    5, 9,14,20,5, 9,14,20,5, 9,14,20,5, 9,14,20,
+    4,11,16,23,4,11,16,23,4,11,16,23,4,11,16,23,
+    6,10,15,21,6,10,15,21,6,10,15,21,6,10,15,21
+};
+static void Block(uint32_t *h,const uint8_t *p) {
+    uint32_t w[16],a = h[0],b = h[1],c = h[2],d = h[3];
+    for(int i=0; i < 16; i++)
+      w[i] = p[i*4] | (p[i*4+1] << 8) | (p[i*4+2] << 16) | ((uint32_t) p[i*4+3] << 24);
+    for(int i=0; i < 64; i++) {
+      uint32_t f,g;
+      if(i < 16)      { f = (b & c) | (~b & d); g = i; }
+      else if(i < 32) { f = (d & b) | (~d & c); g = (5*i + 1) % 16; }
+      else if(i < 48) { f = b ^ c ^ d;          g = (3*i + 5) % 16; }
+      else            { f = c ^ (b | ~d);       g = (7*i) % 16; }
+      f += a + K[i] + w[g];
+      a = d;
+      d = c;
+      c = b;
+      b += ROTL(f,R[i]);
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+// Hash Length bytes of Data and write the digest as
+// lower case hex into Hex (at least MD5_HEX_LENGTH long)
+void MD5Hex(const void *Data,uint32_t Length,char *Hex) {
+    uint32_t h[4] = { 0x67452301,0xefcdab89,0x98badcfe,0x10325476 };
+    const uint8_t *p = Data;
+    uint8_t tail[128];
+    uint32_t n;
+
+    for(n = Length; n >= 64; n -= 64, p += 64)
+      Block(h,p);
+    // Pad with 0x80, zeros and the length in bits
+    memset(tail,0,sizeof(tail));
+    memcpy(tail,p,n);
+    tail[n] = 0x80;
+    uint32_t tl = n < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t) Length * 8;
+    for(int i=0; i < 8; i++)
+      tail[tl-8+i] = bits >> (i*8);
+    Block(h,tail);
+    if(tl == 128)
+      Block(h,tail+64);
+    for(int i=0; i < 16; i++) {
+      static const char hex[] = "0123456789abcdef";
+      uint8_t byte = h[i/4] >> ((i%4)*8);
+      Hex[i*2]   = hex[byte >> 4];
+      Hex[i*2+1] = hex[byte & 15];
+    }
+    Hex[32] = 0;
+}
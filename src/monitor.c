@@ -16,209 +16,722 @@
 */
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <assert.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <curl/curl.h>
+#include "cctvplexer.h"
 #include "monitor.h"
 
-#define MAX_MONITORS      64
+#define MIN_MONITORS      16
 #define FLG_USED          0x0001
 
-CURLM *CurlHandle = NULL;
+// Things that can be registered with epoll. Both structures
+// start with a _PollEntry so the epoll data pointer can be
+// cast to either once the type is known.
+#define PE_MONITOR        1
+#define PE_CURL           2
+
+typedef struct _PollEntry *PollEntry;
+struct _PollEntry {
+    uint32_t Type;              // PE_MONITOR or PE_CURL
+    int      FD;                // The fd registered with epoll, -1 if none
+    uint32_t Events;            // The events registered with epoll
+    PollEntry Next;             // Used to defer freeing curl entries
+};
 typedef struct _MonList *MonList;
 struct _MonList {
-    struct _MonitorHandle Handle;
+    struct _MonitorHandle Handle;       // Must be first, MonitorHandle is really a MonList
+    struct _PollEntry Poll;
     uint32_t Flags;
 };
-struct _MonList Monitor[MAX_MONITORS];
-struct curl_waitfd CurlExtraFD[MAX_MONITORS];
 
-uint32_t  MaxInUse = 0;
+CURLM *CurlHandle = NULL;
+// The registry of monitors. It grows as required and
+// the handles themselves never move so pointers given
+// out by MonitorNew remain valid until released.
+static MonList  *Monitor = NULL;
+static uint32_t  MonitorCount = 0;
+static uint32_t  MonitorSize  = 0;
+// The event loop backend
+static EventLoop Backend = EVENT_LOOP_SELECT;
+static int       EpollFD = -1;
+static struct epoll_event *EpollEvents = NULL;
+static int       EpollEventsSize = 0;
+// When curl wants to be called back (monotonic ms), 0 = never
+static uint64_t  CurlDeadline = 0;
+// The timers in a min-heap ordered by When
+static MonitorTimer *TimerHeap = NULL;
+static int32_t   TimerCount = 0;
+static int32_t   TimerSize  = 0;
+// Functions posted from other threads to be run on the main
+// loop. Posters push onto PostList with a compare and swap and
+// the main loop takes the whole list in one go so no locks are
+// needed. PostFD is an eventfd that wakes the main loop.
+typedef struct _PostEntry *PostEntry;
+struct _PostEntry {
+    void    (*Function)(void *);
+    void     *Data;
+    PostEntry Next;
+};
+static PostEntry     PostList = NULL;
+static int           PostFD = -1;
+static MonitorHandle PostHandle = NULL;
+// Main loop statistics and the timer used to dump them
+static struct _MonitorLoopStats LoopStats;
+static MonitorTimer StatsTimer = NULL;
+static uint32_t     StatsInterval = 0;
+// Curl sockets that have been removed but might still be
+// referenced by events waiting to be dispatched
+static PollEntry CurlRemoved = NULL;
+
+// Monotonic clock in milliseconds. Unlike time(NULL) this
+// doesn't jump when NTP sets the clock.
+uint64_t MonitorNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+// Monotonic clock in nanoseconds for the statistics
+static inline uint64_t NowNS(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+// Add a duration to a log2 microsecond histogram
+static inline void HistogramAdd(uint32_t *h,uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    h[bucket < MONITOR_HIST_BUCKETS ? bucket : MONITOR_HIST_BUCKETS-1]++;
+}
+// Call the read callback of a handle and account for it
+static inline void MonitorCallRead(MonitorHandle mh) {
+    uint64_t start = NowNS();
+    mh->ReadCB(mh,mh->ReadCBData);
+    uint64_t ns = NowNS() - start;
+    mh->Stats.Callbacks++;
+    mh->Stats.TimeNS += ns;
+    if(ns > mh->Stats.MaxNS)
+      mh->Stats.MaxNS = ns;
+    HistogramAdd(mh->Stats.Histogram,ns);
+}
+//
+// Timer heap. TimerHeap[0] is always the next timer due
+// so finding the next deadline is O(1) and adding, removing
+// and rescheduling are O(log n).
+//
+static void TimerPlace(int32_t i,MonitorTimer t) {
+    TimerHeap[i] = t;
+    t->Index = i;
+}
+static void TimerSiftUp(int32_t i) {
+    MonitorTimer t = TimerHeap[i];
+    while(i > 0) {
+      int32_t parent = (i-1)/2;
+      if(TimerHeap[parent]->When <= t->When)
+        break;
+      TimerPlace(i,TimerHeap[parent]);
+      i = parent;
+    }
+    TimerPlace(i,t);
+}
+static void TimerSiftDown(int32_t i) {
+    MonitorTimer t = TimerHeap[i];
+    for(;;) {
+      int32_t child = i*2 + 1;
+      if(child >= TimerCount)
+        break;
+      if(child+1 < TimerCount && TimerHeap[child+1]->When < TimerHeap[child]->When)
+        child++;
+      if(t->When <= TimerHeap[child]->When)
+        break;
+      TimerPlace(i,TimerHeap[child]);
+      i = child;
+    }
+    TimerPlace(i,t);
+}
+static void TimerUnschedule(MonitorTimer t) {
+    int32_t i = t->Index;
+    if(i < 0)
+      return;
+    t->Index = -1;
+    if(--TimerCount == i)
+      return;
+    // Fill the hole with the last timer and restore the heap
+    TimerPlace(i,TimerHeap[TimerCount]);
+    if(i > 0 && TimerHeap[(i-1)/2]->When > TimerHeap[i]->When)
+      TimerSiftUp(i);
+    else
+      TimerSiftDown(i);
+}
+static void TimerSchedule(MonitorTimer t,uint64_t when) {
+    TimerUnschedule(t);
+    t->When = when;
+    if(TimerCount >= TimerSize) {
+      int32_t size = TimerSize ? TimerSize * 2 : MIN_MONITORS;
+      MonitorTimer *h = realloc(TimerHeap,size * sizeof(MonitorTimer));
+      if(h == NULL) {
+        printf("Unable to allocate memory for timer\n");
+        return;
+      }
+      TimerHeap = h;
+      TimerSize = size;
+    }
+    TimerPlace(TimerCount,t);
+    TimerSiftUp(TimerCount++);
+}
+MonitorTimer MonitorTimerAdd(uint32_t Delay,void (*Callback)(MonitorTimer, void *),void *Data) {
+    MonitorTimer t = calloc(1,sizeof(struct _MonitorTimer));
+    if(t == NULL)
+      return NULL;
+    t->Index = -1;
+    t->Callback = Callback;
+    t->Data = Data;
+    TimerSchedule(t,MonitorNow() + Delay);
+    return t;
+}
+void MonitorTimerReschedule(MonitorTimer Timer,uint32_t Delay) {
+    if(Timer)
+      TimerSchedule(Timer,MonitorNow() + Delay);
+}
+void MonitorTimerStop(MonitorTimer Timer) {
+    if(Timer)
+      TimerUnschedule(Timer);
+}
+void MonitorTimerCancel(MonitorTimer Timer) {
+    if(Timer == NULL)
+      return;
+    TimerUnschedule(Timer);
+    free(Timer);
+}
+// Call the timers that are due. Only the timers that were in
+// the heap on entry are considered so a timer rescheduling
+// itself with no delay can't keep us here forever.
+static int TimerExpire(void) {
+    int eventcnt = 0;
+    uint64_t now = MonitorNow();
+    for(int32_t n = TimerCount; n > 0 && TimerCount && TimerHeap[0]->When <= now; n--) {
+      MonitorTimer t = TimerHeap[0];
+      TimerUnschedule(t);
+      eventcnt++;
+      t->Callback(t,t->Data);
+    }
+    LoopStats.Timers += eventcnt;
+    return eventcnt;
+}
+// Milliseconds until the next timer is due, -1 if there are none
+static int64_t TimerNext(void) {
+    if(TimerCount == 0)
+      return -1;
+    uint64_t now = MonitorNow();
+    return TimerHeap[0]->When > now ? TimerHeap[0]->When - now : 0;
+}
+// Add, modify or remove an epoll registration so that it
+// matches fd and events. A negative fd removes it.
+static void EpollSync(PollEntry pe,int fd,uint32_t events) {
+    if(EpollFD < 0)
+      return;
+    if(pe->FD >= 0 && (pe->FD != fd || events == 0)) {
+      // The fd may already have been closed which removes it from
+      // the epoll set so EBADF and ENOENT are expected
+      if(epoll_ctl(EpollFD,EPOLL_CTL_DEL,pe->FD,NULL) < 0 && errno != EBADF && errno != ENOENT)
+        perror("epoll_ctl(DEL)");
+      pe->FD = -1;
+      pe->Events = 0;
+    }
+    if(fd < 0 || events == 0)
+      return;
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = pe;
+    if(pe->FD == fd) {
+      if(pe->Events != events && epoll_ctl(EpollFD,EPOLL_CTL_MOD,fd,&ev) < 0)
+        perror("epoll_ctl(MOD)");
+    }
+    else if(epoll_ctl(EpollFD,EPOLL_CTL_ADD,fd,&ev) < 0) {
+      printf("Error adding fd %i to epoll: %s\n",fd,strerror(errno));
+      return;
+    }
+    pe->FD = fd;
+    pe->Events = events;
+}
+// Make the epoll registration match the handle
+static void MonitorSync(MonList ml) {
+    MonitorHandle mh = &ml->Handle;
+    if( (ml->Flags & FLG_USED) && mh->FileDescriptor >= 0 && mh->ReadCB )
+      EpollSync(&ml->Poll,mh->FileDescriptor,EPOLLIN);
+    else
+      EpollSync(&ml->Poll,-1,0);
+}
+// curl telling us which sockets to watch
+static int CurlSocketCB(CURL *easy,curl_socket_t s,int what,void *userp,void *socketp) {
+    PollEntry pe = socketp;
+    if(what == CURL_POLL_REMOVE) {
+      if(pe) {
+        EpollSync(pe,-1,0);
+        curl_multi_assign(CurlHandle,s,NULL);
+        pe->Next = CurlRemoved;
+        CurlRemoved = pe;
+      }
+      return 0;
+    }
+    if(pe == NULL) {
+      if((pe = calloc(1,sizeof(struct _PollEntry))) == NULL) {
+        printf("No memory to watch curl socket %i\n",(int) s);
+        return -1;
+      }
+      pe->Type = PE_CURL;
+      pe->FD = -1;
+      curl_multi_assign(CurlHandle,s,pe);
+    }
+    uint32_t events = (what & CURL_POLL_IN  ? EPOLLIN  : 0) |
+                      (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+    EpollSync(pe,s,events);
+    return 0;
+}
+// curl telling us when it next wants to be called
+static int CurlTimerCB(CURLM *multi,long timeout_ms,void *userp) {
+    CurlDeadline = timeout_ms < 0 ? 0 : MonitorNow() + timeout_ms;
+    return 0;
+}
+// Queue Function to be called with Data on the main loop.
+// Can be called from any thread, including OMX callbacks.
+int MonitorPost(void (*Function)(void *),void *Data) {
+    PostEntry pe;
+    if(PostFD < 0 || (pe = malloc(sizeof(struct _PostEntry))) == NULL)
+      return -1;
+    pe->Function = Function;
+    pe->Data = Data;
+    pe->Next = __atomic_load_n(&PostList,__ATOMIC_RELAXED);
+    while( !__atomic_compare_exchange_n(&PostList,&pe->Next,pe,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED) )
+      ;
+    // Only the poster that found the list empty needs to wake
+    // the main loop, anyone else is covered by that wakeup
+    if(pe->Next == NULL) {
+      uint64_t one = 1;
+      if(write(PostFD,&one,sizeof(one)) < 0 && errno != EAGAIN)
+        perror("MonitorPost");
+    }
+    return 0;
+}
+// Run everything that has been posted in the order it was posted
+static void PostRun(MonitorHandle Handle,void *Data) {
+    uint64_t count;
+    PostEntry list = NULL,pe,next;
 
-void MonitorInitialise() {
+    if(read(PostFD,&count,sizeof(count)) < 0 && errno != EAGAIN)
+      perror("MonitorPost read");
+    // Take the list and reverse it
+    for(pe = __atomic_exchange_n(&PostList,NULL,__ATOMIC_ACQUIRE); pe; pe = next) {
+      next = pe->Next;
+      pe->Next = list;
+      list = pe;
+    }
+    for(pe = list; pe; pe = next) {
+      next = pe->Next;
+      pe->Function(pe->Data);
+      free(pe);
+    }
+}
+void MonitorInitialise(EventLoop Loop) {
     if(CurlHandle)
       return;
     curl_global_init(CURL_GLOBAL_ALL);
     CurlHandle = curl_multi_init();
+    Backend = Loop;
+    if(Backend == EVENT_LOOP_EPOLL) {
+      if( (EpollFD = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+        printf("Unable to create epoll instance (%s), using select\n",strerror(errno));
+        Backend = EVENT_LOOP_SELECT;
+      }
+      else {
+        curl_multi_setopt(CurlHandle,CURLMOPT_SOCKETFUNCTION,CurlSocketCB);
+        curl_multi_setopt(CurlHandle,CURLMOPT_TIMERFUNCTION,CurlTimerCB);
+      }
+    }
+    // Set up the channel for other threads to post to
+    if( (PostFD = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ) {
+      printf("Unable to create eventfd for MonitorPost: %s\n",strerror(errno));
+      return;
+    }
+    PostHandle = MonitorNew("Post");
+    MonitorSetReadData(PostHandle,NULL);
+    MonitorSetReadCB(PostHandle,PostRun);
+    MonitorSetReadFD(PostHandle,PostFD);
+}
+// The housekeeping timer of a handle has expired
+static void HouseKeepExpired(MonitorTimer Timer,void *Data) {
+    MonList       ml = Data;
+    MonitorHandle mh = &ml->Handle;
+    if( (ml->Flags & FLG_USED) && mh->HouseKeepCB )
+      mh->HouseKeepCB(mh,mh->HouseKeepData);
 }
 // Add an input source
 MonitorHandle MonitorNew(const char *Name) {
-    MonList ml = NULL;
-    if(MaxInUse < (MAX_MONITORS-1))
-      ml = &Monitor[MaxInUse++];
-    else for(int i=0; i < MaxInUse; i++) {
-      if( (Monitor[i].Flags & FLG_USED) == 0 ) {
-        ml = &Monitor[i];
-        break;
-      }
+    MonList ml;
+    if(MonitorCount >= MonitorSize) {
+      uint32_t size = MonitorSize ? MonitorSize * 2 : MIN_MONITORS;
+      MonList *m = realloc(Monitor,size * sizeof(MonList));
+      if(m == NULL)
+        return NULL;
+      Monitor = m;
+      MonitorSize = size;
     }
-    if(ml == NULL)
+    if( (ml = calloc(1,sizeof(struct _MonList))) == NULL )
       return NULL;
     strncpy(ml->Handle.Name,Name,MAX_NAME_LENGTH);
     ml->Handle.Name[MAX_NAME_LENGTH-1] = 0;
+    ml->Handle.FileDescriptor = -1;
+    ml->Handle.HouseKeep.Index = -1;
+    ml->Handle.HouseKeep.Data = ml;
+    ml->Handle.HouseKeep.Callback = HouseKeepExpired;
+    ml->Poll.Type = PE_MONITOR;
+    ml->Poll.FD = -1;
     ml->Flags |= FLG_USED;
+    Monitor[MonitorCount++] = ml;
     return &ml->Handle;
 }
-// Remove an input source
+// Remove an input source. The memory is freed the next time
+// round the loop as callbacks might still refer to it.
 void MonitorRelease(MonitorHandle Handle) {
+    MonList ml = (MonList) Handle;
     if(Handle == NULL)
       return;
-    // Not a mistake The structure handle points
-    // to is really a monitor structure
-    memset(Handle,0,sizeof(struct _MonitorHandle));
+    ml->Flags &= ~FLG_USED;
+    MonitorSync(ml);
+    TimerUnschedule(&Handle->HouseKeep);
 }
-// Monitor the handles for input for at most Timeout seconds
-// returns the number of Handles read from plus the number of
-// housekeeping calls. Returns after the first read and/or
-// housekeeping event
-int MonitorProcess(int Timeout) {
+void MonitorSetReadFD(MonitorHandle Handle,int FD) {
+    Handle->FileDescriptor = FD;
+    MonitorSync((MonList) Handle);
+}
+void MonitorSetReadCB(MonitorHandle Handle,void (*ReadCB)(MonitorHandle, void *)) {
+    Handle->ReadCB = ReadCB;
+    MonitorSync((MonList) Handle);
+}
+// Free released handles and close up the gaps
+static void MonitorCompact(void) {
+    uint32_t n = 0;
+    for(uint32_t i=0; i < MonitorCount; i++) {
+      if(Monitor[i]->Flags & FLG_USED)
+        Monitor[n++] = Monitor[i];
+      else
+        free(Monitor[i]);
+    }
+    MonitorCount = n;
+    while(CurlRemoved) {
+      PollEntry pe = CurlRemoved;
+      CurlRemoved = pe->Next;
+      free(pe);
+    }
+}
+// Process curl messages
+static void CurlMessages(void) {
+    struct CURLMsg *m;
+    do {
+      int msgq = 0;
+      m = curl_multi_info_read(CurlHandle, &msgq);
+      if(m) {
+        switch(m->msg) {
+          case CURLMSG_DONE: {
+            CurlComplete cp = NULL;
+            curl_easy_getinfo(m->easy_handle,CURLINFO_PRIVATE,&cp);
+            CURL *e = m->easy_handle;
+            CURLcode result = m->data.result;
+            curl_multi_remove_handle(CurlHandle,e);
+            if(cp) {
+              cp->Result = result;
+              cp->Callback(e,cp);
+            }
+            else {
+              if(result != CURLE_OK)
+                printf("curl request failed: %s\n",curl_easy_strerror(result));
+              curl_easy_cleanup(e);
+            }
+          } break;
+          default:
+//            printf("MSG: %i\n",m->msg);
+            break;
+        }
+      }
+    } while(m);
+}
+// Schedule housekeeping for When (monotonic ms), 0 cancels it
+void MonitorSetHouseKeepingTime(MonitorHandle Handle,uint64_t When) {
+    if(When == 0)
+      TimerUnschedule(&Handle->HouseKeep);
+    else
+      TimerSchedule(&Handle->HouseKeep,When);
+}
+// Work out how long to wait in milliseconds, at most Timeout
+// seconds, taking into account when the next timer is due
+static int64_t MonitorTimeout(int Timeout,long curltout) {
+    int64_t time_ms;
+
+    Timeout *= 1000;
+    // Determine how long to wait for input
+    curltout = curltout < 0       ? Timeout  :
+               curltout < Timeout ? curltout : Timeout;
+    time_ms = TimerNext();
+    // What comes first? curl or the next timer
+    return time_ms >= 0 && time_ms < curltout ? time_ms : curltout;
+}
+// The select backend. Rebuilds the fd sets every time so
+// is limited to descriptors below FD_SETSIZE.
+static int MonitorProcessSelect(int Timeout) {
     fd_set readfds,writefds,errorfds;
     int  maxfd = 0;
-    time_t nexthk = 0;
     int eventcnt = 0;
     long curltout;
 
     // Get curls timeout recomendation
     curl_multi_timeout(CurlHandle, &curltout);
-    Timeout *= 1000;
-    // Determine how long to wait for input
-    curltout = curltout < 0       ? Timeout  :
-               curltout < Timeout ? curltout : Timeout;
-
     // Get fds from curl that need to be monitored
     FD_ZERO(&readfds);
     FD_ZERO(&writefds);
     FD_ZERO(&errorfds);
     curl_multi_fdset(CurlHandle,&readfds,&writefds,&errorfds,&maxfd);
-    // Set up the readfds and the time of the next houskeeping
-    // Compacts the array by moving handles from the end into
-    // empty spaces
-    for(int i=0; i < MaxInUse;i++ ) {
-      // Compact the array
-      while((Monitor[i].Flags & FLG_USED) == 0 && i < MaxInUse) {
-        // Make sure isn't the end object
-        if(i != (MaxInUse - 1)) {
-          memcpy(&Monitor[i],&Monitor[MaxInUse-1],sizeof(struct _MonList));
-          memset(&Monitor[MaxInUse-1],0,sizeof(struct _MonList));
-        }
-        MaxInUse--;
-      }
-      // Compacting the array might have put i out of bounds!
-      if(i >= MaxInUse)
-        continue;         // Let the loop condition take care of it
-      // Should never reach here with an unset FLG_USED
-      assert(Monitor[i].Flags & FLG_USED);
+    // Set up the readfds
+    for(int i=0; i < MonitorCount;i++ ) {
+      MonitorHandle mh = &Monitor[i]->Handle;
       // Add filehandle to readfds if its there and there is a callback function
-      if( Monitor[i].Handle.FileDescriptor >= 0 && Monitor[i].Handle.ReadCB != NULL) {
-        FD_SET(Monitor[i].Handle.FileDescriptor,&readfds);
-        if( Monitor[i].Handle.FileDescriptor > maxfd )
-          maxfd = Monitor[i].Handle.FileDescriptor;
-      }
-      // Check for housekeeping
-      if(Monitor[i].Handle.NextHouseKeep && Monitor[i].Handle.HouseKeepCB) {
-        nexthk = nexthk == 0 ? Monitor[i].Handle.NextHouseKeep :
-                 Monitor[i].Handle.NextHouseKeep > nexthk ? nexthk : 
-                 Monitor[i].Handle.NextHouseKeep;
+      if( mh->FileDescriptor >= 0 && mh->ReadCB != NULL) {
+        if( mh->FileDescriptor >= FD_SETSIZE ) {
+          printf("%s: fd %i is too big for select\n",mh->Name,mh->FileDescriptor);
+          continue;
+        }
+        FD_SET(mh->FileDescriptor,&readfds);
+        if( mh->FileDescriptor > maxfd )
+          maxfd = mh->FileDescriptor;
       }
     }
     // Calculate the timeout
     struct timeval tv;
-    int64_t time_ms;
-    if( nexthk ) {
-      gettimeofday(&tv,NULL);
-      // convert to milliseconds
-      time_ms = (uint64_t) tv.tv_sec * 1000 + tv.tv_usec/1000;
-      // Calculate how long till nexthk
-      time_ms = (uint64_t) nexthk * 1000 - time_ms;
-      // A zero value could result in waiting Timeout seconds
-      if(time_ms <= 0)
-        time_ms = 1;
-    }
-    else {
-      time_ms = 0;
-    }
-    // What comes first? curl or nexthk
-    time_ms =  time_ms && time_ms < curltout ? time_ms : curltout;
-    // Make sure it isn't negative or zero
-    // Set the timeout
+    int64_t time_ms = MonitorTimeout(Timeout,curltout);
     tv.tv_sec = time_ms/1000;
     tv.tv_usec = (time_ms%1000)*1000;
     // Finally,
     int sr;
-    if( (sr = select(maxfd+1,&readfds,NULL,NULL,&tv)) < 0 ) {
+    uint64_t start = NowNS();
+    sr = select(maxfd+1,&readfds,&writefds,&errorfds,&tv);
+    uint64_t end = NowNS();
+    LoopStats.BlockedNS += end - start;
+    HistogramAdd(LoopStats.BlockedHistogram,end - start);
+    if( sr < 0 ) {
       perror("select error");
       return 0;
     }
-    else if(sr) {
+    else if(sr == 0)
+      LoopStats.Timeouts++;
+    else
+      LoopStats.Wakeups++;
+    if(sr) {
       // There is no limit to what the callbacks can do
       // They might have added/removed/closed handles or
       // even changed callbacks so have be careful.
-      for(int i=0,hcnt = MaxInUse; i < hcnt; i++) {
+      for(int i=0,hcnt = MonitorCount; i < hcnt; i++) {
         // For convenience
-        MonList       ml = &Monitor[i];
+        MonList       ml = Monitor[i];
         MonitorHandle mh = &ml->Handle;
         // Might have been changed by a callback so test
-        if( (ml->Flags & FLG_USED) == 0 || mh->FileDescriptor < 0 || mh->ReadCB == NULL)
+        if( (ml->Flags & FLG_USED) == 0 || mh->FileDescriptor < 0 ||
+            mh->FileDescriptor >= FD_SETSIZE || mh->ReadCB == NULL)
           continue;
-        
+
         if( FD_ISSET(mh->FileDescriptor,&readfds) ) {
           eventcnt++;
-          mh->ReadCB(mh,mh->ReadCBData);
+          MonitorCallRead(mh);
         }
       }
     }
     // Let curl perform anything it wants
     int running = 0;
+    start = NowNS();
     curl_multi_perform(CurlHandle,&running);
-    if(0 && running)
-      printf("%i still running\n",running);
-    // Everything has been read so test for housekeeping events
-    for(int i=0,hcnt = MaxInUse; i < hcnt; i++) {
-      // For convenience
-      MonList       ml = &Monitor[i];
-      MonitorHandle mh = &ml->Handle;
-      // Might have been changed by a callback so test
-      if( (ml->Flags & FLG_USED) == 0 || mh->HouseKeepCB == NULL)
-        continue;
+    LoopStats.CurlNS += NowNS() - start;
+    LoopStats.CurlCalls++;
+    return eventcnt;
+}
+// The epoll backend. Descriptors are only registered/unregistered
+// when they change and curl tells us about its sockets through
+// CurlSocketCB so only the handles that are ready get looked at.
+static int MonitorProcessEpoll(int Timeout) {
+    int eventcnt = 0;
+    int running = 0;
+    long curltout = -1;
 
-      if( mh->NextHouseKeep && mh->NextHouseKeep <= time(NULL) ) {
-        mh->NextHouseKeep = 0;
-        eventcnt++;
-        mh->HouseKeepCB(mh,mh->HouseKeepData);
+    // Make sure there is room for every handle and a few curl sockets
+    if(EpollEventsSize < MonitorCount + MIN_MONITORS) {
+      int size = MonitorSize + MIN_MONITORS;
+      struct epoll_event *e = realloc(EpollEvents,size * sizeof(struct epoll_event));
+      if(e) {
+        EpollEvents = e;
+        EpollEventsSize = size;
       }
     }
-    // Process curl messages
-    struct CURLMsg *m;
-    do {
-      int msgq = 0;
-      m = curl_multi_info_read(CurlHandle, &msgq);
-      if(m) {
-        switch(m->msg) {
-          case CURLMSG_DONE: {
-            CurlComplete cp = NULL;
-            curl_easy_getinfo(m->easy_handle,CURLINFO_PRIVATE,&cp);
-            if(m->data.whatever)
-              printf("MESSAGE: %s\n",(char *) m->data.whatever);
-            CURL *e = m->easy_handle;
-            curl_multi_remove_handle(CurlHandle,e);
-            if(cp)
-              cp->Callback(e,cp);
-            else
-              curl_easy_cleanup(e);
-          } break;
-          default:
-//            printf("MSG: %i\n",m->msg);
-            break;
-        }
+    if(CurlDeadline) {
+      uint64_t now = MonitorNow();
+      curltout = CurlDeadline > now ? CurlDeadline - now : 0;
+    }
+    int64_t time_ms = MonitorTimeout(Timeout,curltout);
+    uint64_t start = NowNS();
+    int n = epoll_wait(EpollFD,EpollEvents,EpollEventsSize,time_ms);
+    uint64_t end = NowNS();
+    LoopStats.BlockedNS += end - start;
+    HistogramAdd(LoopStats.BlockedHistogram,end - start);
+    if(n < 0) {
+      if(errno != EINTR)
+        perror("epoll_wait error");
+      return 0;
+    }
+    else if(n == 0)
+      LoopStats.Timeouts++;
+    else
+      LoopStats.Wakeups++;
+    // There is no limit to what the callbacks can do so the
+    // handle is checked before each call. Released handles
+    // aren't freed until the next compaction so the pointers
+    // in EpollEvents are still safe to look at.
+    for(int i=0; i < n; i++) {
+      PollEntry pe = EpollEvents[i].data.ptr;
+      if(pe->Type == PE_CURL) {
+        // Ignore sockets curl has asked us to stop watching
+        if(pe->FD < 0)
+          continue;
+        uint32_t ev = EpollEvents[i].events;
+        int flags = (ev & EPOLLIN  ? CURL_CSELECT_IN  : 0) |
+                    (ev & EPOLLOUT ? CURL_CSELECT_OUT : 0) |
+                    (ev & (EPOLLERR|EPOLLHUP) ? CURL_CSELECT_ERR : 0);
+        start = NowNS();
+        curl_multi_socket_action(CurlHandle,pe->FD,flags,&running);
+        LoopStats.CurlNS += NowNS() - start;
+        LoopStats.CurlCalls++;
+        continue;
       }
-    } while(m);
+      MonList       ml = (MonList) ((char *) pe - offsetof(struct _MonList,Poll));
+      MonitorHandle mh = &ml->Handle;
+      if( (ml->Flags & FLG_USED) == 0 || mh->FileDescriptor < 0 || mh->ReadCB == NULL)
+        continue;
+      eventcnt++;
+      MonitorCallRead(mh);
+    }
+    // Has curls timer expired
+    if(CurlDeadline && CurlDeadline <= MonitorNow()) {
+      CurlDeadline = 0;
+      start = NowNS();
+      curl_multi_socket_action(CurlHandle,CURL_SOCKET_TIMEOUT,0,&running);
+      LoopStats.CurlNS += NowNS() - start;
+      LoopStats.CurlCalls++;
+    }
     return eventcnt;
 }
+// Monitor the handles for input for at most Timeout seconds
+// returns the number of Handles read from plus the number of
+// housekeeping calls. Returns after the first read and/or
+// housekeeping event
+int MonitorProcess(int Timeout) {
+    int eventcnt;
+    uint64_t start,blocked;
 
-
-
-
-
+    start = NowNS();
+    blocked = LoopStats.BlockedNS;
+    LoopStats.Iterations++;
+    // Get rid of any released handles
+    MonitorCompact();
+    if(Backend == EVENT_LOOP_EPOLL)
+      eventcnt = MonitorProcessEpoll(Timeout);
+    else
+      eventcnt = MonitorProcessSelect(Timeout);
+    // Everything has been read so run any timers that are due
+    uint64_t timers = NowNS();
+    eventcnt += TimerExpire();
+    LoopStats.TimerNS += NowNS() - timers;
+    CurlMessages();
+    // Whatever wasn't spent waiting was spent busy
+    uint64_t busy = NowNS() - start - (LoopStats.BlockedNS - blocked);
+    LoopStats.BusyNS += busy;
+    HistogramAdd(LoopStats.BusyHistogram,busy);
+    return eventcnt;
+}
+//
+// Statistics
+//
+void MonitorGetStats(MonitorHandle Handle,MonitorStats Stats) {
+    if(Handle && Stats)
+      memcpy(Stats,&Handle->Stats,sizeof(struct _MonitorStats));
+}
+void MonitorGetLoopStats(MonitorLoopStats Stats) {
+    if(Stats)
+      memcpy(Stats,&LoopStats,sizeof(struct _MonitorLoopStats));
+}
+// Upper bound in microseconds of the bucket containing the
+// given percentile of a histogram
+static uint64_t HistogramPercentile(uint32_t *h,int percent) {
+    uint64_t total = 0,count = 0;
+    for(int i=0; i < MONITOR_HIST_BUCKETS; i++)
+      total += h[i];
+    if(total == 0)
+      return 0;
+    for(int i=0; i < MONITOR_HIST_BUCKETS; i++) {
+      count += h[i];
+      if(count * 100 >= total * percent)
+        return (uint64_t) 1 << i;
+    }
+    return (uint64_t) 1 << (MONITOR_HIST_BUCKETS-1);
+}
+void MonitorStatsDump(void) {
+    struct _MonitorLoopStats ls;
+    MonitorGetLoopStats(&ls);
+    printf("Loop: %llu iterations, %llu wakeups, %llu timeouts, blocked %llums, busy %llums "
+           "(p50 <%lluus, p99 <%lluus), curl %llu calls %llums, timers %llu %llums\n",
+           (unsigned long long) ls.Iterations,(unsigned long long) ls.Wakeups,
+           (unsigned long long) ls.Timeouts,(unsigned long long) ls.BlockedNS/1000000,
+           (unsigned long long) ls.BusyNS/1000000,
+           (unsigned long long) HistogramPercentile(ls.BusyHistogram,50),
+           (unsigned long long) HistogramPercentile(ls.BusyHistogram,99),
+           (unsigned long long) ls.CurlCalls,(unsigned long long) ls.CurlNS/1000000,
+           (unsigned long long) ls.Timers,(unsigned long long) ls.TimerNS/1000000);
+    for(int i=0; i < MonitorCount; i++) {
+      struct _MonitorStats st;
+      if( (Monitor[i]->Flags & FLG_USED) == 0 )
+        continue;
+      MonitorGetStats(&Monitor[i]->Handle,&st);
+      if(st.Callbacks == 0)
+        continue;
+      printf("  %-16s %8llu calls %10llu bytes avg %6lluus max %6lluus p50 <%lluus p99 <%lluus\n",
+             Monitor[i]->Handle.Name,(unsigned long long) st.Callbacks,
+             (unsigned long long) st.Bytes,(unsigned long long) st.TimeNS/st.Callbacks/1000,
+             (unsigned long long) st.MaxNS/1000,
+             (unsigned long long) HistogramPercentile(st.Histogram,50),
+             (unsigned long long) HistogramPercentile(st.Histogram,99));
+      if(st.Frames)
+        printf("  %-16s %8llu frames %6.2f wakeups %6.2f reads per frame\n",
+               Monitor[i]->Handle.Name,(unsigned long long) st.Frames,
+               (double) st.Callbacks / st.Frames,(double) st.Reads / st.Frames);
+    }
+}
+static void StatsExpired(MonitorTimer Timer,void *Data) {
+    MonitorStatsDump();
+    MonitorTimerReschedule(Timer,StatsInterval);
+}
+// Dump the statistics every Interval milliseconds, 0 stops it
+void MonitorSetStatsInterval(uint32_t Interval) {
+    StatsInterval = Interval;
+    if(Interval == 0) {
+      MonitorTimerCancel(StatsTimer);
+      StatsTimer = NULL;
+    }
+    else if(StatsTimer)
+      MonitorTimerReschedule(StatsTimer,Interval);
+    else
+      StatsTimer = MonitorTimerAdd(Interval,StatsExpired,NULL);
+}
@@ -19,32 +19,94 @@
 
 #define MAX_NAME_LENGTH   16
 
+#define MONITOR_HIST_BUCKETS  24               // Bucket n counts times < 2^n microseconds
+
+// Per handle statistics. Updated in place so they are
+// cheap enough to leave on all the time.
+typedef struct _MonitorStats *MonitorStats;
+struct _MonitorStats {
+    uint64_t Callbacks;                         // Number of read callbacks
+    uint64_t Bytes;                             // Bytes read, see MonitorAddBytes
+    uint64_t Reads;                             // Read system calls, see MonitorAddReads
+    uint64_t Frames;                            // Access units read, see MonitorAddFrames
+    uint64_t TimeNS;                            // Total time in the read callback
+    uint64_t MaxNS;                             // Longest read callback
+    uint32_t Histogram[MONITOR_HIST_BUCKETS];   // Read callback durations
+};
+// Main loop statistics
+typedef struct _MonitorLoopStats *MonitorLoopStats;
+struct _MonitorLoopStats {
+    uint64_t Iterations;                        // Calls to MonitorProcess
+    uint64_t Wakeups;                           // select/epoll returned with something ready
+    uint64_t Timeouts;                          // select/epoll timed out
+    uint64_t BlockedNS;                         // Time spent waiting in select/epoll
+    uint64_t BusyNS;                            // Time spent doing everything else
+    uint64_t CurlCalls;                         // curl perform/socket_action calls
+    uint64_t CurlNS;                            // Time spent in curl
+    uint64_t Timers;                            // Timer callbacks
+    uint64_t TimerNS;                           // Time spent in timer callbacks
+    uint32_t BlockedHistogram[MONITOR_HIST_BUCKETS];
+    uint32_t BusyHistogram[MONITOR_HIST_BUCKETS];
+};
+typedef struct _MonitorTimer *MonitorTimer;
+struct _MonitorTimer {
+    uint64_t When;                              // Monotonic milliseconds when due
+    int32_t  Index;                             // Position in the timer heap, -1 if not scheduled
+    void    *Data;                              // Data to pass to Callback
+    void (*Callback)(MonitorTimer, void *);       // Called when the timer expires
+};
 typedef struct _MonitorHandle *MonitorHandle;
 struct _MonitorHandle {
     char   Name[MAX_NAME_LENGTH];               // Used for logging
     int    FileDescriptor;                      // File Descriptor to monitor
     void  *ReadCBData;                          // Data to pass to ReadCB
     void (*ReadCB)(MonitorHandle, void *);        // Called when there is data to read
-    time_t NextHouseKeep;                       // When to call HouseKeepCB
+    struct _MonitorTimer HouseKeep;             // When to call HouseKeepCB
     void  *HouseKeepData;                       // Data to pass to Housekeeping
     void (*HouseKeepCB)(MonitorHandle, void *);   // Called periodically
     void *DisEngageData;                        // Data to pass to DisEngageCB
     void (*DisEngageCB)(MonitorHandle, void *);   // Called when the handle is being destroyed
+    struct _MonitorStats Stats;                 // Maintained by MonitorProcess
 };
 typedef struct _CurlComplete  *CurlComplete;
 struct _CurlComplete {
     void (*Callback)(CURL *,CurlComplete);
     void *Data;
+    CURLcode Result;                            // How the transfer went, set before Callback
 };
 MonitorHandle MonitorNew(const char *);
+void MonitorRelease(MonitorHandle);
 int MonitorProcess(int);
-#define MonitorSetReadFD(h,f)           (h)->FileDescriptor = (f)
+// These change what is being monitored so are functions
+void MonitorSetReadFD(MonitorHandle,int);
+void MonitorSetReadCB(MonitorHandle,void (*)(MonitorHandle, void *));
 #define MonitorSetReadData(h,d)         (h)->ReadCBData = (d)
-#define MonitorSetReadCB(h,cb)          (h)->ReadCB = (cb)
-#define MonitorSetHouseKeepingTime(h,t) (h)->NextHouseKeep = (t)
+// Housekeeping times are in monotonic milliseconds, see MonitorNow()
+void MonitorSetHouseKeepingTime(MonitorHandle,uint64_t);
+#define MonitorSetHouseKeepingDelay(h,ms) MonitorSetHouseKeepingTime((h),MonitorNow() + (ms))
+#define MonitorCancelHouseKeeping(h)    MonitorSetHouseKeepingTime((h),0)
 #define MonitorSetHouseKeepingCB(h,cb)  (h)->HouseKeepCB = (cb)
 #define MonitorSetHouseKeepingData(h,d) (h)->HouseKeepData = (d)
 #define MonitorGetName(h)               (h)->Name
 #define MonitorGetReadFD(h)             (h)->FileDescriptor
 #define MonitorClearReadFD(h)           MonitorSetReadFD((h),-1)
+// Timers. Delays are in milliseconds. A timer fires once and
+// stays allocated until cancelled so it can be rescheduled,
+// even from within its own callback.
+uint64_t MonitorNow(void);
+MonitorTimer MonitorTimerAdd(uint32_t,void (*)(MonitorTimer, void *),void *);
+void MonitorTimerReschedule(MonitorTimer,uint32_t);
+void MonitorTimerStop(MonitorTimer);
+void MonitorTimerCancel(MonitorTimer);
+#define MonitorTimerPending(t)          ((t)->Index >= 0)
+// Run a function on the main loop. Safe to call from any thread.
+int MonitorPost(void (*)(void *),void *);
+// Statistics
+#define MonitorAddBytes(h,n)            (h)->Stats.Bytes += (n)
+#define MonitorAddReads(h,n)            (h)->Stats.Reads += (n)
+#define MonitorAddFrames(h,n)           (h)->Stats.Frames += (n)
+void MonitorGetStats(MonitorHandle,MonitorStats);
+void MonitorGetLoopStats(MonitorLoopStats);
+void MonitorStatsDump(void);
+void MonitorSetStatsInterval(uint32_t);
 #endif
@@ -0,0 +1,82 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _NAL_H_INCLUDED_
+#define _NAL_H_INCLUDED_
+
+// What a NAL unit header says about where decoding can start, for
+// H264 (ITU-T H.264 7.4.1.2) and H265 (ITU-T H.265 7.4.2.2).
+// Need cctvplexer.h
+
+#define NAL_SEI_RECOVERY_POINT  6   // SEI payload type, the same for both
+
+static inline int32_t NalHeaderLength(VideoCodec codec) {
+    return codec == CODEC_H265 ? 2 : 1;
+}
+static inline int32_t NalType(VideoCodec codec,const uint8_t *header) {
+    return codec == CODEC_H265 ? (header[0] >> 1) & 0x3f : header[0] & 0x1f;
+}
+// SPS and PPS, and for H265 VPS
+static inline int NalParameterSet(VideoCodec codec,const uint8_t *header) {
+    int32_t type = NalType(codec,header);
+    return codec == CODEC_H265 ? type >= 32 && type <= 34 : type == 7 || type == 8;
+}
+// A slice of a picture other pictures may refer to. Parameter sets
+// and other non VCL units aren't.
+static inline int NalReference(VideoCodec codec,const uint8_t *header) {
+    int32_t type = NalType(codec,header);
+    if(codec == CODEC_H265)
+      // Even types up to 14 are sub-layer non-reference pictures
+      return type < 32 && (type > 14 || (type & 1));
+    return type >= 1 && type <= 5 && (header[0] & 0x60);
+}
+// The first of a group of parameter sets, VPS for H265 or SPS for H264
+static inline int NalFirstSet(VideoCodec codec,const uint8_t *header) {
+    return NalType(codec,header) == (codec == CODEC_H265 ? 32 : 7);
+}
+// A picture decoding can start from: an IDR, for H265 any IRAP, or an
+// SEI whose first message is a recovery point. Body is the Avail bytes
+// after the header that have arrived.
+static inline int NalRandomAccess(VideoCodec codec,const uint8_t *header,const uint8_t *body,int32_t avail) {
+    int32_t type = NalType(codec,header);
+    if(codec == CODEC_H265) {
+      if(type >= 16 && type <= 21)
+        return 1;
+      return type == 39 && avail > 0 && body[0] == NAL_SEI_RECOVERY_POINT;
+    }
+    if(type == 5)
+      return 1;
+    return type == 6 && avail > 0 && body[0] == NAL_SEI_RECOVERY_POINT;
+}
+// A slice of a picture, as opposed to parameter sets, SEI and the like
+static inline int NalPicture(VideoCodec codec,const uint8_t *header) {
+    int32_t type = NalType(codec,header);
+    return codec == CODEC_H265 ? type < 32 : type >= 1 && type <= 5;
+}
+// A NAL unit that starts a new access unit if the current one already
+// has a picture in it (H.264 7.4.1.2.3, H.265 7.4.2.4.4). A slice does
+// when it is the first of its picture. Body as for NalRandomAccess.
+static inline int NalStartsAccessUnit(VideoCodec codec,const uint8_t *header,const uint8_t *body,int32_t avail) {
+    int32_t type = NalType(codec,header);
+    if(NalPicture(codec,header))
+      // first_slice_segment_in_pic_flag, or first_mb_in_slice of 0
+      return avail > 0 && (body[0] & 0x80);
+    if(codec == CODEC_H265)
+      return (type >= 32 && type <= 35) || type == 39 || (type >= 41 && type <= 44) ||
+             (type >= 48 && type <= 55);
+    return (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+}
+#endif
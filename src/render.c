@@ -28,8 +28,11 @@
 #include <IL/OMX_Component.h>
 #include <IL/OMX_Broadcom.h>
 #include <png.h>
+#include <curl/curl.h>
 
+#include "cctvplexer.h"
 #include "render.h"
+#include "monitor.h"
 
 #define IMAGE_DECODE "OMX.broadcom.image_decode"
 #define VIDEO_DECODE "OMX.broadcom.video_decode"
@@ -42,6 +45,8 @@
 #define BG_COLOUR_LAYER   -2
 #define BG_IMAGE_LAYER    -1
 
+#define RECONFIG_TIMEOUT  2000          // Milliseconds to wait for ports to disable
+
 #define RGB888_TO_RGB565(c)   ((((c) >> 8) & 0xf800 ) | (((c) >> 5) & 0x07e0 ) | (((c) >> 3) & 0x001f ))
 
 #define FATAL(rh,omxcmnd,...)      do {                    \
@@ -80,6 +85,19 @@ struct _Buffer {
     __attribute__((__aligned__(16)))
     unsigned char Buffer[1];
 };
+// A tunnel being reconfigured, see Reconfigure
+typedef struct _Reconfig *Reconfig;
+struct _Reconfig {
+    struct _Renderer *Renderer;
+    OMX_HANDLETYPE Out;
+    OMX_U32   OutPort;
+    OMX_HANDLETYPE In;
+    OMX_U32   InPort;
+    int32_t   Disabling;                // Ports still to report disabled, counted on OMX threads
+    int32_t   Busy;
+    int32_t   Again;                    // Changed again while it was being reconfigured
+    MonitorTimer Timer;                 // For ports that never report
+};
 struct _Renderer {
     char Name[32];
     OMX_HANDLETYPE Decode;
@@ -91,6 +109,11 @@ struct _Renderer {
     Buffer DecodeBuffer;
     Buffer LastUsed;
     uint32_t  NumberOfBuffers;
+    int32_t   DecodeTunnelled;          // Set up once, changes after that are reconfigured
+    int32_t   ResizeTunnelled;
+    struct _Reconfig Reconfig[2];       // The decode and resize output tunnels
+    void    (*Freed)(void *);           // Called when a decode buffer is free again
+    void     *FreedData;
 //    int ReadyToRender;
 //    int Rendering;
 //    int IsInvisible;
@@ -106,6 +129,13 @@ static Renderer BackgroundImage;
 static OMX_HANDLETYPE NullSink;
 static OMX_U32 NullSinkPort;
 static void *SetupTunnel(Renderer r,OMX_U32 port);
+static void PortDisabled(Renderer r,OMX_HANDLETYPE h,OMX_U32 port);
+// Port settings change passed from an OMX thread to the main loop
+typedef struct _PortChange *PortChange;
+struct _PortChange {
+    Renderer Renderer;
+    OMX_U32  Port;
+};
 
 // Used for logging and debugging
 static char *StateToString(OMX_STATETYPE state) {
@@ -121,6 +151,12 @@ static char *StateToString(OMX_STATETYPE state) {
     return "OMX_StateUnknown";
 }
 
+// Runs on the main loop, posted by CB_EventHandler
+static void PortSettingsChanged(void *data) {
+    PortChange pc = data;
+    SetupTunnel(pc->Renderer,pc->Port);
+    free(pc);
+}
 static OMX_ERRORTYPE CB_EventHandler(OMX_HANDLETYPE hComponent,
                                      OMX_PTR pAppData,
                                      OMX_EVENTTYPE eEvent,
@@ -130,7 +166,10 @@ static OMX_ERRORTYPE CB_EventHandler(OMX_HANDLETYPE hComponent,
     Renderer r = (Renderer) pAppData;
     char *name = r ? r->Name : "Unknown";
     switch (eEvent) {
-      case OMX_EventCmdComplete: break;
+      case OMX_EventCmdComplete:
+        if(nData1 == OMX_CommandPortDisable && r)
+          PortDisabled(r,hComponent,nData2);
+        break;
         switch (nData1) {
           case OMX_CommandStateSet:
             printf("%s state changed (%s) complete\n",name,StateToString(nData2));
@@ -204,10 +243,21 @@ static OMX_ERRORTYPE CB_EventHandler(OMX_HANDLETYPE hComponent,
       case OMX_EventBufferFlag:
 //        printf("CB buffer flag %d/%x\n", nData1, nData2);
         break;
-      case OMX_EventPortSettingsChanged:
+      case OMX_EventPortSettingsChanged: {
+        // This is called on an OMX thread and setting up the
+        // tunnel blocks so hand it over to the main loop
         printf("CB port settings changed for %s Port %d\n", name,nData1);
+        PortChange pc = malloc(sizeof(struct _PortChange));
+        if(pc) {
+          pc->Renderer = r;
+          pc->Port = nData1;
+          if(MonitorPost(PortSettingsChanged,pc) == 0)
+            break;
+          free(pc);
+        }
+        printf("%s unable to post port change, setting up tunnel now\n",name);
         SetupTunnel(r,nData1);
-        break;
+      } break;
       case OMX_EventMark:
         printf("CB buffer mark %p\n", pEventData);
         break;
@@ -224,9 +274,13 @@ static OMX_ERRORTYPE CB_EmptyBufferDone(OMX_HANDLETYPE hComponent,
                                         OMX_PTR pAppData,
                                         OMX_BUFFERHEADERTYPE* pBuffer) {
 
+    Renderer r = pAppData;
     Buffer buff;
+    // Called on an OMX thread so InUse is updated atomically
     buff = (void *) pBuffer->pBuffer - offsetof(struct _Buffer,Buffer);
-    buff->InUse = 0;
+    __atomic_store_n(&buff->InUse,0,__ATOMIC_RELEASE);
+    if(r && r->Freed)
+      r->Freed(r->FreedData);
 //    printf("CB_EmptyBufferDone %p %p\n",buff,pBuffer);
     return 0;
 }
@@ -285,11 +339,89 @@ static int GetBasePort(Renderer r,OMX_HANDLETYPE h) {
     
     return port.nStartPortNumber;
 }
+// An output port that is already tunnelled has changed, as when the
+// camera is switched to a stream with another resolution. Both ends
+// are disabled, the new settings passed on and then enabled again.
+// This runs on the main loop so it doesn't wait for the ports, it
+// carries on in ReconfigEnable when both have reported being disabled.
+static void ReconfigEnable(void *data) {
+    Reconfig rc = data;
+    Renderer r = rc->Renderer;
+    OMX_PARAM_PORTDEFINITIONTYPE portdef;
+
+    // Both ports reporting and the timer can get here
+    if(!rc->Busy)
+      return;
+    MonitorTimerStop(rc->Timer);
+    if(rc->In == r->Resize) {
+      portdef.nSize = sizeof(OMX_PARAM_PORTDEFINITIONTYPE);
+      portdef.nVersion.nVersion = OMX_VERSION;
+      portdef.nPortIndex = rc->OutPort;
+      WARN(r,OMX_GetParameter,rc->Out,OMX_IndexParamPortDefinition, &portdef);
+      portdef.nPortIndex = rc->InPort;
+      WARN(r,OMX_SetParameter,rc->In,OMX_IndexParamPortDefinition, &portdef);
+    }
+    WARN(r,OMX_SendCommand,rc->Out,OMX_CommandPortEnable,rc->OutPort, NULL);
+    WARN(r,OMX_SendCommand,rc->In,OMX_CommandPortEnable,rc->InPort, NULL);
+    rc->Busy = 0;
+    if(rc->Again) {
+      printf("%s: output changed again, reconfiguring tunnel\n",r->Name);
+      SetupTunnel(r,rc->OutPort);
+    }
+}
+static void ReconfigTimeout(MonitorTimer t,void *data) {
+    Reconfig rc = data;
+
+    printf("%s: port never disabled, reconfiguring anyway\n",rc->Renderer->Name);
+    __atomic_store_n(&rc->Disabling,0,__ATOMIC_RELAXED);
+    ReconfigEnable(rc);
+}
+// Called on an OMX thread when a port has been disabled
+static void PortDisabled(Renderer r,OMX_HANDLETYPE h,OMX_U32 port) {
+    for(int i = 0; i < 2; i++) {
+      Reconfig rc = &r->Reconfig[i];
+      if(__atomic_load_n(&rc->Disabling,__ATOMIC_ACQUIRE) <= 0 ||
+         !((h == rc->Out && port == rc->OutPort) || (h == rc->In && port == rc->InPort)))
+        continue;
+      // The timer covers it if it can't be posted
+      if(__atomic_sub_fetch(&rc->Disabling,1,__ATOMIC_ACQ_REL) == 0)
+        MonitorPost(ReconfigEnable,rc);
+    }
+}
+static void Reconfigure(Renderer r,Reconfig rc,OMX_HANDLETYPE out,OMX_U32 outport,OMX_HANDLETYPE in,OMX_U32 inport) {
+    if(rc->Busy) {
+      rc->Again = 1;
+      return;
+    }
+    printf("%s: output changed, reconfiguring tunnel\n",r->Name);
+    rc->Renderer = r;
+    rc->Out = out;
+    rc->OutPort = outport;
+    rc->In = in;
+    rc->InPort = inport;
+    rc->Busy = 1;
+    rc->Again = 0;
+    __atomic_store_n(&rc->Disabling,2,__ATOMIC_RELEASE);
+    if(rc->Timer == NULL)
+      rc->Timer = MonitorTimerAdd(RECONFIG_TIMEOUT,ReconfigTimeout,rc);
+    else
+      MonitorTimerReschedule(rc->Timer,RECONFIG_TIMEOUT);
+    WARN(r,OMX_SendCommand,out,OMX_CommandPortDisable,outport, NULL);
+    WARN(r,OMX_SendCommand,in,OMX_CommandPortDisable,inport, NULL);
+}
 static void *SetupTunnel(Renderer r,OMX_U32 port) {
     OMX_PARAM_PORTDEFINITIONTYPE portdef;
     if(r == NULL)
       return NULL;
-    if(port == (r->DecodePort+1)) {
+    if(port == (r->DecodePort+1) && r->DecodeTunnelled) {
+      Reconfigure(r,&r->Reconfig[0],r->Decode,port,r->Resize ? r->Resize : r->Render,
+                  r->Resize ? r->ResizePort : r->RenderPort);
+    }
+    else if(port == (r->ResizePort+1) && r->ResizeTunnelled) {
+      Reconfigure(r,&r->Reconfig[1],r->Resize,port,r->Render,r->RenderPort);
+    }
+    else if(port == (r->DecodePort+1)) {
+      r->DecodeTunnelled = 1;
       if( r->Resize ) {
         // Setup tunnel between decode and resize
         printf("%s: adding tunnel from decode to resize\n",r->Name);
@@ -315,6 +447,7 @@ static void *SetupTunnel(Renderer r,OMX_U32 port) {
       }
     }
     else if(port == (r->ResizePort+1)) {
+      r->ResizeTunnelled = 1;
       // Setup tunnel between resize and render
       printf("%s: adding tunnel from resize to render\n",r->Name);
       WARN(r,OMX_SendCommand,r->Resize,OMX_CommandPortDisable,port, NULL);
@@ -537,6 +670,8 @@ void RenderRelease(void *handle) {
     if(r == NULL)
       return;
 
+    MonitorTimerCancel(r->Reconfig[0].Timer);
+    MonitorTimerCancel(r->Reconfig[1].Timer);
     // Disable and flush decoder port
     if(r->Decode) {
       OMX_SendCommand(r->Decode,OMX_CommandPortDisable,r->DecodePort+1,NULL);
@@ -590,8 +725,26 @@ void RenderRelease(void *handle) {
 //
 // Sets up a decoder/renderer for a H264 stream
 //
-void *RenderNew(char *Name,int Resizer) {
-    return SetupRenderer(Name,VIDEO_DECODE,VIDEO_RENDER,OMX_VIDEO_CodingAVC,Resizer);
+// What the firmware decoder is told for each codec. It has no HEVC
+// support so those streams can only be ingested.
+static const OMX_VIDEO_CODINGTYPE Coding[] = {
+    [CODEC_H264] = OMX_VIDEO_CodingAVC,
+    [CODEC_H265] = OMX_VIDEO_CodingUnused,
+};
+// The display size in pixels, views are fractions of it
+void RenderGetDisplaySize(int32_t *Width,int32_t *Height) {
+    *Width = DisplayInfo.width;
+    *Height = DisplayInfo.height;
+}
+int RenderCanDecode(VideoCodec Codec) {
+    return Codec < sizeof(Coding)/sizeof(Coding[0]) && Coding[Codec] != OMX_VIDEO_CodingUnused;
+}
+void *RenderNew(char *Name,int Resizer,VideoCodec Codec) {
+    if(!RenderCanDecode(Codec)) {
+      printf("%s: the decoder doesn't support this codec\n",Name);
+      return NULL;
+    }
+    return SetupRenderer(Name,VIDEO_DECODE,VIDEO_RENDER,Coding[Codec],Resizer);
 }
 //
 // Get a buffer to put stream data in
@@ -623,10 +776,79 @@ void *RenderGetBuffer(void *handle,int32_t *length) {
     return buff->Header->pBuffer;
 }
 //
+// Like RenderGetBuffer but marks the buffer as in use so it
+// won't be handed out again before it is processed. This is
+// for callers that fill buffers on a different thread to the
+// one that calls RenderProcessBuffer. A buffer that isn't
+// going to be processed must be given back with
+// RenderUnreserveBuffer.
+//
+void *RenderReserveBuffer(void *handle,int32_t *length) {
+    Renderer r = handle;
+    Buffer buff;
+    uint16_t unused;
+
+    if(r == NULL)
+      return NULL;
+    buff = r->DecodeBuffer;
+    for(int i=0; buff && i < r->NumberOfBuffers; i++, buff = buff->Next) {
+      unused = 0;
+      if(buff->Header->nFilledLen == 0 &&
+         __atomic_compare_exchange_n(&buff->InUse,&unused,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+        if(length)
+          *length = buff->Header->nAllocLen;
+        return buff->Header->pBuffer;
+      }
+    }
+    return NULL;
+}
+void RenderUnreserveBuffer(void *handle,void *data) {
+    Buffer buff;
+    if(handle == NULL || data == NULL)
+      return;
+    Renderer r = handle;
+    buff = data - offsetof(struct _Buffer,Buffer);
+    __atomic_store_n(&buff->InUse,0,__ATOMIC_RELEASE);
+    if(r->Freed)
+      r->Freed(r->FreedData);
+}
+// Freed is called, on any thread, whenever a buffer from
+// RenderReserveBuffer may have become free
+void RenderSetBufferFreed(void *handle,void (*Freed)(void *),void *Data) {
+    Renderer r = handle;
+    if(r == NULL)
+      return;
+    r->FreedData = Data;
+    r->Freed = Freed;
+}
+// How much a decoder buffer holds, they are all the same
+int32_t RenderBufferSize(void *handle) {
+    Renderer r = handle;
+    if(r == NULL || r->DecodeBuffer == NULL)
+      return 0;
+    return r->DecodeBuffer->Header->nAllocLen;
+}
+// Sets the presentation time, in microseconds, of the data going into
+// a buffer from RenderGetBuffer. Call before RenderProcessBuffer.
+void RenderSetTimeStamp(void *handle,void *data,int64_t us) {
+    Buffer buff;
+    if(handle == NULL || data == NULL)
+      return;
+    buff = data - offsetof(struct _Buffer,Buffer);
+#ifdef OMX_SKIP64BIT
+    buff->Header->nTimeStamp.nLowPart = (OMX_U32) us;
+    buff->Header->nTimeStamp.nHighPart = (OMX_U32) (us >> 32);
+#else
+    buff->Header->nTimeStamp = us;
+#endif
+}
+//
 // Process the data in buffer.
 // "data" pointer must have been obtained by calling RenderGetBuffer
-// length is how much data is in buffer and a non zero
-// flag indicates the End-Of-Stream
+// length is how much data is in buffer and flag is
+// RENDER_EOS for the End-Of-Stream and/or RENDER_CORRUPT
+// for data the decoder should conceal the damage in and/or
+// RENDER_ENDOFFRAME when the buffer ends on a frame boundary
 //
 void *RenderProcessBuffer(void *handle,void *data,int32_t length,int flag) {
     Renderer r = handle;
@@ -635,8 +857,13 @@ void *RenderProcessBuffer(void *handle,void *data,int32_t length,int flag) {
     buff = data - offsetof(struct _Buffer,Buffer);
     buff->Header->nFilledLen = length;
     buff->InUse++;
-    if(flag)
+    buff->Header->nFlags &= ~(OMX_BUFFERFLAG_DATACORRUPT | OMX_BUFFERFLAG_ENDOFFRAME);
+    if(flag & RENDER_EOS)
       buff->Header->nFlags = OMX_BUFFERFLAG_EOS;
+    if(flag & RENDER_CORRUPT)
+      buff->Header->nFlags |= OMX_BUFFERFLAG_DATACORRUPT;
+    if(flag & RENDER_ENDOFFRAME)
+      buff->Header->nFlags |= OMX_BUFFERFLAG_ENDOFFRAME;
     ABORT(r,OMX_EmptyThisBuffer,r->Decode, buff->Header);
     return r;
 }
@@ -17,10 +17,22 @@
 #ifndef _RENDERER_INCLUDED_
 #define _RENDERER_INCLUDED_
 
+// Flags for RenderProcessBuffer
+#define RENDER_EOS      1           // End of the stream
+#define RENDER_CORRUPT  2           // Part of the data was lost
+#define RENDER_ENDOFFRAME 4         // Ends with the last byte of a frame
+
 int  RenderInitialise(void);
 void RenderDeInitialise(void);
-void *RenderNew(char *,int);
+void *RenderNew(char *,int,VideoCodec);
+int  RenderCanDecode(VideoCodec);
+void RenderGetDisplaySize(int32_t *,int32_t *);
 void *RenderGetBuffer(void *,int32_t *);
+void *RenderReserveBuffer(void *,int32_t *);
+void RenderUnreserveBuffer(void *,void *);
+void RenderSetBufferFreed(void *,void (*)(void *),void *);
+int32_t RenderBufferSize(void *);
+void RenderSetTimeStamp(void *,void *,int64_t);
 void *RenderProcessBuffer(void *,void *,int32_t,int32_t);
 void RenderSetViewPort(void *,int,int,int,int,int,int,int,int);
 void RendererSetInvisible(void *);
@@ -0,0 +1,318 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "monitor.h"
+#include "rtp.h"
+#include "rtcp.h"
+
+//
+// RTCP receiver side (RFC 3550).
+//
+// Keeps the reception statistics for the camera's RTP stream:
+// extended highest sequence number, cumulative and interval loss
+// and interarrival jitter (appendix A.1, A.3 and A.8). Sender
+// reports are parsed so their timestamp can be echoed back, and
+// a receiver report with an SDES CNAME is sent every few seconds
+// so the camera doesn't time the session out and can see how its
+// stream is arriving. How the reports get there is up to the
+// caller, interleaved on the RTSP connection or over UDP.
+//
+
+#define RTCP_INTERVAL     5000      // Milliseconds between receiver reports
+#define RTCP_SR           200
+#define RTCP_RR           201
+#define RTCP_SDES         202
+#define RTCP_BYE          203
+#define SDES_CNAME        1
+#define DEFAULT_CLOCK     90000
+#define MAX_DROPOUT       3000      // Sequence jumps treated as loss
+#define MAX_MISORDER      100       // Sequence steps back treated as reordering
+#define SEQ_MOD           (1 << 16)
+#define REPORT_SIZE       64
+
+struct _Rtcp {
+    char        *Name;
+    RtcpSend     Send;
+    void        *Data;
+    MonitorTimer Timer;
+    uint32_t     OurSSRC;
+    int32_t      Started;           // Seen an RTP packet
+    uint16_t     MaxSeq;
+    uint32_t     Cycles;            // Sequence wraps, shifted up 16 bits
+    uint32_t     BaseSeq;
+    uint32_t     BadSeq;            // Where a sender restart would continue from
+    uint64_t     ExpectedPrior;     // At the last report
+    uint64_t     ReceivedPrior;
+    uint32_t     Transit;           // Previous arrival less RTP timestamp
+    uint64_t     Jitter;            // Scaled by 16 as in A.8
+    uint32_t     LastSR;            // Middle 32 bits of the last SR NTP timestamp
+    uint64_t     LastSRArrived;     // Microseconds
+    struct _RtcpStats Stats;
+};
+
+static void InitSeq(Rtcp r,uint16_t seq) {
+    r->BaseSeq = seq;
+    r->MaxSeq = seq;
+    r->BadSeq = SEQ_MOD + 1;
+    r->Cycles = 0;
+    r->ExpectedPrior = 0;
+    r->ReceivedPrior = 0;
+    r->Stats.Received = 0;
+    r->Jitter = 0;
+    r->Transit = 0;
+}
+// Appendix A.1 without the probation, there's only one sender.
+// Returns 0 for packets that shouldn't be counted.
+static int UpdateSeq(Rtcp r,uint16_t seq) {
+    uint16_t delta = seq - r->MaxSeq;
+
+    if(delta < MAX_DROPOUT) {
+      if(seq < r->MaxSeq)
+        r->Cycles += SEQ_MOD;
+      r->MaxSeq = seq;
+    }
+    else if(delta <= SEQ_MOD - MAX_MISORDER) {
+      // A big jump, believe it when the next packet follows on
+      if(seq != r->BadSeq) {
+        r->BadSeq = (seq + 1) & (SEQ_MOD - 1);
+        return 0;
+      }
+      InitSeq(r,seq);
+    }
+    r->Stats.Received++;
+    return 1;
+}
+static void Put16(uint8_t *p,uint32_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+static void Put32(uint8_t *p,uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+static uint32_t Get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+// Cumulative figures as of now
+static void UpdateTotals(Rtcp r) {
+    r->Stats.ExtendedMax = r->Cycles + r->MaxSeq;
+    r->Stats.Expected = (uint64_t) r->Cycles + r->MaxSeq - r->BaseSeq + 1;
+    r->Stats.Lost = (int64_t) r->Stats.Expected - (int64_t) r->Stats.Received;
+    r->Stats.Jitter = r->Jitter >> 4;
+}
+// Loss since the last report as well (appendix A.3)
+static void UpdateLoss(Rtcp r) {
+    uint64_t expected,interval;
+    int64_t lost;
+
+    UpdateTotals(r);
+    expected = r->Stats.Expected;
+    interval = expected - r->ExpectedPrior;
+    lost = (int64_t) interval - (int64_t)(r->Stats.Received - r->ReceivedPrior);
+    r->Stats.FractionLost = interval == 0 || lost <= 0 ? 0 : (lost << 8) / interval;
+    r->ExpectedPrior = expected;
+    r->ReceivedPrior = r->Stats.Received;
+}
+// A receiver report, with a report block once there is something
+// to report on, followed by the SDES chunk every compound needs
+static int32_t BuildReport(Rtcp r,uint8_t *p) {
+    static const char cname[] = "cctvplexer";
+    int32_t length,sdes;
+
+    p[0] = 0x80 | (r->Started ? 1 : 0);
+    p[1] = RTCP_RR;
+    Put32(p+4,r->OurSSRC);
+    length = 8;
+    if(r->Started) {
+      int64_t lost;
+      uint32_t dlsr = 0;
+
+      UpdateLoss(r);
+      lost = r->Stats.Lost;
+      // 24 bit signed cumulative loss
+      lost = lost > 0x7fffff ? 0x7fffff : lost < -0x800000 ? -0x800000 : lost;
+      if(r->LastSRArrived)
+        dlsr = (RtcpNow() - r->LastSRArrived) * 65536 / 1000000;
+      Put32(p+8,r->Stats.SSRC);
+      Put32(p+12,((uint32_t) r->Stats.FractionLost << 24) | ((uint32_t) lost & 0xffffff));
+      Put32(p+16,r->Stats.ExtendedMax);
+      Put32(p+20,r->Stats.Jitter);
+      Put32(p+24,r->LastSR);
+      Put32(p+28,r->LastSR ? dlsr : 0);
+      length += 24;
+    }
+    Put16(p+2,length/4 - 1);
+    p += length;
+    // One chunk with the CNAME item, null terminated and padded to 32 bits
+    sdes = (8 + 2 + sizeof(cname)-1 + 1 + 3) & ~3;
+    memset(p,0,sdes);
+    p[0] = 0x81;
+    p[1] = RTCP_SDES;
+    Put16(p+2,sdes/4 - 1);
+    Put32(p+4,r->OurSSRC);
+    p[8] = SDES_CNAME;
+    p[9] = sizeof(cname)-1;
+    memcpy(p+10,cname,sizeof(cname)-1);
+    return length + sdes;
+}
+static void ReportExpired(MonitorTimer t,void *data) {
+    Rtcp r = data;
+    uint8_t report[REPORT_SIZE];
+    int32_t length = BuildReport(r,report);
+
+    // Randomised by half either way (RFC 3550 6.3.5). Done first as
+    // a failed send can end the session and stop the timer.
+    MonitorTimerReschedule(t,RTCP_INTERVAL/2 + rand() % RTCP_INTERVAL);
+    if(r->Send(r->Data,report,length) == 0)
+      r->Stats.ReceiverReports++;
+}
+
+//
+// Public interface
+//
+
+// Send is called with each receiver report
+Rtcp RtcpNew(const char *Name,RtcpSend Send,void *Data) {
+    Rtcp r = calloc(1,sizeof(struct _Rtcp));
+
+    if(r == NULL)
+      return NULL;
+    r->Name = strdup(Name);
+    r->Send = Send;
+    r->Data = Data;
+    r->Stats.ClockRate = DEFAULT_CLOCK;
+    r->Timer = MonitorTimerAdd(0,ReportExpired,r);
+    MonitorTimerStop(r->Timer);
+    return r;
+}
+void RtcpRelease(Rtcp r) {
+    if(r == NULL)
+      return;
+    MonitorTimerCancel(r->Timer);
+    free(r->Name);
+    free(r);
+}
+// From the SDP rtpmap, for the jitter
+void RtcpSetClockRate(Rtcp r,uint32_t Rate) {
+    r->Stats.ClockRate = Rate ? Rate : DEFAULT_CLOCK;
+}
+// The session is playing, start from scratch and report periodically
+void RtcpStart(Rtcp r) {
+    uint32_t rate = r->Stats.ClockRate;
+
+    memset(&r->Stats,0,sizeof(r->Stats));
+    r->Stats.ClockRate = rate;
+    r->Started = 0;
+    r->LastSR = 0;
+    r->LastSRArrived = 0;
+    r->OurSSRC = ((uint32_t) rand() << 16) ^ rand();
+    MonitorTimerReschedule(r->Timer,RTCP_INTERVAL);
+}
+// The session has ended
+void RtcpStop(Rtcp r) {
+    if(!MonitorTimerPending(r->Timer))
+      return;
+    MonitorTimerStop(r->Timer);
+    if(r->Started) {
+      UpdateLoss(r);
+      printf("RTCP %s: %llu packets, %lld lost, jitter %.1fms, %llu sender reports\n",r->Name,
+             (unsigned long long) r->Stats.Received,(long long) r->Stats.Lost,
+             r->Stats.Jitter * 1000.0 / r->Stats.ClockRate,
+             (unsigned long long) r->Stats.SenderReports);
+    }
+}
+// Each RTP packet as it arrives, before any reordering. Arrived is
+// in microseconds from any clock as long as it is the same one.
+void RtcpRtp(Rtcp r,const uint8_t *Packet,int32_t Length,uint64_t Arrived) {
+    uint32_t ssrc,transit,arrival;
+    uint16_t seq;
+    int32_t d;
+
+    if(Length < RTP_MIN_HEADER || (Packet[0] & 0xc0) != 0x80)
+      return;
+    seq = (Packet[2] << 8) | Packet[3];
+    ssrc = Get32(Packet+8);
+    // Appendix A.8, arrival converted to timestamp units
+    arrival = (uint32_t)(Arrived / 1000000 * r->Stats.ClockRate +
+                         Arrived % 1000000 * r->Stats.ClockRate / 1000000);
+    transit = arrival - Get32(Packet+4);
+    if(r->Started == 0 || ssrc != r->Stats.SSRC) {
+      // First packet or the camera has restarted, when any sender
+      // report was from someone else
+      if(r->Started) {
+        r->LastSR = 0;
+        r->LastSRArrived = 0;
+      }
+      r->Stats.SSRC = ssrc;
+      r->Started = 1;
+      InitSeq(r,seq);
+      r->Stats.Received = 1;
+      r->Transit = transit;
+      return;
+    }
+    if(!UpdateSeq(r,seq))
+      return;
+    d = (int32_t)(transit - r->Transit);
+    if(d < 0)
+      d = -d;
+    r->Jitter += d - (int64_t)((r->Jitter + 8) >> 4);
+    r->Transit = transit;
+}
+// A compound RTCP packet from the camera
+void RtcpReceive(Rtcp r,const uint8_t *Packet,int32_t Length) {
+    while(Length >= 4) {
+      int32_t length = (((Packet[2] << 8) | Packet[3]) + 1) * 4;
+
+      if((Packet[0] & 0xc0) != 0x80 || length > Length) {
+        r->Stats.Invalid++;
+        return;
+      }
+      switch(Packet[1]) {
+        case RTCP_SR:
+          if(length < 28) {
+            r->Stats.Invalid++;
+            return;
+          }
+          r->LastSR = (Get32(Packet+8) << 16) | (Get32(Packet+12) >> 16);
+          r->LastSRArrived = RtcpNow();
+          r->Stats.SenderPackets = Get32(Packet+20);
+          r->Stats.SenderOctets = Get32(Packet+24);
+          r->Stats.SenderReports++;
+          break;
+        case RTCP_BYE:
+          r->Stats.Byes++;
+          printf("RTCP %s: camera said goodbye\n",r->Name);
+          break;
+      }
+      Packet += length;
+      Length -= length;
+    }
+}
+RtcpStats RtcpGetStats(Rtcp r) {
+    if(r->Started)
+      UpdateTotals(r);
+    return &r->Stats;
+}
@@ -0,0 +1,60 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _RTCP_H_INCLUDED_
+#define _RTCP_H_INCLUDED_
+
+#define RTCP_CHANNEL      1         // Interleaved channel for RTCP
+
+typedef struct _Rtcp      *Rtcp;
+typedef struct _RtcpStats *RtcpStats;
+
+// Reception statistics for the current session (RFC 3550 6.4)
+struct _RtcpStats {
+    uint32_t SSRC;                  // The camera's
+    uint64_t Received;              // RTP packets
+    uint32_t ExtendedMax;           // Highest sequence number, wraps in the top 16 bits
+    uint64_t Expected;
+    int64_t  Lost;                  // Expected less received, negative with duplicates
+    uint8_t  FractionLost;          // Out of 256, over the last report interval
+    uint32_t Jitter;                // Interarrival jitter in timestamp units
+    uint32_t ClockRate;             // Timestamp units per second
+    uint64_t SenderReports;
+    uint64_t ReceiverReports;       // Sent by us
+    uint64_t Byes;
+    uint64_t Invalid;               // RTCP packets that couldn't be parsed
+    uint32_t SenderPackets;         // From the last sender report
+    uint32_t SenderOctets;
+};
+// Sends a compound RTCP packet to the camera
+typedef int (*RtcpSend)(void *,const uint8_t *,int32_t);
+
+// Monotonic microseconds, for packet arrival times. Needs time.h
+static inline uint64_t RtcpNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+Rtcp RtcpNew(const char *,RtcpSend,void *);
+void RtcpRelease(Rtcp);
+void RtcpSetClockRate(Rtcp,uint32_t);
+void RtcpStart(Rtcp);
+void RtcpStop(Rtcp);
+void RtcpRtp(Rtcp,const uint8_t *,int32_t,uint64_t);
+void RtcpReceive(Rtcp,const uint8_t *,int32_t);
+RtcpStats RtcpGetStats(Rtcp);
+#endif
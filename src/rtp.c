@@ -0,0 +1,989 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "render.h"
+#include "monitor.h"
+#include "nal.h"
+#include "fanout.h"
+#include "rtp.h"
+
+//
+// RTP depacketizer for H264 (RFC 6184) and H265 (RFC 7798).
+//
+// Turns RTP packets back into an Annex B byte stream for the decoder.
+// For H264 single NAL units, STAP-A/B, MTAP16/24 and FU-A/B are
+// handled, for H265 single NAL units, APs, FUs and PACI packets.
+// Packets are collected into whole access units, ended by the marker
+// bit or a change of timestamp, so the decoder normally gets one
+// buffer per frame rather than one per packet.
+//
+// Packets can be passed in whole with RtpDepackPacket() or, to avoid
+// a copy, in two parts. RtpDepackBegin() is given the first part,
+// which must include the RTP header and RTP_PEEK payload bytes (or
+// the whole packet if it is shorter), and returns where the rest of
+// the packet should be read to. RtpDepackEnd() is called once it has
+// been. For single NAL units and fragments that is the decoder buffer
+// itself; aggregation packets have to be seen whole so are staged.
+//
+// Interleaved mode (STAP-B, MTAP, FU-B, H265 DONL) is accepted but NAL
+// units are passed on in arrival order rather than decoding order.
+//
+// A stream the decoder can't handle, such as H265 on the Pi, is still
+// put together into access units, in a buffer of its own, for the
+// camera's fanout (for recording or relaying). Access units going to
+// the decoder are published to the fanout as well.
+//
+// A depacketizer can be held, which it is whenever a stream starts or
+// restarts and while a new stream is started alongside the one being
+// shown. Everything is dropped up to a picture the decoder can start
+// from (an IDR, for H265 any IRAP, or a recovery point SEI) so it
+// isn't given frames that refer to ones it never had. Parameter sets
+// are kept to go ahead of it. The callback, if any, decides whether to
+// go live there.
+//
+// A depacketizer can also be kept warm, for a stream that may be
+// switched to soon. Access units go to a buffer of its own rather
+// than the decoder, and each key frame replaces what is there, so when
+// it goes live the decoder is given the frames from the last key frame
+// on and can show the stream straight away.
+//
+// Lost packets show up as gaps in the sequence numbers. A NAL unit
+// missing fragments is never passed on. If only a frame nothing else
+// refers to was hit just it is dropped, otherwise everything is held
+// until the next key frame. With Conceal set the damaged frame goes to
+// the decoder instead, flagged as corrupt, for it to cover up.
+//
+
+#define START_CODE_LENGTH   4
+#define STAGE_SIZE          65536   // Biggest interleaved or UDP packet
+#define PUBLISH_SIZE        (1024*1024)  // Biggest access unit published
+#define WARM_SIZE           (4*1024*1024)  // Key frame to key frame for a busy 1080p stream
+#define GATE_SETS           1024    // In band parameter sets kept while held
+#define MAX_MISORDER        100     // Sequence steps back taken as late packets
+
+enum DepackMode {
+    DM_NONE = 0,                    // Packet dealt with in RtpDepackBegin
+    DM_DIRECT,                      // Rest goes straight to the decoder buffer
+    DM_STAGED,                      // Rest goes to Stage to be handled at the end
+    DM_DISCARD,                     // Rest goes to Stage and is thrown away
+};
+// How a single NAL unit or fragment is written out: Prefix, which is
+// the start code and any rebuilt NAL header, then the payload from Skip
+typedef struct _Plan *Plan;
+struct _Plan {
+    int32_t Skip;
+    int32_t PrefixLength;
+    uint8_t Prefix[START_CODE_LENGTH+2];
+    int32_t FUStart;
+    int32_t FUEnd;
+};
+struct _RtpDepack {
+    const char *Name;
+    void       *Renderer;
+    VideoCodec  DecoderCodec;       // What Renderer can decode
+    VideoCodec  Codec;              // What the stream is
+    int32_t     Donl;               // H265 decoding order numbers are present
+    int32_t     Decode;             // Codec can go to Renderer
+    Fanout      Fanout;             // Gets a copy of what is passed on
+    uint8_t    *PublishBuffer;      // For a stream that isn't decoded
+    uint8_t    *FanoutStage;        // An access unit passed on in pieces
+    int32_t     Staged;             // Bytes of it, -1 if it isn't being published
+    int32_t     Split;              // Part of the access unit has been passed on
+    // The buffer being filled
+    uint8_t    *Buffer;
+    int32_t     Size;
+    int32_t     Used;
+    uint32_t    Timestamp;          // Of the access unit in Buffer
+    int32_t     InFU;               // A fragmented NAL unit is in progress
+    int32_t     FUAt;               // Where it starts in Buffer
+    int32_t     RefAU;              // The access unit is a reference picture
+    // Loss
+    uint16_t    Seq;                // Expected next
+    int32_t     SeqValid;
+    int32_t     Damaged;            // Part of the access unit was lost
+    int32_t     Conceal;            // Let the decoder cover up losses
+    // The packet between RtpDepackBegin and RtpDepackEnd
+    enum DepackMode Mode;
+    int32_t     Remaining;          // Bytes the caller is reading
+    int32_t     Length;
+    int32_t     Padding;
+    int32_t     Marker;
+    int32_t     FUEnd;
+    // Waiting for a key frame
+    int32_t     Held;
+    RtpKeyFrame KeyFrame;
+    void       *KeyFrameData;
+    uint64_t    HeldSince;          // Monotonic ms
+    uint64_t    HeldBytes;          // Dropped since then
+    uint8_t    *HeldSets;           // SDP parameter sets to go ahead of it
+    int32_t     HeldSetsLength;
+    uint8_t     GateSets[GATE_SETS];  // Then the latest in band ones
+    int32_t     GateSetsLength;
+    // Keeping access units for later, Buffer is WarmBuffer
+    int32_t     Warm;
+    int32_t     WantWarm;           // Changes Warm between packets
+    uint8_t    *WarmBuffer;
+    int32_t     Kept;               // Bytes of whole access units in it
+    int32_t     KeyAU;              // The access unit being built starts a key frame
+    int32_t     Ready;              // What is kept starts with a key frame
+    int32_t     Draining;           // Live, WarmBuffer still going to the decoder
+    int32_t     Sent;               // Bytes of it the decoder has had
+    struct _RtpDepackStats Stats;
+    uint8_t     Stage[STAGE_SIZE];
+};
+
+static const uint8_t StartCode[START_CODE_LENGTH] = { 0, 0, 0, 1 };
+
+static void Complete(RtpDepack,const uint8_t *,int32_t);
+
+// Warm, the access unit just finished is kept. If it starts a key
+// frame it replaces everything before it.
+static void Keep(RtpDepack d) {
+    if(d->KeyAU) {
+      memmove(d->Buffer,d->Buffer + d->Kept,d->Used - d->Kept);
+      d->Used -= d->Kept;
+      d->Ready = 1;
+      d->KeyAU = 0;
+    }
+    d->Kept = d->Used;
+}
+// Gone live from warm, passes what was kept to the decoder as it has
+// buffers for it. Once it has had it all the access unit being built
+// moves to a decoder buffer and things carry on as normal.
+static void Drain(RtpDepack d) {
+    uint8_t *buffer;
+    int32_t size,n;
+
+    while(d->Sent < d->Kept && (buffer = RenderGetBuffer(d->Renderer,&size)) != NULL) {
+      n = d->Kept - d->Sent < size ? d->Kept - d->Sent : size;
+      memcpy(buffer,d->Buffer + d->Sent,n);
+      RenderProcessBuffer(d->Renderer,buffer,n,0);
+      d->Stats.Buffers++;
+      d->Sent += n;
+    }
+    if(d->Sent < d->Kept || (buffer = RenderGetBuffer(d->Renderer,&size)) == NULL || size < d->Used - d->Kept)
+      return;
+    n = d->Used - d->Kept;
+    memcpy(buffer,d->Buffer + d->Kept,n);
+    d->Buffer = buffer;
+    d->Size = size;
+    d->Used = n;
+    d->Kept = d->Sent = 0;
+    d->Draining = 0;
+}
+// Publishes to Fanout what is being passed on. An access unit that
+// doesn't fit in one buffer is put back together first so sinks only
+// ever see whole ones. End is non zero if this finishes it.
+static void Publish(RtpDepack d,const uint8_t *data,int32_t length,int32_t end) {
+    if(!d->Split) {
+      if(end) {
+        FanoutPublish(d->Fanout,data,length,FANOUT_FRAMED | (d->KeyAU ? FANOUT_KEY : 0));
+        return;
+      }
+      d->Split = 1;
+      d->Staged = FanoutWanted(d->Fanout) ? 0 : -1;
+    }
+    if(d->Staged >= 0) {
+      if(d->FanoutStage == NULL)
+        d->FanoutStage = malloc(PUBLISH_SIZE);
+      if(d->FanoutStage == NULL || d->Staged + length > PUBLISH_SIZE) {
+        printf("Camera %s: access unit too big to publish\n",d->Name);
+        d->Staged = -1;
+      }
+      else {
+        memcpy(d->FanoutStage + d->Staged,data,length);
+        d->Staged += length;
+      }
+    }
+    if(!end)
+      return;
+    if(d->Staged > 0)
+      FanoutPublish(d->Fanout,d->FanoutStage,d->Staged,FANOUT_FRAMED | (d->KeyAU ? FANOUT_KEY : 0));
+    d->Split = d->Staged = 0;
+}
+// Passes what has been collected on. End is non zero at the end of
+// an access unit, zero if it has filled a buffer part way through.
+static void Flush(RtpDepack d,int32_t end) {
+    if(d->InFU)
+      d->FUAt = 0;
+    if(d->Buffer && d->Used > d->Kept) {
+      if(d->Damaged && (!d->Conceal || !d->Decode || d->Warm || d->Draining)) {
+        // Can't be flagged so goes, see Lost, and nor is the rest of it published
+        d->Used = d->Kept;
+        d->Stats.Damaged++;
+        d->Split = !end;
+        d->Staged = end ? 0 : -1;
+        return;
+      }
+      if(!d->Warm)
+        Publish(d,d->Buffer + d->Kept,d->Used - d->Kept,end);
+      if(d->Warm) {
+        Keep(d);
+        return;
+      }
+      if(d->Draining) {
+        d->Kept = d->Used;
+        Drain(d);
+        return;
+      }
+      if(d->Decode) {
+        RenderProcessBuffer(d->Renderer,d->Buffer,d->Used,d->Damaged ? RENDER_CORRUPT : 0);
+        d->Stats.Damaged += d->Damaged ? 1 : 0;
+        d->Stats.Buffers++;
+        d->Buffer = NULL;
+      }
+      else
+        d->Stats.Ingested++;
+      d->Used = 0;
+    }
+    else if(end && d->Split)
+      Publish(d,NULL,0,1);
+}
+// Drop everything until a picture the decoder can start from
+static void Hold(RtpDepack d,RtpKeyFrame KeyFrame,void *Data) {
+    d->Held = 1;
+    d->KeyFrame = KeyFrame;
+    d->KeyFrameData = Data;
+    d->HeldSince = MonitorNow();
+    d->HeldBytes = 0;
+    d->GateSetsLength = 0;
+    d->Damaged = 0;
+    d->Split = d->Staged = 0;
+}
+// Makes room in WarmBuffer. Warm, it has been too long since the last
+// key frame so the next one is waited for. Draining, what the decoder
+// has had goes, and if that isn't enough it has fallen too far behind
+// and has to start again from a key frame.
+static int Compact(RtpDepack d,int32_t need) {
+    int32_t drop = d->Warm ? d->Kept : d->Sent;
+
+    memmove(d->Buffer,d->Buffer + drop,d->Used - drop);
+    d->Used -= drop;
+    d->Kept -= drop;
+    d->FUAt = d->FUAt > drop ? d->FUAt - drop : 0;
+    d->Sent = 0;
+    if(d->Warm)
+      d->Ready = 0;
+    if(d->Size - d->Used >= need)
+      return 1;
+    if(d->Draining) {
+      printf("Camera %s: decoder too far behind the warm stream\n",d->Name);
+      d->Draining = 0;
+      d->Buffer = NULL;
+      d->Used = d->Kept = 0;
+      Hold(d,NULL,NULL);
+    }
+    else {
+      printf("RTP access unit too big for camera %s\n",d->Name);
+      d->Used = 0;
+    }
+    return 0;
+}
+// Makes sure there is room for Need more bytes, starting a new
+// buffer if necessary. Returns 0 if there isn't.
+static int Reserve(RtpDepack d,int32_t need) {
+    if(d->Buffer && d->Size - d->Used >= need)
+      return 1;
+    if(d->Warm || d->Draining)
+      return Compact(d,need);
+    Flush(d,0);
+    if(d->Buffer == NULL) {
+      if(d->Decode) {
+        d->Buffer = RenderGetBuffer(d->Renderer,&d->Size);
+      }
+      else {
+        if(d->PublishBuffer == NULL)
+          d->PublishBuffer = malloc(PUBLISH_SIZE);
+        d->Buffer = d->PublishBuffer;
+        d->Size = PUBLISH_SIZE;
+      }
+      if(d->Buffer == NULL) {
+        printf("Error getting buffer for camera %s\n",d->Name);
+        return 0;
+      }
+    }
+    if(d->Size < need) {
+      printf("RTP packet too big for camera %s\n",d->Name);
+      return 0;
+    }
+    return 1;
+}
+// Whether a NAL unit starts a key frame, either the parameter sets or
+// a picture the decoder can start from. Body is the Avail bytes after
+// the header.
+static int KeyNal(RtpDepack d,const uint8_t *header,const uint8_t *body,int32_t avail) {
+    return NalFirstSet(d->Codec,header) || NalRandomAccess(d->Codec,header,body,avail);
+}
+// The parameter sets kept while held or warm go to the decoder, those
+// from the SDP then the latest from the stream
+static void SendHeldSets(RtpDepack d) {
+    if(d->HeldSets) {
+      RtpDepackSetParameterSets(d,d->HeldSets,d->HeldSetsLength);
+      free(d->HeldSets);
+      d->HeldSets = NULL;
+    }
+    if(d->GateSetsLength) {
+      RtpDepackSetParameterSets(d,d->GateSets,d->GateSetsLength);
+      d->GateSetsLength = 0;
+    }
+}
+// While held, keeps a parameter set that arrives in two parts, the
+// first starting with Header, to go ahead of the key frame
+static void KeepSet(RtpDepack d,const uint8_t *header,const uint8_t *part1,int32_t length1,
+                    const uint8_t *part2,int32_t length2) {
+    if(NalFirstSet(d->Codec,header))
+      d->GateSetsLength = 0;
+    if(d->GateSetsLength + START_CODE_LENGTH + length1 + length2 > GATE_SETS)
+      return;
+    memcpy(d->GateSets + d->GateSetsLength,StartCode,START_CODE_LENGTH);
+    d->GateSetsLength += START_CODE_LENGTH;
+    memcpy(d->GateSets + d->GateSetsLength,part1,length1);
+    d->GateSetsLength += length1;
+    memcpy(d->GateSets + d->GateSetsLength,part2,length2);
+    d->GateSetsLength += length2;
+}
+// While held, whether to go live from the NAL unit with Header
+static int Release(RtpDepack d,const uint8_t *header,const uint8_t *body,int32_t avail) {
+    if(!NalRandomAccess(d->Codec,header,body,avail) || (d->KeyFrame && !d->KeyFrame(d->KeyFrameData)))
+      return 0;
+    d->Held = 0;
+    d->Stats.Releases++;
+    d->Stats.Discarded += d->HeldBytes;
+    d->Stats.LastCleanMS = MonitorNow() - d->HeldSince;
+    printf("Camera %s: first clean frame after %u ms, %llu bytes discarded\n",
+           d->Name,d->Stats.LastCleanMS,(unsigned long long) d->HeldBytes);
+    SendHeldSets(d);
+    return 1;
+}
+// Starts or stops keeping access units, between packets
+static void ChangeWarm(RtpDepack d) {
+    int32_t used = d->Used,kept = d->Kept;
+
+    if(d->WantWarm) {
+      if(d->WarmBuffer == NULL && (d->WarmBuffer = malloc(WARM_SIZE)) == NULL) {
+        printf("No memory to keep camera %s warm\n",d->Name);
+        d->WantWarm = 0;
+        return;
+      }
+      // Anything on its way to the decoder is dropped, as is any hold
+      RtpDepackReset(d);
+      d->Draining = 0;
+      d->Held = 0;
+      d->KeyFrame = NULL;
+      d->GateSetsLength = 0;
+      d->Warm = 1;
+      d->Buffer = d->WarmBuffer;
+      d->Size = WARM_SIZE;
+      return;
+    }
+    d->Warm = 0;
+    d->Buffer = NULL;
+    d->Used = d->Kept = 0;
+    if(!d->Ready || !d->Decode) {
+      // Nothing the decoder can start from so wait for a key frame
+      d->InFU = 0;
+      Hold(d,NULL,NULL);
+      return;
+    }
+    SendHeldSets(d);
+    d->Buffer = d->WarmBuffer;
+    d->Size = WARM_SIZE;
+    d->Used = used;
+    d->Kept = kept;
+    d->Sent = 0;
+    d->Draining = 1;
+    d->Stats.WarmStarts++;
+    Drain(d);
+}
+static void NalUnit(RtpDepack d,const uint8_t *nal,int32_t length) {
+    int32_t header = NalHeaderLength(d->Codec);
+
+    if(length <= 0)
+      return;
+    if(d->Held) {
+      if(NalParameterSet(d->Codec,nal)) {
+        KeepSet(d,nal,nal,length,NULL,0);
+        return;
+      }
+      if(!Release(d,nal,nal + header,length - header)) {
+        d->Stats.Held++;
+        d->HeldBytes += length;
+        return;
+      }
+    }
+    if(!Reserve(d,length + START_CODE_LENGTH))
+      return;
+    memcpy(d->Buffer + d->Used,StartCode,START_CODE_LENGTH);
+    memcpy(d->Buffer + d->Used + START_CODE_LENGTH,nal,length);
+    d->Used += length + START_CODE_LENGTH;
+    d->Stats.NalUnits++;
+    if(NalReference(d->Codec,nal))
+      d->RefAU = 1;
+    if(KeyNal(d,nal,nal + header,length - header))
+      d->KeyAU = 1;
+}
+
+//
+// H264
+//
+
+// Returns 1 for a single NAL unit or fragment, 0 for an aggregation
+// packet and -1 for something to drop
+static int PlanH264(RtpDepack d,const uint8_t *payload,int32_t length,Plan plan) {
+    enum PktType ptype = *payload & 0x1f;
+
+    memcpy(plan->Prefix,StartCode,START_CODE_LENGTH);
+    plan->PrefixLength = START_CODE_LENGTH;
+    plan->Skip = 0;
+    plan->FUStart = plan->FUEnd = 0;
+    switch(ptype) {
+      case PT_NAL_01:
+      case PT_NAL_02:
+      case PT_NAL_03:
+      case PT_NAL_04:
+      case PT_NAL_05:
+      case PT_NAL_06:
+      case PT_NAL_07:
+      case PT_NAL_08:
+      case PT_NAL_09:
+      case PT_NAL_10:
+      case PT_NAL_11:
+      case PT_NAL_12:
+      case PT_NAL_13:
+      case PT_NAL_14:
+      case PT_NAL_15:
+      case PT_NAL_16:
+      case PT_NAL_17:
+      case PT_NAL_18:
+      case PT_NAL_19:
+      case PT_NAL_20:
+      case PT_NAL_21:
+      case PT_NAL_22:
+      case PT_NAL_23:
+        return 1;
+      case PT_FU_A:
+      case PT_FU_B:
+        // FU indicator, FU header and for FU-B a decoding order number
+        plan->Skip = ptype == PT_FU_B ? 4 : 2;
+        if(length < plan->Skip)
+          return -1;
+        if(payload[1] & 0x80) {
+          // The start, rebuild the NAL header from the NRI flags and type
+          plan->Prefix[START_CODE_LENGTH] = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+          plan->PrefixLength++;
+          plan->FUStart = 1;
+        }
+        else if(!d->InFU) {
+          // The start has been lost so the rest is no use
+          return -1;
+        }
+        else {
+          plan->PrefixLength = 0;
+        }
+        plan->FUEnd = payload[1] & 0x40;
+        return 1;
+      case PT_STAP_A:
+      case PT_STAP_B:
+      case PT_MTAP16:
+      case PT_MTAP24:
+        return 0;
+      case PT_RES_00:
+      case PT_RES_30:
+      case PT_RES_31:
+        printf("Reserved packet type %i\n",ptype);
+        break;
+    }
+    return -1;
+}
+// STAP and MTAP
+static void AggregateH264(RtpDepack d,const uint8_t *payload,int32_t length) {
+    enum PktType ptype = *payload & 0x1f;
+    // Skip the type and any decoding order number base
+    int32_t offset = ptype == PT_STAP_A ? 1 : 3;
+    // Per NAL unit: 2 byte size then for MTAPs a DON difference and timestamp offset
+    int32_t extra = ptype == PT_MTAP16 ? 3 : ptype == PT_MTAP24 ? 4 : 0;
+
+    while(offset + 2 <= length) {
+      int32_t size = (payload[offset] << 8) | payload[offset+1];
+      offset += 2;
+      if(size < extra || offset + size > length) {
+        printf("Bad aggregation packet for camera %s\n",d->Name);
+        d->Stats.Dropped++;
+        return;
+      }
+      NalUnit(d,payload + offset + extra,size - extra);
+      offset += size;
+    }
+}
+
+//
+// H265
+//
+
+static int PlanH265(RtpDepack d,const uint8_t *payload,int32_t length,Plan plan) {
+    int32_t type = (payload[0] >> 1) & 0x3f;
+    int32_t donl = d->Donl ? 2 : 0;
+
+    memcpy(plan->Prefix,StartCode,START_CODE_LENGTH);
+    plan->PrefixLength = START_CODE_LENGTH;
+    plan->Skip = 0;
+    plan->FUStart = plan->FUEnd = 0;
+    if(length < 3)
+      return -1;
+    if(type < PT_H265_AP) {
+      if(donl == 0)
+        return 1;
+      // Keep the 2 byte NAL header but not the DONL after it
+      plan->Prefix[START_CODE_LENGTH]   = payload[0];
+      plan->Prefix[START_CODE_LENGTH+1] = payload[1];
+      plan->PrefixLength += 2;
+      plan->Skip = 2 + donl;
+      return length > plan->Skip ? 1 : -1;
+    }
+    switch(type) {
+      case PT_H265_FU: {
+        uint8_t fu = payload[2];
+        // Payload header, FU header and on the first fragment the DONL
+        plan->Skip = 3;
+        if(fu & 0x80) {
+          // The start, the NAL header is the payload header with the FU type
+          plan->Skip += donl;
+          plan->Prefix[START_CODE_LENGTH]   = (payload[0] & 0x81) | ((fu & 0x3f) << 1);
+          plan->Prefix[START_CODE_LENGTH+1] = payload[1];
+          plan->PrefixLength += 2;
+          plan->FUStart = 1;
+        }
+        else if(!d->InFU) {
+          return -1;
+        }
+        else {
+          plan->PrefixLength = 0;
+        }
+        plan->FUEnd = fu & 0x40;
+        return length >= plan->Skip ? 1 : -1;
+      }
+      case PT_H265_AP:
+      case PT_H265_PACI:
+        return 0;
+      default:
+        printf("Reserved H265 packet type %i\n",type);
+        return -1;
+    }
+}
+// Aggregation packet or PACI
+static void AggregateH265(RtpDepack d,const uint8_t *payload,int32_t length) {
+    int32_t type = (payload[0] >> 1) & 0x3f;
+    int32_t offset = 2;
+
+    if(type == PT_H265_PACI) {
+      // Payload header, PACI fields and header extensions, then a
+      // payload with the header's type replaced by cType
+      int32_t ctype = (payload[2] >> 1) & 0x3f;
+      int32_t phssize = ((payload[2] & 1) << 4) | (payload[3] >> 4);
+      offset = 4 + phssize;
+      if(ctype == PT_H265_PACI || offset >= length) {
+        d->Stats.Dropped++;
+        return;
+      }
+      // Rebuild the inner payload in the stage (it may already be there)
+      memmove(d->Stage + 2,payload + offset,length - offset);
+      d->Stage[0] = (payload[0] & 0x81) | (ctype << 1);
+      d->Stage[1] = payload[1];
+      Complete(d,d->Stage,length - offset + 2);
+      return;
+    }
+    // The first NAL unit may have a DONL, the rest a DOND
+    offset += d->Donl ? 2 : 0;
+    for(int first = 1; ; first = 0) {
+      if(!first && d->Donl)
+        offset++;
+      if(offset + 2 > length)
+        break;
+      int32_t size = (payload[offset] << 8) | payload[offset+1];
+      offset += 2;
+      if(size < 2 || offset + size > length) {
+        printf("Bad aggregation packet for camera %s\n",d->Name);
+        d->Stats.Dropped++;
+        return;
+      }
+      NalUnit(d,payload + offset,size);
+      offset += size;
+    }
+}
+
+//
+// Both
+//
+
+static int PlanPayload(RtpDepack d,const uint8_t *payload,int32_t length,Plan plan) {
+    return d->Codec == CODEC_H265 ? PlanH265(d,payload,length,plan) : PlanH264(d,payload,length,plan);
+}
+// The NAL header is either rebuilt in the prefix or starts the payload
+static const uint8_t *PlanHeader(Plan plan,const uint8_t *payload) {
+    return plan->PrefixLength > START_CODE_LENGTH ? plan->Prefix + START_CODE_LENGTH : payload + plan->Skip;
+}
+// Makes room for and writes the prefix for a planned packet. Avail
+// bytes of the Length byte payload have arrived.
+static int StartPlan(RtpDepack d,Plan plan,const uint8_t *payload,int32_t length,int32_t avail) {
+    const uint8_t *header = PlanHeader(plan,payload);
+    const uint8_t *body = payload + plan->Skip;
+
+    if(plan->PrefixLength <= START_CODE_LENGTH)
+      body += NalHeaderLength(d->Codec);
+    if(d->Held) {
+      if(plan->PrefixLength && !plan->FUStart && NalParameterSet(d->Codec,header)) {
+        // Always whole, see RtpDepackBegin
+        KeepSet(d,header,plan->Prefix + START_CODE_LENGTH,plan->PrefixLength - START_CODE_LENGTH,
+                payload + plan->Skip,length - plan->Skip);
+        return 0;
+      }
+      if(plan->PrefixLength == 0 || !Release(d,header,body,avail - (body - payload))) {
+        d->Stats.Held++;
+        d->HeldBytes += length - plan->Skip;
+        d->InFU = 0;
+        return 0;
+      }
+    }
+    if(!Reserve(d,plan->PrefixLength + length - plan->Skip)) {
+      d->InFU = 0;
+      return 0;
+    }
+    if(plan->FUStart)
+      d->FUAt = d->Used;
+    memcpy(d->Buffer + d->Used,plan->Prefix,plan->PrefixLength);
+    d->Used += plan->PrefixLength;
+    if(plan->PrefixLength) {
+      d->Stats.NalUnits++;
+      if(NalReference(d->Codec,header))
+        d->RefAU = 1;
+      if(KeyNal(d,header,body,avail - (body - payload)))
+        d->KeyAU = 1;
+    }
+    if(plan->FUStart)
+      d->InFU = 1;
+    return 1;
+}
+// A payload that is all here, padding removed
+static void Complete(RtpDepack d,const uint8_t *payload,int32_t length) {
+    struct _Plan plan;
+
+    switch(PlanPayload(d,payload,length,&plan)) {
+      case 1:
+        if(StartPlan(d,&plan,payload,length,length)) {
+          memcpy(d->Buffer + d->Used,payload + plan.Skip,length - plan.Skip);
+          d->Used += length - plan.Skip;
+          if(plan.FUEnd)
+            d->InFU = 0;
+        }
+        break;
+      case 0:
+        if(d->Codec == CODEC_H265)
+          AggregateH265(d,payload,length);
+        else
+          AggregateH264(d,payload,length);
+        break;
+      default:
+        d->Stats.Dropped++;
+        break;
+    }
+}
+// Count packets have gone missing before one with timestamp TS. A
+// part built NAL unit is no use. If only a frame that nothing refers
+// to has been hit it is dropped, or with Conceal flagged, otherwise
+// everything up to the next key frame is, or with Conceal just the
+// frame the loss was in is flagged.
+static void Lost(RtpDepack d,int32_t count,uint32_t ts) {
+    int32_t unreferenced = ts == d->Timestamp && d->Used > d->Kept && !d->RefAU;
+
+    d->Stats.LossEvents++;
+    d->Stats.Lost += count;
+    if(d->Held)
+      return;
+    if(d->InFU) {
+      if(d->FUAt >= d->Kept && d->FUAt <= d->Used)
+        d->Used = d->FUAt;
+      d->InFU = 0;
+      d->Stats.FUDropped++;
+    }
+    if(d->Warm) {
+      // Nothing kept is any use until the next key frame
+      d->Used = d->Kept = 0;
+      d->KeyAU = d->Ready = 0;
+      return;
+    }
+    if(d->Conceal || unreferenced) {
+      d->Damaged = 1;
+      return;
+    }
+    printf("Camera %s: lost %i packets, waiting for a key frame\n",d->Name,count);
+    if(d->Buffer == d->WarmBuffer || d->Decode)
+      d->Buffer = NULL;
+    d->Used = d->Kept = d->Sent = 0;
+    d->Draining = 0;
+    d->Stats.LossHolds++;
+    Hold(d,NULL,NULL);
+}
+// A packet has been finished with so see if it ends the access unit
+static void EndPacket(RtpDepack d) {
+    if(d->Marker) {
+      Flush(d,1);
+      d->Stats.AccessUnits++;
+      d->Damaged = d->RefAU = d->KeyAU = 0;
+    }
+    d->Mode = DM_NONE;
+    if(d->Warm != d->WantWarm)
+      ChangeWarm(d);
+}
+
+//
+// Public interface
+//
+
+// Renderer decodes DecoderCodec. NULL if there isn't one.
+RtpDepack RtpDepackNew(const char *Name,void *Renderer,VideoCodec DecoderCodec) {
+    RtpDepack d = calloc(1,sizeof(struct _RtpDepack));
+    if(d == NULL)
+      return NULL;
+    d->Name = Name;
+    d->Renderer = Renderer;
+    d->DecoderCodec = DecoderCodec;
+    RtpDepackSetCodec(d,DecoderCodec,0);
+    return d;
+}
+// Publish the access units passed on to Fanout as well
+void RtpDepackSetFanout(RtpDepack d,void *Fanout) {
+    d->Fanout = Fanout;
+}
+// Pass frames damaged by packet loss to the decoder flagged as corrupt
+// rather than waiting for a key frame
+void RtpDepackSetConceal(RtpDepack d,int32_t Conceal) {
+    d->Conceal = Conceal;
+}
+void RtpDepackRelease(RtpDepack d) {
+    if(d == NULL)
+      return;
+    free(d->HeldSets);
+    free(d->PublishBuffer);
+    free(d->FanoutStage);
+    free(d->WarmBuffer);
+    free(d);
+}
+// Set what the stream is from the SDP. Donl is non zero when H265
+// decoding order numbers are present (sprop-max-don-diff > 0).
+void RtpDepackSetCodec(RtpDepack d,VideoCodec Codec,int32_t Donl) {
+    int decode = d->Renderer && Codec == d->DecoderCodec;
+    if(Codec != d->Codec || decode != d->Decode) {
+      // Anything partly done was for the old setup
+      RtpDepackReset(d);
+      d->Draining = 0;
+      if(!d->Warm)
+        d->Buffer = NULL;
+      if(!decode)
+        printf("Camera %s: %s stream can't be decoded, fanout only\n",
+               d->Name,Codec == CODEC_H265 ? "H265" : "H264");
+    }
+    d->Codec = Codec;
+    d->Donl = Donl;
+    d->Decode = decode;
+}
+// Passes on the parameter sets from the SDP, in Annex B, ahead of
+// the first packet so the first IDR can be decoded straight away
+void RtpDepackSetParameterSets(RtpDepack d,const uint8_t *Sets,int32_t Length) {
+    if(d->Held || d->Warm) {
+      // Kept until the key frame
+      free(d->HeldSets);
+      if((d->HeldSets = malloc(Length)) != NULL)
+        memcpy(d->HeldSets,Sets,Length);
+      d->HeldSetsLength = Length;
+      return;
+    }
+    Flush(d,1);
+    if(!Reserve(d,Length))
+      return;
+    memcpy(d->Buffer + d->Used,Sets,Length);
+    d->Used += Length;
+    d->KeyAU = 1;
+    Flush(d,1);
+    d->KeyAU = 0;
+}
+// Drop everything until a key frame starts and KeyFrame, if given,
+// returns non zero. Anything partly done is forgotten and the decoder
+// buffer it was in left for someone else.
+void RtpDepackHold(RtpDepack d,RtpKeyFrame KeyFrame,void *Data) {
+    RtpDepackReset(d);
+    if(d->Decode || d->Buffer == d->WarmBuffer)
+      d->Buffer = NULL;
+    d->Warm = d->WantWarm = d->Draining = 0;
+    Hold(d,KeyFrame,Data);
+}
+int RtpDepackHeld(RtpDepack d) {
+    return d->Held;
+}
+// Keep the access units from the last key frame on instead of passing
+// them on or, with Warm zero, go live starting with them. Takes effect
+// between packets.
+void RtpDepackWarm(RtpDepack d,int32_t Warm) {
+    d->WantWarm = Warm;
+    if(d->Mode != DM_DIRECT && d->Warm != Warm)
+      ChangeWarm(d);
+}
+// Whether a warm depacketizer has a key frame to go live from
+int RtpDepackReady(RtpDepack d) {
+    return d->Warm && d->Ready;
+}
+// Forget any partial access unit, for instance after reconnecting.
+// Warm, everything kept goes too as the stream may start again.
+void RtpDepackReset(RtpDepack d) {
+    d->Used = 0;
+    d->Kept = d->Sent = 0;
+    d->KeyAU = d->Ready = 0;
+    d->InFU = 0;
+    d->RefAU = d->Damaged = 0;
+    d->Split = d->Staged = 0;
+    d->SeqValid = 0;
+    d->Mode = DM_NONE;
+}
+RtpDepackStats RtpDepackGetStats(RtpDepack d) {
+    return &d->Stats;
+}
+// The codec for an SDP rtpmap, "96 H264/90000". -1 if not known.
+int RtpCodecFromRtpmap(const char *rtpmap) {
+    const char *encoding = strchr(rtpmap,' ');
+    if(encoding == NULL)
+      return -1;
+    encoding += strspn(encoding," ");
+    if(strncasecmp(encoding,"H264/",5) == 0)
+      return CODEC_H264;
+    if(strncasecmp(encoding,"H265/",5) == 0)
+      return CODEC_H265;
+    return -1;
+}
+// Starts a packet of Length bytes of which the first Avail are at
+// Packet. Returns where the remaining Length - Avail bytes go. If
+// there are none RtpDepackEnd can be called straight away.
+uint8_t *RtpDepackBegin(RtpDepack d,const uint8_t *packet,int32_t avail,int32_t length) {
+    int32_t header = RtpHeaderLength(packet,avail);
+    struct _Plan plan;
+
+    if(d->Warm != d->WantWarm)
+      ChangeWarm(d);
+    d->Stats.Packets++;
+    d->Remaining = length - avail;
+    d->Length = length;
+    d->Mode = DM_DISCARD;
+    d->Marker = 0;
+    d->FUEnd = 0;
+    if(header <= 0 || length <= header || (avail < length && avail < header + RTP_PEEK)) {
+      d->Stats.Dropped++;
+      return d->Stage;
+    }
+    // A gap in the sequence numbers is loss, a step back a late
+    // or duplicate packet
+    uint16_t seq = (packet[2] << 8) | packet[3];
+    int16_t gap = seq - d->Seq;
+    uint32_t ts = (packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+    if(d->SeqValid && gap < 0 && gap > -MAX_MISORDER) {
+      d->Stats.Dropped++;
+      return d->Stage;
+    }
+    if(d->SeqValid && gap != 0)
+      Lost(d,gap > 0 ? gap : 0,ts);
+    d->Seq = seq + 1;
+    d->SeqValid = 1;
+    d->Padding = packet[0] & 0x20;
+    d->Marker = packet[1] & 0x80;
+    // A new timestamp means a new access unit even if the
+    // marker on the last one was lost
+    if(ts != d->Timestamp) {
+      if(d->Used > d->Kept || d->Split) {
+        Flush(d,1);
+        d->Stats.AccessUnits++;
+      }
+      d->Damaged = d->RefAU = d->KeyAU = 0;
+      d->Timestamp = ts;
+    }
+    const uint8_t *payload = packet + header;
+    int32_t paylen = length - header;
+    if(avail == length) {
+      // All here so no need to be clever
+      if(d->Padding)
+        paylen -= packet[length-1];
+      if(paylen > 0)
+        Complete(d,payload,paylen);
+      d->Mode = DM_NONE;
+      return d->Stage;
+    }
+    switch(PlanPayload(d,payload,paylen,&plan)) {
+      case 1:
+        // Parameter sets are kept while held so need to be seen whole
+        if(d->Held && plan.PrefixLength && !plan.FUStart && NalParameterSet(d->Codec,PlanHeader(&plan,payload))) {
+          memcpy(d->Stage,packet,avail);
+          d->Mode = DM_STAGED;
+          return d->Stage + avail;
+        }
+        if(!StartPlan(d,&plan,payload,paylen,avail - header))
+          break;
+        // Take what has already arrived, the rest follows it
+        memcpy(d->Buffer + d->Used,payload + plan.Skip,avail - header - plan.Skip);
+        d->Used += avail - header - plan.Skip;
+        d->FUEnd = plan.FUEnd;
+        d->Mode = DM_DIRECT;
+        return d->Buffer + d->Used;
+      case 0:
+        // Need the whole packet
+        memcpy(d->Stage,packet,avail);
+        d->Mode = DM_STAGED;
+        return d->Stage + avail;
+    }
+    d->Stats.Dropped++;
+    return d->Stage;
+}
+// The rest of the packet has been read
+void RtpDepackEnd(RtpDepack d) {
+    switch(d->Mode) {
+      case DM_DIRECT:
+        d->Used += d->Remaining;
+        // The last byte of the padding is the amount of padding
+        if(d->Padding)
+          d->Used -= d->Buffer[d->Used-1] < d->Used ? d->Buffer[d->Used-1] : d->Used;
+        if(d->FUEnd)
+          d->InFU = 0;
+        break;
+      case DM_STAGED: {
+        int32_t header = RtpHeaderLength(d->Stage,d->Length);
+        int32_t length = d->Length - header - (d->Padding ? d->Stage[d->Length-1] : 0);
+        if(length > 0)
+          Complete(d,d->Stage + header,length);
+      } break;
+      default:
+        break;
+    }
+    EndPacket(d);
+}
+// A whole packet
+void RtpDepackPacket(RtpDepack d,const uint8_t *packet,int32_t length) {
+    RtpDepackBegin(d,packet,length,length);
+    RtpDepackEnd(d);
+}
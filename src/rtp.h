@@ -0,0 +1,123 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _RTP_H_INCLUDED_
+#define _RTP_H_INCLUDED_
+
+// H264 NAL unit/RTP payload types (RFC 6184 5.2)
+enum PktType {
+    PT_RES_00 = 0,
+    PT_NAL_01,
+    PT_NAL_02,
+    PT_NAL_03,
+    PT_NAL_04,
+    PT_NAL_05,
+    PT_NAL_06,
+    PT_NAL_07,
+    PT_NAL_08,
+    PT_NAL_09,
+    PT_NAL_10,
+    PT_NAL_11,
+    PT_NAL_12,
+    PT_NAL_13,
+    PT_NAL_14,
+    PT_NAL_15,
+    PT_NAL_16,
+    PT_NAL_17,
+    PT_NAL_18,
+    PT_NAL_19,
+    PT_NAL_20,
+    PT_NAL_21,
+    PT_NAL_22,
+    PT_NAL_23,
+    PT_STAP_A,
+    PT_STAP_B,
+    PT_MTAP16,
+    PT_MTAP24,
+    PT_FU_A,
+    PT_FU_B,
+    PT_RES_30,
+    PT_RES_31,
+};
+// H265 RTP payload types (RFC 7798 4.4), below these are NAL units
+#define PT_H265_AP        48
+#define PT_H265_FU        49
+#define PT_H265_PACI      50
+
+#define RTP_MIN_HEADER    12
+#define RTP_PEEK          5         // Payload bytes RtpDepackBegin needs to see
+
+typedef struct _RtpDepack      *RtpDepack;
+typedef struct _RtpDepackStats *RtpDepackStats;
+
+struct _RtpDepackStats {
+    uint64_t Packets;
+    uint64_t NalUnits;
+    uint64_t AccessUnits;
+    uint64_t Buffers;               // Decoder buffers submitted
+    uint64_t Dropped;               // Packets that couldn't be used
+    uint64_t Ingested;              // Access units only published to the fanout
+    uint64_t Held;                  // NAL units dropped waiting for a key frame
+    uint64_t Discarded;             // Bytes of them, up to the last release
+    uint64_t Releases;              // Times a hold ended at a key frame
+    uint32_t LastCleanMS;           // From the last hold to its key frame
+    uint64_t WarmStarts;            // Times it went live from a warm start
+    uint64_t LossEvents;            // Gaps in the sequence numbers
+    uint64_t Lost;                  // Packets missing in them
+    uint64_t FUDropped;             // Fragmented NAL units missing a part
+    uint64_t Damaged;               // Access units dropped or flagged corrupt after a loss
+    uint64_t LossHolds;             // Times a loss meant waiting for a key frame
+};
+// Called at each key frame while held, non zero to go live
+typedef int (*RtpKeyFrame)(void *);
+
+// Returns the length of the RTP header including any CSRCs and
+// header extension, 0 if more than Avail bytes are needed to tell
+// or -1 if it isn't an RTP version 2 packet
+static inline int32_t RtpHeaderLength(const uint8_t *rtp,int32_t avail) {
+    int32_t length;
+
+    if(avail < RTP_MIN_HEADER)
+      return 0;
+    if((rtp[0] & 0xc0) != 0x80)
+      return -1;
+    length = RTP_MIN_HEADER + (rtp[0] & 0x0f) * 4;
+    if(rtp[0] & 0x10) {
+      if(avail < length + 4)
+        return 0;
+      length += 4 + ((rtp[length+2] << 8) | rtp[length+3]) * 4;
+    }
+    return length;
+}
+
+// Need cctvplexer.h
+RtpDepack RtpDepackNew(const char *,void *,VideoCodec);
+void     RtpDepackSetCodec(RtpDepack,VideoCodec,int32_t);
+void     RtpDepackSetParameterSets(RtpDepack,const uint8_t *,int32_t);
+void     RtpDepackSetConceal(RtpDepack,int32_t);
+void     RtpDepackSetFanout(RtpDepack,void *);
+int      RtpCodecFromRtpmap(const char *);
+void     RtpDepackRelease(RtpDepack);
+void     RtpDepackReset(RtpDepack);
+void     RtpDepackHold(RtpDepack,RtpKeyFrame,void *);
+int      RtpDepackHeld(RtpDepack);
+void     RtpDepackWarm(RtpDepack,int32_t);
+int      RtpDepackReady(RtpDepack);
+void     RtpDepackPacket(RtpDepack,const uint8_t *,int32_t);
+uint8_t *RtpDepackBegin(RtpDepack,const uint8_t *,int32_t,int32_t);
+void     RtpDepackEnd(RtpDepack);
+RtpDepackStats RtpDepackGetStats(RtpDepack);
+#endif
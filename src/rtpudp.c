@@ -0,0 +1,496 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "monitor.h"
+#include "rtp.h"
+#include "rtcp.h"
+#include "rtpudp.h"
+
+//
+// RTP over UDP.
+//
+// Opens an RTP/RTCP port pair for a session and reads the RTP
+// socket in batches with recvmmsg(). Packets are put back in
+// sequence order in a reorder window before being passed on.
+// A gap is waited for until the packet after it has been held for
+// the latency budget, then given up on. Anything that turns up
+// after its turn is dropped so a lost packet never stalls the
+// stream the way a TCP retransmit does.
+//
+// RTCP from the camera goes to the Rtcp it is given, which sees
+// each RTP packet as it arrives with the kernel's receive time so
+// the jitter isn't spread out by the batching. Receiver reports go
+// back from the RTCP port to the camera's.
+//
+// For multicast the ports are the ones the camera sends the group
+// to. Several plexers, even on the same machine, can join the same
+// group so a camera only has to send each stream once. Where the
+// camera is known the join is source specific, so the kernel and
+// the network only pass on its packets, and receiver reports go to
+// the group as RFC 3550 asks.
+//
+
+#define SLOTS         256           // Reorder window in packets, power of 2
+#define SLOT_MASK     (SLOTS-1)
+#define SLOT_SIZE     2048          // Bigger datagrams are dropped
+#define BATCH         32            // Datagrams per recvmmsg()
+#define MAX_BATCHES   8             // recvmmsg() calls per callback
+#define RESYNC        (SLOTS*4)     // Sequence jumps bigger than this restart the window
+#define PORT_TRIES    16
+#define SOCKET_BUFFER (1024*1024)
+
+typedef struct _Slot *Slot;
+struct _Slot {
+    uint8_t *Data;                  // NULL when empty
+    int32_t  Length;
+    uint64_t Arrived;
+};
+struct _RtpUdp {
+    MonitorHandle Rtp;
+    MonitorHandle Rtcp;
+    MonitorTimer  Timer;
+    int32_t       Port;             // RTP port, RTCP is the next one up
+    struct sockaddr_storage Group;  // Multicast group joined
+    int32_t       Multicast;
+    uint32_t      Latency;          // Milliseconds to wait for a missing packet
+    RtpUdpPacket  Packet;
+    void         *Data;
+    struct sockaddr_storage Source; // Only accept packets from here
+    int32_t       HaveSource;
+    Rtcp          Reports;          // Gets the RTCP, NULL if it isn't wanted
+    struct sockaddr_storage RtcpTo; // Where receiver reports go
+    int32_t       HaveRtcpTo;
+    int32_t       Started;
+    uint16_t      NextSeq;          // Next to be passed on
+    uint16_t      HighestSeq;
+    int32_t       Buffered;
+    struct _Slot  Ring[SLOTS];
+    uint8_t      *Free[SLOTS+BATCH];
+    int32_t       FreeCount;
+    uint8_t      *Pool;
+    struct _RtpUdpStats Stats;
+};
+
+// Binds a pair of UDP sockets to an even port and the one after
+static int OpenPair(int family,int *rtp,int *rtcp) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    int size = SOCKET_BUFFER;
+    int one = 1;
+
+    for(int i=0; i < PORT_TRIES; i++) {
+      memset(&ss,0,sizeof(ss));
+      ss.ss_family = family;
+      len = family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+      *rtp = socket(family,SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,0);
+      *rtcp = socket(family,SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,0);
+      if(*rtp < 0 || *rtcp < 0)
+        break;
+      setsockopt(*rtp,SOL_SOCKET,SO_TIMESTAMPNS,&one,sizeof(one));
+      // Let the kernel pick the RTP port then try for the next one
+      if(bind(*rtp,(struct sockaddr *) &ss,len) == 0 &&
+         getsockname(*rtp,(struct sockaddr *) &ss,&len) == 0) {
+        uint16_t *port = family == AF_INET6 ? &((struct sockaddr_in6 *) &ss)->sin6_port
+                                            : &((struct sockaddr_in *) &ss)->sin_port;
+        int p = ntohs(*port);
+        *port = htons(p + 1);
+        if((p & 1) == 0 && bind(*rtcp,(struct sockaddr *) &ss,len) == 0) {
+          setsockopt(*rtp,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size));
+          return p;
+        }
+      }
+      close(*rtp);
+      close(*rtcp);
+    }
+    if(*rtp >= 0) close(*rtp);
+    if(*rtcp >= 0) close(*rtcp);
+    return -1;
+}
+// Length of a sockaddr for family
+static socklen_t AddressLength(int family) {
+    return family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+// Binds a UDP socket to the multicast Group's address and port and
+// joins it on Interface, for packets from Source only if given. -1 on
+// error.
+static int JoinGroup(const struct sockaddr *Group,const struct sockaddr *Source,uint32_t Interface) {
+    int level = Group->sa_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    int one = 1, zero = 0;
+    int fd;
+
+    if((fd = socket(Group->sa_family,SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,0)) < 0)
+      return -1;
+    // Other plexers on this machine may be watching the same group
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+    // Only the group bound to, not every group joined on the port
+    if(level == IPPROTO_IP)
+      setsockopt(fd,IPPROTO_IP,IP_MULTICAST_ALL,&zero,sizeof(zero));
+    if(bind(fd,Group,AddressLength(Group->sa_family)) == 0) {
+      if(Source) {
+        struct group_source_req gsr;
+        memset(&gsr,0,sizeof(gsr));
+        gsr.gsr_interface = Interface;
+        memcpy(&gsr.gsr_group,Group,AddressLength(Group->sa_family));
+        memcpy(&gsr.gsr_source,Source,AddressLength(Source->sa_family));
+        if(setsockopt(fd,level,MCAST_JOIN_SOURCE_GROUP,&gsr,sizeof(gsr)) == 0)
+          return fd;
+      }
+      else {
+        struct group_req gr;
+        memset(&gr,0,sizeof(gr));
+        gr.gr_interface = Interface;
+        memcpy(&gr.gr_group,Group,AddressLength(Group->sa_family));
+        if(setsockopt(fd,level,MCAST_JOIN_GROUP,&gr,sizeof(gr)) == 0)
+          return fd;
+      }
+    }
+    close(fd);
+    return -1;
+}
+static int SameHost(const struct sockaddr_storage *a,const struct sockaddr_storage *b) {
+    if(a->ss_family != b->ss_family)
+      return 0;
+    if(a->ss_family == AF_INET)
+      return ((struct sockaddr_in *) a)->sin_addr.s_addr == ((struct sockaddr_in *) b)->sin_addr.s_addr;
+    if(a->ss_family == AF_INET6)
+      return memcmp(&((struct sockaddr_in6 *) a)->sin6_addr,&((struct sockaddr_in6 *) b)->sin6_addr,
+                    sizeof(struct in6_addr)) == 0;
+    return 0;
+}
+// Pass on what can be passed on. A gap holds things up until the
+// first packet after it has waited Latency milliseconds.
+static void Deliver(RtpUdp u,uint64_t now) {
+    while(u->Buffered) {
+      Slot slot = &u->Ring[u->NextSeq & SLOT_MASK];
+      if(slot->Data == NULL) {
+        uint16_t seq = u->NextSeq;
+        while(u->Ring[seq & SLOT_MASK].Data == NULL)
+          seq++;
+        slot = &u->Ring[seq & SLOT_MASK];
+        if(slot->Arrived + u->Latency > now) {
+          MonitorTimerReschedule(u->Timer,slot->Arrived + u->Latency - now);
+          return;
+        }
+        u->Stats.Lost += (uint16_t)(seq - u->NextSeq);
+        u->NextSeq = seq;
+      }
+      u->Packet(u->Data,slot->Data,slot->Length);
+      u->Free[u->FreeCount++] = slot->Data;
+      slot->Data = NULL;
+      u->Buffered--;
+      u->NextSeq++;
+      u->Stats.Packets++;
+    }
+    MonitorTimerStop(u->Timer);
+}
+// Hands over everything that is buffered regardless of gaps
+static void Flush(RtpUdp u) {
+    uint32_t latency = u->Latency;
+    u->Latency = 0;
+    Deliver(u,MonitorNow());
+    u->Latency = latency;
+}
+static void Insert(RtpUdp u,uint8_t *data,int32_t length,uint64_t now) {
+    uint16_t seq = (data[2] << 8) | data[3];
+    int32_t diff;
+    Slot slot;
+
+    if(u->Started == 0) {
+      u->NextSeq = u->HighestSeq = seq;
+      u->Started = 1;
+    }
+    diff = (int16_t)(seq - u->NextSeq);
+    if(diff < -RESYNC || diff >= RESYNC) {
+      // The sender has probably restarted
+      Flush(u);
+      u->NextSeq = u->HighestSeq = seq;
+      diff = 0;
+    }
+    if(diff < 0) {
+      u->Stats.Late++;
+      u->Free[u->FreeCount++] = data;
+      return;
+    }
+    if(diff >= SLOTS) {
+      // Too far ahead to keep waiting for what is missing
+      uint16_t first = seq - SLOTS + 1;
+      while(u->NextSeq != first) {
+        slot = &u->Ring[u->NextSeq & SLOT_MASK];
+        if(slot->Data) {
+          u->Packet(u->Data,slot->Data,slot->Length);
+          u->Free[u->FreeCount++] = slot->Data;
+          slot->Data = NULL;
+          u->Buffered--;
+          u->Stats.Packets++;
+        }
+        else {
+          u->Stats.Lost++;
+        }
+        u->NextSeq++;
+      }
+    }
+    slot = &u->Ring[seq & SLOT_MASK];
+    if(slot->Data) {
+      u->Stats.Duplicates++;
+      u->Free[u->FreeCount++] = data;
+      return;
+    }
+    if((int16_t)(seq - u->HighestSeq) < 0)
+      u->Stats.Reordered++;
+    else
+      u->HighestSeq = seq;
+    slot->Data = data;
+    slot->Length = length;
+    slot->Arrived = now;
+    u->Buffered++;
+}
+// When the kernel received a packet, in microseconds
+static uint64_t Arrived(struct msghdr *msg) {
+    struct timespec ts;
+
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg,c))
+      if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+        memcpy(&ts,CMSG_DATA(c),sizeof(ts));
+        return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+      }
+    clock_gettime(CLOCK_REALTIME,&ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+static void RtpRead(MonitorHandle h,void *data) {
+    RtpUdp u = data;
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    struct sockaddr_storage from[BATCH];
+    union {
+      char buffer[CMSG_SPACE(sizeof(struct timespec))];
+      struct cmsghdr align;
+    } control[BATCH];
+    int got = BATCH;
+
+    for(int b=0; b < MAX_BATCHES && got == BATCH; b++) {
+      // The ring holds at most SLOTS so there are always BATCH free
+      memset(msgs,0,sizeof(msgs));
+      for(int i=0; i < BATCH; i++) {
+        iov[i].iov_base = u->Free[u->FreeCount-1-i];
+        iov[i].iov_len = SLOT_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_control = control[i].buffer;
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buffer);
+      }
+      if((got = recvmmsg(MonitorGetReadFD(h),msgs,BATCH,MSG_DONTWAIT,NULL)) <= 0) {
+        if(got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          printf("RTP %s: receive error: %s\n",MonitorGetName(h),strerror(errno));
+        break;
+      }
+      uint64_t now = MonitorNow();
+      u->Stats.Batches++;
+      // Take the filled buffers off the free list before any go back
+      u->FreeCount -= got;
+      for(int i=0; i < got; i++) {
+        uint8_t *packet = iov[i].iov_base;
+        int32_t length = msgs[i].msg_len;
+        MonitorAddBytes(h,length);
+        if((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || RtpHeaderLength(packet,length) < 0 ||
+           length < RTP_MIN_HEADER || (u->HaveSource && !SameHost(&u->Source,&from[i]))) {
+          u->Stats.Invalid++;
+          u->Free[u->FreeCount++] = packet;
+          continue;
+        }
+        if(u->Reports)
+          RtcpRtp(u->Reports,packet,length,Arrived(&msgs[i].msg_hdr));
+        Insert(u,packet,length,now);
+      }
+      Deliver(u,now);
+    }
+}
+static void TimerExpired(MonitorTimer t,void *data) {
+    RtpUdp u = data;
+    Deliver(u,MonitorNow());
+}
+// The port has to be kept empty even if nothing wants the RTCP
+static void RtcpRead(MonitorHandle h,void *data) {
+    RtpUdp u = data;
+    uint8_t buffer[SLOT_SIZE];
+    struct sockaddr_storage from;
+    socklen_t len = sizeof(from);
+    ssize_t got;
+
+    while((got = recvfrom(MonitorGetReadFD(h),buffer,sizeof(buffer),MSG_DONTWAIT,
+                          (struct sockaddr *) &from,&len)) >= 0) {
+      MonitorAddBytes(h,got);
+      if(u->Reports && (!u->HaveSource || SameHost(&u->Source,&from)))
+        RtcpReceive(u->Reports,buffer,got);
+      len = sizeof(from);
+    }
+}
+
+// Sets up the reading of a port pair
+static RtpUdp Start(RtpUdp u,const char *Name,int rtp,int rtcp,uint32_t Latency,RtpUdpPacket Packet,void *Data) {
+    for(int i=0; i < SLOTS+BATCH; i++)
+      u->Free[u->FreeCount++] = u->Pool + i * SLOT_SIZE;
+    u->Latency = Latency;
+    u->Packet = Packet;
+    u->Data = Data;
+    u->Timer = MonitorTimerAdd(0,TimerExpired,u);
+    MonitorTimerStop(u->Timer);
+    u->Rtp = MonitorNew(Name);
+    MonitorSetReadData(u->Rtp,u);
+    MonitorSetReadCB(u->Rtp,RtpRead);
+    MonitorSetReadFD(u->Rtp,rtp);
+    u->Rtcp = MonitorNew(Name);
+    MonitorSetReadData(u->Rtcp,u);
+    MonitorSetReadCB(u->Rtcp,RtcpRead);
+    MonitorSetReadFD(u->Rtcp,rtcp);
+    return u;
+}
+
+//
+// Public interface
+//
+
+// Opens a port pair for family (AF_INET or AF_INET6). Packets are
+// passed to Packet in order, waiting up to Latency milliseconds for
+// any that are missing.
+RtpUdp RtpUdpNew(const char *Name,int Family,uint32_t Latency,RtpUdpPacket Packet,void *Data) {
+    RtpUdp u = calloc(1,sizeof(struct _RtpUdp));
+    int rtp,rtcp;
+
+    if(u == NULL)
+      return NULL;
+    if((u->Pool = malloc((SLOTS+BATCH) * SLOT_SIZE)) == NULL ||
+       (u->Port = OpenPair(Family,&rtp,&rtcp)) < 0) {
+      printf("RTP %s: unable to open UDP ports\n",Name);
+      free(u->Pool);
+      free(u);
+      return NULL;
+    }
+    return Start(u,Name,rtp,rtcp,Latency,Packet,Data);
+}
+// Like RtpUdpNew but joins the multicast Group, whose port is the RTP
+// one, on the Interface index (0 for the kernel's choice) and if
+// Source is given only takes packets from there
+RtpUdp RtpUdpNewMulticast(const char *Name,const struct sockaddr *Group,const struct sockaddr *Source,
+                          uint32_t Interface,uint32_t Latency,RtpUdpPacket Packet,void *Data) {
+    RtpUdp u = calloc(1,sizeof(struct _RtpUdp));
+    int size = SOCKET_BUFFER;
+    int one = 1;
+    int rtp = -1,rtcp = -1;
+
+    if(u == NULL)
+      return NULL;
+    memcpy(&u->Group,Group,AddressLength(Group->sa_family));
+    u->Multicast = 1;
+    u->Port = ntohs(Group->sa_family == AF_INET6 ? ((struct sockaddr_in6 *) &u->Group)->sin6_port
+                                                 : ((struct sockaddr_in *) &u->Group)->sin_port);
+    if((u->Pool = malloc((SLOTS+BATCH) * SLOT_SIZE)) != NULL &&
+       (rtp = JoinGroup((struct sockaddr *) &u->Group,Source,Interface)) >= 0) {
+      // RTCP goes to the same group on the next port
+      struct sockaddr_storage group = u->Group;
+      if(group.ss_family == AF_INET6)
+        ((struct sockaddr_in6 *) &group)->sin6_port = htons(u->Port + 1);
+      else
+        ((struct sockaddr_in *) &group)->sin_port = htons(u->Port + 1);
+      rtcp = JoinGroup((struct sockaddr *) &group,Source,Interface);
+    }
+    if(rtp < 0 || rtcp < 0) {
+      printf("RTP %s: unable to join multicast group: %s\n",Name,strerror(errno));
+      if(rtp >= 0)
+        close(rtp);
+      free(u->Pool);
+      free(u);
+      return NULL;
+    }
+    setsockopt(rtp,SOL_SOCKET,SO_TIMESTAMPNS,&one,sizeof(one));
+    setsockopt(rtp,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size));
+    // Receiver reports go out the way the stream comes in
+    if(Interface && Group->sa_family == AF_INET6) {
+      setsockopt(rtcp,IPPROTO_IPV6,IPV6_MULTICAST_IF,&Interface,sizeof(Interface));
+    }
+    else if(Interface) {
+      struct ip_mreqn mreq = { .imr_ifindex = Interface };
+      setsockopt(rtcp,IPPROTO_IP,IP_MULTICAST_IF,&mreq,sizeof(mreq));
+    }
+    if(Source)
+      RtpUdpSetSource(u,Source);
+    return Start(u,Name,rtp,rtcp,Latency,Packet,Data);
+}
+int RtpUdpGetPort(RtpUdp u) {
+    return u->Port;
+}
+// Only accept packets from Source's address
+void RtpUdpSetSource(RtpUdp u,const struct sockaddr *Source) {
+    memset(&u->Source,0,sizeof(u->Source));
+    memcpy(&u->Source,Source,AddressLength(Source->sa_family));
+    u->HaveSource = 1;
+}
+// Passes RTCP to r and sends its reports to Port on the source, if
+// the camera said which port that is, or for multicast the group
+void RtpUdpSetRtcp(RtpUdp u,Rtcp r,int Port) {
+    u->Reports = r;
+    u->HaveRtcpTo = 0;
+    if((!u->HaveSource && !u->Multicast) || Port <= 0 || Port > 65535)
+      return;
+    u->RtcpTo = u->Multicast ? u->Group : u->Source;
+    if(u->RtcpTo.ss_family == AF_INET6)
+      ((struct sockaddr_in6 *) &u->RtcpTo)->sin6_port = htons(Port);
+    else
+      ((struct sockaddr_in *) &u->RtcpTo)->sin_port = htons(Port);
+    u->HaveRtcpTo = 1;
+}
+// Sends a compound RTCP packet from the RTCP port
+int RtpUdpSendRtcp(RtpUdp u,const uint8_t *Packet,int32_t Length) {
+    if(!u->HaveRtcpTo)
+      return -1;
+    if(sendto(MonitorGetReadFD(u->Rtcp),Packet,Length,MSG_DONTWAIT,(struct sockaddr *) &u->RtcpTo,
+              AddressLength(u->RtcpTo.ss_family)) != Length)
+      return -1;
+    return 0;
+}
+RtpUdpStats RtpUdpGetStats(RtpUdp u) {
+    return &u->Stats;
+}
+void RtpUdpRelease(RtpUdp u) {
+    if(u == NULL)
+      return;
+    int rtp = MonitorGetReadFD(u->Rtp);
+    int rtcp = MonitorGetReadFD(u->Rtcp);
+    MonitorClearReadFD(u->Rtp);
+    MonitorClearReadFD(u->Rtcp);
+    MonitorRelease(u->Rtp);
+    MonitorRelease(u->Rtcp);
+    close(rtp);
+    close(rtcp);
+    MonitorTimerCancel(u->Timer);
+    free(u->Pool);
+    free(u);
+}
@@ -0,0 +1,44 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _RTPUDP_H_INCLUDED_
+#define _RTPUDP_H_INCLUDED_
+
+typedef struct _RtpUdp      *RtpUdp;
+typedef struct _RtpUdpStats *RtpUdpStats;
+
+struct _RtpUdpStats {
+    uint64_t Packets;               // Passed on in sequence
+    uint64_t Late;                  // Arrived after their turn had gone
+    uint64_t Lost;                  // Skipped over when the latency ran out
+    uint64_t Duplicates;
+    uint64_t Reordered;             // Arrived out of order but in time
+    uint64_t Invalid;               // Too big, not RTP or from someone else
+    uint64_t Batches;               // recvmmsg calls that returned something
+};
+// Called with each packet, in sequence order
+typedef void (*RtpUdpPacket)(void *,uint8_t *,int32_t);
+
+// Needs sys/socket.h and rtcp.h
+RtpUdp RtpUdpNew(const char *,int,uint32_t,RtpUdpPacket,void *);
+RtpUdp RtpUdpNewMulticast(const char *,const struct sockaddr *,const struct sockaddr *,uint32_t,uint32_t,RtpUdpPacket,void *);
+int    RtpUdpGetPort(RtpUdp);
+void   RtpUdpSetSource(RtpUdp,const struct sockaddr *);
+void   RtpUdpSetRtcp(RtpUdp,Rtcp,int);
+int    RtpUdpSendRtcp(RtpUdp,const uint8_t *,int32_t);
+void   RtpUdpRelease(RtpUdp);
+RtpUdpStats RtpUdpGetStats(RtpUdp);
+#endif
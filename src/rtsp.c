@@ -21,6 +21,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/time.h>
@@ -36,57 +38,42 @@
 #include "cctvplexer.h"
 #include "render.h"
 #include "monitor.h"
+#include "rtp.h"
+#include "rtcp.h"
+#include "sdp.h"
 
 //
 // In order to get at RTP stream and then the raw H264 data
 // there are several steps that need to be taken.
 //   1. Send a DESCRIBE
-//      This gets a description of the stream. The only
-//      attribute currently needed is the control URI
+//      This gets a description of the stream, the control
+//      URI, codec and parameter sets (see sdp.c)
 //   2. Send a SETUP
 //      This is sent using the control extracted from 1.
 //   3. Send a PLAY
 //      Tells the stream to start playing
 //
+// Sessions wait for one of StartupConcurrency slots before starting
+// and hold it until the first packet arrives, so a houseful of
+// cameras coming back after a power cut don't all start at once.
+// How long each step took is kept in the camera's RtspStats.
+//
+// Once playing a GET_PARAMETER is sent every half session timeout
+// to stop the camera dropping the session. A watchdog timer checks
+// that packets keep arriving and if anything fails the session is
+// thrown away and started again from the DESCRIBE after a backoff.
+//
+// RTCP on channel 1 keeps the loss and jitter figures and receiver
+// reports go back on the same connection (see rtcp.c).
+//
 
 
-#define MINBUFSIZ     4096
 #define TRANSPORT     "RTP/AVP/TCP;unicast;interleaved=0-1"
+#define RECONNECT_MIN     500       // Milliseconds before the first reconnect
+#define RECONNECT_MAX     30000     // Longest wait between reconnects
+#define SESSION_TIMEOUT   60        // Seconds, when the server doesn't say (RFC 2326 12.37)
+#define WATCHDOG_DELAY(c) ((c)->RTSP.Timeout / 4)
 
-enum PktType {
-    PT_RES_00 = 0,
-    PT_NAL_01,
-    PT_NAL_02,
-    PT_NAL_03,
-    PT_NAL_04,
-    PT_NAL_05,
-    PT_NAL_06,
-    PT_NAL_07,
-    PT_NAL_08,
-    PT_NAL_09,
-    PT_NAL_10,
-    PT_NAL_11,
-    PT_NAL_12,
-    PT_NAL_13,
-    PT_NAL_14,
-    PT_NAL_15,
-    PT_NAL_16,
-    PT_NAL_17,
-    PT_NAL_18,
-    PT_NAL_19,
-    PT_NAL_20,
-    PT_NAL_21,
-    PT_NAL_22,
-    PT_NAL_23,
-    PT_STAP_A,
-    PT_STAP_B,
-    PT_MTAP16,
-    PT_MTAP24,
-    PT_FU_A,
-    PT_FU_B,
-    PT_RES_30,
-    PT_RES_31,
-};
 extern CURLM *CurlHandle;
 #define my_curl_easy_setopt(A, B, C)                                \
   do {                                                              \
@@ -97,113 +84,319 @@ extern CURLM *CurlHandle;
               #A, #B, #C, res);                                     \
   } while(0)
 
+static void StreamDescribe(Camera);
+static size_t DiscardBody(char *,size_t,size_t,void *);
+
+static int32_t StartupConcurrency;      // 0 for no limit
+static int32_t StartupActive;           // Sessions holding a slot
+static Camera *StartupQueue;            // Waiting for a slot, oldest first
+static int32_t StartupQueued;
+static int32_t StartupQueueSize;
+
+//
+// Session supervision, shared with the native client
+//
+
+// Records a failure and returns the milliseconds to wait before
+// reconnecting. The wait doubles with each failure up to
+// RECONNECT_MAX and is picked at random from its upper half so
+// cameras that went down together don't all come back at once.
+uint32_t RtspSessionFailed(Camera c) {
+    struct _RTSP *r = &c->RTSP;
+    uint32_t delay = RECONNECT_MIN << (r->Failures < 6 ? r->Failures : 6);
+
+    delay = delay < RECONNECT_MAX ? delay : RECONNECT_MAX;
+    RtspStartupCancel(c);
+    r->Failures++;
+    r->Stats.Failures++;
+    if(r->Stats.DownSince == 0)
+      r->Stats.DownSince = MonitorNow();
+    return delay / 2 + rand() % (delay / 2 + 1);
+}
+// The session has reached PLAY
+void RtspSessionPlaying(Camera c) {
+    RtspStats st = &c->RTSP.Stats;
+
+    st->Connects++;
+    RtspPhaseDone(c,PHASE_PLAY);
+    RtspSessionActive(c);
+    if(st->DownSince == 0)
+      return;
+    st->Reconnects++;
+    st->LastReconnectMS = MonitorNow() - st->DownSince;
+    st->TotalReconnectMS += st->LastReconnectMS;
+    if(st->LastReconnectMS > st->MaxReconnectMS)
+      st->MaxReconnectMS = st->LastReconnectMS;
+    st->DownSince = 0;
+    printf("RTSP %s: reconnected in %llu ms (%llu reconnects, longest %llu ms)\n",c->Name,
+           (unsigned long long) st->LastReconnectMS,(unsigned long long) st->Reconnects,
+           (unsigned long long) st->MaxReconnectMS);
+}
+// The session has moved on so restart the inactivity clock
+void RtspSessionActive(Camera c) {
+    c->RTSP.LastActivity = MonitorNow();
+    c->RTSP.LastPackets = c->RTSP.Depack ? RtpDepackGetStats(c->RTSP.Depack)->Packets : 0;
+}
+// Called from the watchdogs. Returns 1 if there has been no progress
+// and no packets for Timeout milliseconds. Packets arriving also
+// mean the session is healthy so the backoff starts again.
+int RtspSessionIdle(Camera c) {
+    struct _RTSP *r = &c->RTSP;
+    uint64_t packets = r->Depack ? RtpDepackGetStats(r->Depack)->Packets : 0;
+    uint64_t now = MonitorNow();
+
+    if(packets != r->LastPackets) {
+      r->LastPackets = packets;
+      r->LastActivity = now;
+      r->Failures = 0;
+      return 0;
+    }
+    if(now - r->LastActivity < r->Timeout)
+      return 0;
+    r->Stats.Timeouts++;
+    return 1;
+}
+// Keepalives are sent at half the timeout from a Session header
+uint32_t RtspKeepAliveDelay(const char *session) {
+    const char *timeout = session ? strstr(session,"timeout=") : NULL;
+    int32_t seconds = timeout ? atoi(timeout + 8) : 0;
+    return (seconds > 0 ? seconds : SESSION_TIMEOUT) * 500;
+}
+
+
+//
+// Startup
+//
+
+void RtspSetStartupConcurrency(int32_t n) {
+    StartupConcurrency = n > 0 ? n : 0;
+}
+static void StartupGrant(Camera c) {
+    c->RTSP.Queued = 0;
+    if(c->RTSP.Starting == 0) {
+      c->RTSP.Starting = 1;
+      StartupActive++;
+    }
+    RtspPhaseDone(c,PHASE_QUEUED);
+    c->RTSP.Start(c);
+}
+// Calls Start for camera c once it has a startup slot
+void RtspStartupQueue(Camera c,void (*start)(Camera)) {
+    struct _RTSP *r = &c->RTSP;
+
+    if(r->Queued)
+      return;
+    r->Start = start;
+    if(r->Starting == 0) {
+      r->StartTime = r->PhaseStart = MonitorNow();
+      memset(r->Stats.PhaseMS,0,sizeof(r->Stats.PhaseMS));
+      if(StartupConcurrency && StartupActive >= StartupConcurrency) {
+        if(StartupQueued == StartupQueueSize) {
+          int32_t size = StartupQueueSize ? StartupQueueSize * 2 : 8;
+          Camera *q = realloc(StartupQueue,size * sizeof(Camera));
+          if(q == NULL) {
+            printf("Unable to allocate memory for startup queue\n");
+            return;
+          }
+          StartupQueue = q;
+          StartupQueueSize = size;
+        }
+        StartupQueue[StartupQueued++] = c;
+        r->Queued = 1;
+        return;
+      }
+    }
+    StartupGrant(c);
+}
+// Takes camera c out of the queue or gives up its slot, letting the
+// next in line start
+void RtspStartupCancel(Camera c) {
+    if(c->RTSP.Queued) {
+      for(int32_t i=0; i < StartupQueued; i++) {
+        if(StartupQueue[i] == c) {
+          memmove(StartupQueue + i,StartupQueue + i + 1,(--StartupQueued - i) * sizeof(Camera));
+          break;
+        }
+      }
+      c->RTSP.Queued = 0;
+    }
+    if(c->RTSP.Starting == 0)
+      return;
+    c->RTSP.Starting = 0;
+    StartupActive--;
+    while(StartupQueued && (StartupConcurrency == 0 || StartupActive < StartupConcurrency)) {
+      Camera next = StartupQueue[0];
+      memmove(StartupQueue,StartupQueue + 1,--StartupQueued * sizeof(Camera));
+      StartupGrant(next);
+    }
+}
+// Records how long Phase took. The first packet ends the start.
+void RtspPhaseDone(Camera c,RtspPhase phase) {
+    struct _RTSP *r = &c->RTSP;
+    uint64_t now = MonitorNow();
+    uint32_t *ms = r->Stats.PhaseMS;
+
+    if(r->Starting == 0)
+      return;
+    ms[phase] = now - r->PhaseStart;
+    r->PhaseStart = now;
+    if(phase != PHASE_FIRST_PACKET)
+      return;
+    r->Stats.StartMS = now - r->StartTime;
+    if(r->Stats.StartMS > r->Stats.MaxStartMS)
+      r->Stats.MaxStartMS = r->Stats.StartMS;
+    printf("RTSP %s: started in %u ms (queued %u, connect %u, describe %u, setup %u, play %u, "
+           "first packet %u)\n",c->Name,r->Stats.StartMS,ms[PHASE_QUEUED],ms[PHASE_CONNECT],
+           ms[PHASE_DESCRIBE],ms[PHASE_SETUP],ms[PHASE_PLAY],ms[PHASE_FIRST_PACKET]);
+    RtspStartupCancel(c);
+}
+
+//
+// curl client
+//
+
 // The interleaved stream
 static size_t RTPStream(char *ptr,size_t size, size_t nitems, void *userdata) {
     Camera cam = userdata;
     int inlength = size * nitems;
     int length = ((unsigned char) *(ptr+2)) * 256 + ((unsigned char) *(ptr+3));
-    int buflen;
-    // Check the length
-    if((length+4) != inlength)
-      exit(0);
-    // Check the channel (exiting so I know)
-    if(*(ptr+1))
-      exit(0);
-    // 4 bytes RTSP + 12 bytes RTP header
-    char *payload = ptr + 4 + 12;
-    int paylen = inlength - 4 - 12;
-    // Remove any padding
-    if( ptr[4] & 0x20 )
-      paylen -= ptr[inlength-1];
-
-    char *buffer = RenderGetBuffer(cam->RenderHandle,&buflen);
-    if(buffer == NULL) {
-      printf("Error getting buffer for camera %s\n",cam->Name);
+    // curl hands over one interleaved frame per call
+    if((length+4) != inlength || (*(ptr+1) == 0 && length < 12)) {
+      printf("Bad interleaved frame for camera %s: %i/%i\n",cam->Name,length,inlength);
       return inlength;
     }
-    // handle packet type
-    buflen = 0;
-    enum PktType ptype = *payload & 0x1f;
-    switch(ptype) {
-      case PT_NAL_01:
-      case PT_NAL_02:
-      case PT_NAL_03:
-      case PT_NAL_04:
-      case PT_NAL_05:
-      case PT_NAL_06:
-      case PT_NAL_07:
-      case PT_NAL_08:
-      case PT_NAL_09:
-      case PT_NAL_10:
-      case PT_NAL_11:
-      case PT_NAL_12:
-      case PT_NAL_13:
-      case PT_NAL_14:
-      case PT_NAL_15:
-      case PT_NAL_16:
-      case PT_NAL_17:
-      case PT_NAL_18:
-      case PT_NAL_19:
-      case PT_NAL_20:
-      case PT_NAL_21:
-      case PT_NAL_22:
-      case PT_NAL_23:
-        // Set the frame marker
-        buffer[0] = buffer[1] = buffer[2] = 0; buffer[3] = 1;
-        // Copy the payload
-        memcpy(buffer+4,payload,paylen);
-        buflen = paylen+4;
-        break;
-      case PT_STAP_A:
-      case PT_STAP_B:
-        printf("Unhandled STAP packet %i\n",ptype);
-        break;
-      case PT_MTAP16:
-      case PT_MTAP24:
-        printf("Unhandled MTAP packet %i\n",ptype);
-        break;
-      case PT_FU_B:
-      case PT_FU_A: {
-        // Extract NRI flags and move on
-        int nri_flags = *payload++ & 0xe0;
-        paylen--;
-        // Start of fragment or continuation?
-        if( *payload & 0x80 ) {
-          // The start
-          // Set the frame marker
-          buffer[0] = buffer[1] = buffer[2] = 0; buffer[3] = 1;
-          // Set nri flags
-          *payload = (*payload & 0x1f) | nri_flags;
-          memcpy(buffer+4,payload,paylen);
-          buflen = paylen+4;
-        }
-        else {
-          // Skip frag header
-          payload++;
-          paylen--;
-          memcpy(buffer,payload,paylen);
-          buflen = paylen;
-        }
-      } break;
-      case PT_RES_00:
-      case PT_RES_30:
-      case PT_RES_31:
-        printf("Reserved packet type %i\n",ptype);
-        break;
+    if(*(ptr+1) == RTCP_CHANNEL) {
+      RtcpReceive(cam->RTSP.Rtcp,(uint8_t *) ptr + 4,length);
+      return inlength;
     }
-    RenderProcessBuffer(cam->RenderHandle,buffer,buflen,0);
+    // Nothing else is set up on the other channels
+    if(*(ptr+1))
+      return inlength;
+    if(cam->RTSP.Starting)
+      RtspPhaseDone(cam,PHASE_FIRST_PACKET);
+    RtcpRtp(cam->RTSP.Rtcp,(uint8_t *) ptr + 4,length,RtcpNow());
+    RtpDepackPacket(cam->RTSP.Depack,(uint8_t *) ptr + 4,length);
     return inlength;
 }
-// Resubmit the interleave
+// Throws the session away
+static void StreamClose(Camera c) {
+    CURL *easy = c->RTSP.Easy;
+    CurlComplete cp = NULL;
+
+    RtcpStop(c->RTSP.Rtcp);
+    curl_easy_getinfo(easy,CURLINFO_PRIVATE,&cp);
+    curl_multi_remove_handle(CurlHandle,easy);
+    curl_easy_cleanup(easy);
+    free(cp);
+    c->RTSP.Easy = NULL;
+}
+// Throws the session away and arranges for the watchdog to start
+// a new one
+static void StreamFail(Camera c) {
+    uint32_t delay;
+
+    if(c->RTSP.Easy == NULL)
+      return;
+    StreamClose(c);
+    delay = RtspSessionFailed(c);
+    printf("RTSP %s: retrying in %u ms\n",c->Name,delay);
+    MonitorTimerReschedule(c->RTSP.Watchdog,delay);
+}
+// Checks how a request went, failing the session if it didn't
+static int RequestFailed(CURL *easy,CurlComplete cp,const char *request) {
+    Camera c = cp->Data;
+    long status = 0;
+
+    // RECEIVE has no reply of its own so leaves the status at 0
+    curl_easy_getinfo(easy,CURLINFO_RESPONSE_CODE,&status);
+    if(cp->Result == CURLE_OK && (status == 0 || status == 200))
+      return 0;
+    if(cp->Result != CURLE_OK)
+      printf("RTSP %s: %s failed: %s\n",c->Name,request,curl_easy_strerror(cp->Result));
+    else
+      printf("RTSP %s: %s failed with status %li\n",c->Name,request,status);
+    StreamFail(c);
+    return 1;
+}
+// Checks the session is still alive and restarts it after a failure
+static void StreamWatchdog(MonitorTimer t,void *data) {
+    Camera c = data;
+
+    if(c->RTSP.Easy == NULL) {
+      RtspStartupQueue(c,StreamDescribe);
+    }
+    else if(RtspSessionIdle(c)) {
+      printf("RTSP %s: nothing received for %i ms\n",c->Name,c->RTSP.Timeout);
+      StreamFail(c);
+      return;
+    }
+    MonitorTimerReschedule(t,WATCHDOG_DELAY(c));
+}
+static void StreamInterleaveDone(CURL *easy,CurlComplete cp);
+// The keepalive has been answered so go back to receiving
+static void KeepAliveDone(CURL *easy,CurlComplete cp) {
+    Camera c = cp->Data;
+    long status = 0;
+
+    // Not every camera implements GET_PARAMETER but any request
+    // with the session refreshes it. Only a lost session matters.
+    curl_easy_getinfo(easy,CURLINFO_RESPONSE_CODE,&status);
+    if((cp->Result != CURLE_OK || status == 454) && RequestFailed(easy,cp,"GET_PARAMETER"))
+      return;
+    c->RTSP.KeepAliveDue = MonitorNow() + c->RTSP.KeepAliveDelay;
+    cp->Callback = StreamInterleaveDone;
+    my_curl_easy_setopt(easy, CURLOPT_RTSP_REQUEST,(long)CURL_RTSPREQ_RECEIVE);
+    curl_multi_add_handle(CurlHandle,easy);
+}
+// Resubmit the interleave, sending a keepalive when one is due
 static void StreamInterleaveDone(CURL *easy,CurlComplete cp) {
-    // curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response_code);
+    Camera c = cp->Data;
+
+    if(RequestFailed(easy,cp,"RECEIVE"))
+      return;
+    if(MonitorNow() >= c->RTSP.KeepAliveDue) {
+      c->RTSP.Stats.KeepAlives++;
+      cp->Callback = KeepAliveDone;
+      my_curl_easy_setopt(easy, CURLOPT_RTSP_REQUEST,(long)CURL_RTSPREQ_GET_PARAMETER);
+    }
     curl_multi_add_handle(CurlHandle,easy);
-    return;
+}
+// curl has no way to send interleaved data so receiver reports are
+// written to its connection directly. That is only safe while it is
+// waiting in RECEIVE and has nothing of its own to send.
+static int SendRtcp(void *data,const uint8_t *packet,int32_t length) {
+    Camera c = data;
+    CurlComplete cp = NULL;
+    curl_socket_t sock = CURL_SOCKET_BAD;
+    uint8_t header[4] = { '$',RTCP_CHANNEL,length >> 8,length & 0xff };
+    struct iovec iov[2] = { { header,4 },{ (void *) packet,length } };
+    struct msghdr msg = { .msg_iov = iov,.msg_iovlen = 2 };
+    ssize_t sent;
+
+    if(c->RTSP.Easy == NULL)
+      return -1;
+    curl_easy_getinfo(c->RTSP.Easy,CURLINFO_PRIVATE,&cp);
+    curl_easy_getinfo(c->RTSP.Easy,CURLINFO_ACTIVESOCKET,&sock);
+    if(cp == NULL || cp->Callback != StreamInterleaveDone || sock == CURL_SOCKET_BAD)
+      return -1;
+    if((sent = sendmsg(sock,&msg,MSG_NOSIGNAL | MSG_DONTWAIT)) == 4 + length)
+      return 0;
+    // Half a frame would throw the camera's parsing out
+    if(sent > 0) {
+      printf("RTSP %s: RTCP only partly sent\n",c->Name);
+      StreamFail(c);
+    }
+    return -1;
 }
 // The stream is playing so setup interleave
 static void StreamPlayDone(CURL *easy,CurlComplete cp) {
     Camera c = cp->Data;
 
+    if(RequestFailed(easy,cp,"PLAY"))
+      return;
+    RtspSessionPlaying(c);
+    RtcpStart(c->RTSP.Rtcp);
+    c->RTSP.KeepAliveDue = MonitorNow() + c->RTSP.KeepAliveDelay;
     cp->Callback = StreamInterleaveDone;
 
     my_curl_easy_setopt(easy, CURLOPT_PRIVATE, cp);
@@ -217,6 +410,10 @@ static void StreamPlayDone(CURL *easy,CurlComplete cp) {
 static void StreamSetupDone(CURL *easy,CurlComplete cp) {
     Camera c = cp->Data;
 
+    if(RequestFailed(easy,cp,"SETUP"))
+      return;
+    RtspPhaseDone(c,PHASE_SETUP);
+    RtspSessionActive(c);
     cp->Callback = StreamPlayDone;
 
 //    return;
@@ -231,8 +428,23 @@ static void StreamSetupDone(CURL *easy,CurlComplete cp) {
 static void DescribeDone(CURL *easy,CurlComplete cp) {
     Camera c = cp->Data;
 
+    if(RequestFailed(easy,cp,"DESCRIBE"))
+      return;
+    SdpEnd(c->RTSP.Sdp);
+    free(c->RTSP.Control);
+    c->RTSP.Control = NULL;
+    if(SdpApply(c->RTSP.Sdp,c->RTSP.Depack,c->Name,c->Codec) ||
+       (c->RTSP.Control = SdpControlURL(c->RTSP.Sdp,c->RTSP.ContentBase ? c->RTSP.ContentBase : c->RTSP.URL)) == NULL) {
+      StreamFail(c);
+      return;
+    }
+    RtcpSetClockRate(c->RTSP.Rtcp,((Sdp) c->RTSP.Sdp)->ClockRate);
+    RtspPhaseDone(c,PHASE_DESCRIBE);
+    RtspSessionActive(c);
     cp->Callback = StreamSetupDone;
 
+    my_curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, DiscardBody);
+
     my_curl_easy_setopt(easy, CURLOPT_PRIVATE, cp); 
     my_curl_easy_setopt(easy, CURLOPT_URL, c->RTSP.URL);
     my_curl_easy_setopt(easy, CURLOPT_RTSP_STREAM_URI, c->RTSP.Control);
@@ -240,123 +452,65 @@ static void DescribeDone(CURL *easy,CurlComplete cp) {
     my_curl_easy_setopt(easy, CURLOPT_RTSP_REQUEST, (long)CURL_RTSPREQ_SETUP);
     curl_multi_add_handle(CurlHandle,easy);
 }
-// Parses the the SDP response from DESCRIBE
-// and extracts the control uri
+// The SDP from the DESCRIBE, parsed as it arrives
 static size_t ParseSDP(char *ptr,size_t size, size_t nitems, void *userdata) {
-    int inlength = size * nitems;
     Camera c = userdata;
-    int maxcp = c->RTSP.ContentLength - c->RTSP.BufferUsed;
-    if(maxcp < 0 || maxcp < inlength) {
-      printf("Something is wrong: maxcp:%i cl:%i length:%i\n",
-             maxcp,c->RTSP.ContentLength,inlength);
-      return 0;   // force abort
-    }
-    maxcp = maxcp > inlength ? inlength : maxcp;
-    memcpy(c->RTSP.Buffer+c->RTSP.BufferUsed,ptr,maxcp);
-    c->RTSP.BufferUsed += maxcp;
-    if( c->RTSP.BufferUsed < c->RTSP.ContentLength )
-      return inlength;
-    // Terminate SDP data
-    c->RTSP.Buffer[inlength] = 0;
-    char *cur,*next;
-    char *media   = NULL;
-    
-    for(cur = ptr; cur; cur = next) {
-      if((next = strstr(cur,"\r\n")) != NULL) {
-        *next = 0;
-        next += 2;
-      }
-      switch(*cur) {
-                  // Session Description
-        case 'v':     break;  // Version
-        case 'o':     break;  // Originator and session id
-        case 's':     break;  // Session Name
-        // case 'i':  break;  // Title/Information
-        case 'u':     break;  // Description URI
-        case 'e':     break;  // Contact email address
-        case 'p':     break;  // Contact phone
-        // case 'c':  break;  // Connection information
-        // case 'b':  break;  // Bandwidth
-        case 'z':     break;  // Time Zone adjustments
-        // case 'k':  break;  // Encryption key
-        // case 'a':  break;  // Session attributes
-                  // Time description
-        case 't':     break;  // Time session is active
-        case 'r':     break;  // Repeat times
-                  // Media description
-        case 'm':             // Name and transport
-          if(strncmp(cur,"m=video ",8) == 0) {
-            media = cur + 2;
-          }
-        case 'i':     break;  // Title/Information
-        case 'c':     break;  // Connection information
-        case 'b':     break;  // Bandwidth information
-        case 'k':     break;  // Encryption key
-        case 'a':             // Attributes
-          if( media ) {
-            if(strncmp(cur,"a=control:",10) == 0) {
-              if( c->RTSP.Control )
-                free(c->RTSP.Control);
-              c->RTSP.Control = strdup(cur+10);
-            }
-          }
-          break;
-        case 0:
-          break;
-        default:
-          printf("Unhandled character %c\n",*cur);
-          break;
-      }
-    }
-    // If the data was extracted then need to setup the stream
-//    curl_multi_add_handle(CurlHandle,easy);
-
-    return inlength;
+    SdpParse(c->RTSP.Sdp,ptr,size * nitems);
+    return size * nitems;
+}
+// Bodies of anything after the DESCRIBE aren't wanted
+static size_t DiscardBody(char *ptr,size_t size, size_t nitems, void *userdata) {
+    return size * nitems;
 }
-// Extracts the content length from
-// DESCRIBE header response
-static size_t ParseDescribeHeader(char *ptr,size_t size, size_t nitems, void *userdata) {
+// Picks out the Content-Base from the DESCRIBE
+// response and the timeout from the SETUP response
+static size_t ParseHeader(char *ptr,size_t size, size_t nitems, void *userdata) {
     int inlength = size * nitems;
     Camera c = userdata;
-    //
-    // According to rfc7826 18.17 Content-Length is mandatory
-    // on all responses that have content beyond the header.
-    //
-    if(strncasecmp(ptr,"Content-Length: ", 15 < inlength ? 15 : inlength) == 0) {
-      // The line is terminated by CRLF so it is safe to null terminate
-      ptr[inlength-1] = 0;
-      int cl = c->RTSP.ContentLength = atoi(ptr+15);
-      // Add 1 to cl for NULL termination
-      cl++;
-      // Allocate the buffer
-      if( cl > c->RTSP.BufferLength ) {
-        if(c->RTSP.Buffer) {
-          printf("Increasing buffer to %i\n",cl);
-          free(c->RTSP.Buffer);
-        }
-        c->RTSP.Buffer = malloc(cl < MINBUFSIZ ? MINBUFSIZ : cl);
-      }
-      c->RTSP.BufferUsed = 0;
+    char line[512];
+
+    // Header lines aren't terminated
+    if(inlength < 9 || inlength >= sizeof(line))
+      return inlength;
+    memcpy(line,ptr,inlength);
+    line[inlength] = 0;
+    line[strcspn(line,"\r\n")] = 0;
+    if(strncasecmp(line,"Content-Base:",13) == 0) {
+      free(c->RTSP.ContentBase);
+      c->RTSP.ContentBase = strdup(line + 13 + strspn(line + 13," \t"));
+    }
+    else if(strncasecmp(line,"Session:",8) == 0) {
+      c->RTSP.KeepAliveDelay = RtspKeepAliveDelay(line);
     }
     return inlength;
 }
-// The sequence to get the H264 stream
-// is started by sending a DESCRIBE
-void RtspStartStream(Camera c) {
+// Starts a new session with a DESCRIBE
+static void StreamDescribe(Camera c) {
     CURL *easy = curl_easy_init( );
     CurlComplete cp;
-    // Need to reset some parameters before starting...
-    c->RTSP.BufferUsed = 0;
-    c->RTSP.ContentLength = 0;
+    // Need to reset some parameters before starting, and nothing
+    // reaches the decoder until a picture it can start from
+    RtpDepackHold(c->RTSP.Depack,NULL,NULL);
+    RtspSessionActive(c);
+    if(c->RTSP.Sdp == NULL)
+      c->RTSP.Sdp = SdpNew();
+    SdpReset(c->RTSP.Sdp);
+    free(c->RTSP.ContentBase);
+    c->RTSP.ContentBase = NULL;
+    c->RTSP.KeepAliveDelay = RtspKeepAliveDelay(NULL);
+    c->RTSP.Easy = easy;
     // Setup and execute the DESCRIBE
-    cp = malloc(sizeof(struct _CurlComplete));
+    cp = calloc(1,sizeof(struct _CurlComplete));
     cp->Data = c;
     cp->Callback = DescribeDone;
     my_curl_easy_setopt(easy, CURLOPT_PRIVATE, cp); 
     my_curl_easy_setopt(easy, CURLOPT_VERBOSE, 0L);
     my_curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 1L);
+    // A dropped session can't be picked up on the old connection
+    my_curl_easy_setopt(easy, CURLOPT_FRESH_CONNECT, 1L);
+    my_curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 1L);
     my_curl_easy_setopt(easy, CURLOPT_URL, c->RTSP.URL);
-    my_curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, ParseDescribeHeader);
+    my_curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, ParseHeader);
     my_curl_easy_setopt(easy, CURLOPT_HEADERDATA, c);
     my_curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION,ParseSDP);
     my_curl_easy_setopt(easy, CURLOPT_WRITEDATA,c);
@@ -364,3 +518,73 @@ void RtspStartStream(Camera c) {
     my_curl_easy_setopt(easy, CURLOPT_RTSP_REQUEST, (long)CURL_RTSPREQ_DESCRIBE);
     curl_multi_add_handle(CurlHandle,easy);
 }
+// The sequence to get the H264 stream
+// is started by sending a DESCRIBE
+void RtspStartStream(Camera c) {
+    if(c->RTSP.Depack == NULL) {
+      c->RTSP.Depack = RtpDepackNew(c->Name,c->RenderHandle,c->Codec);
+      RtpDepackSetConceal(c->RTSP.Depack,c->RTSP.Conceal);
+      RtpDepackSetFanout(c->RTSP.Depack,c->Fanout);
+    }
+    if(c->RTSP.Rtcp == NULL)
+      c->RTSP.Rtcp = RtcpNew(c->Name,SendRtcp,c);
+    if(c->RTSP.Watchdog == NULL)
+      c->RTSP.Watchdog = MonitorTimerAdd(WATCHDOG_DELAY(c),StreamWatchdog,c);
+    RtspStartupQueue(c,StreamDescribe);
+}
+// Drops the session, the camera is going away
+void RtspStopStream(Camera c) {
+    MonitorTimerCancel(c->RTSP.Watchdog);
+    c->RTSP.Watchdog = NULL;
+    RtspStartupCancel(c);
+    if(c->RTSP.Easy)
+      StreamClose(c);
+}
+// Switches camera c to stream Index, normally because the view has
+// changed the size of its tile. The native client plays the new
+// stream alongside the old one and changes over at its first key
+// frame. curl only has the one session so it is restarted with the
+// decoder held on the last picture until the new key frame.
+void RtspSwitchStream(Camera c,int32_t Index) {
+    Stream st;
+
+    if(Index < 0 || Index >= c->StreamCount || Index == c->StreamIndex)
+      return;
+    c->StreamIndex = Index;
+    st = &c->Stream[Index];
+    printf("RTSP %s: switching to the %ix%i stream\n",c->Name,st->Width,st->Height);
+    if(c->RTSP.Native) {
+      RtspNativeSwitchStream(c,st->URL);
+      return;
+    }
+    c->RTSP.URL = st->URL;
+    // Not started yet
+    if(c->RTSP.Watchdog == NULL)
+      return;
+    RtpDepackHold(c->RTSP.Depack,NULL,NULL);
+    if(c->RTSP.Easy)
+      StreamClose(c);
+    RtspStartupQueue(c,StreamDescribe);
+}
+// A switch has been given up on so the camera is still on the
+// stream it was playing. Pointing StreamIndex back at it lets the
+// next view change try again.
+void RtspSwitchFailed(Camera c) {
+    for(int32_t i = 0; i < c->StreamCount; i++)
+      if(strcmp(c->Stream[i].URL,c->RTSP.URL) == 0) {
+        c->StreamIndex = i;
+        return;
+      }
+}
+// Keeps stream Index of camera c playing, but not decoded, so that a
+// switch to it is immediate. -1 for none. Only the native client can
+// run the extra session.
+void RtspPrewarmStream(Camera c,int32_t Index) {
+    if(Index >= c->StreamCount || !c->RTSP.Native)
+      Index = -1;
+    if(Index >= 0 && Index != c->WarmIndex)
+      printf("RTSP %s: keeping the %ix%i stream warm\n",c->Name,c->Stream[Index].Width,c->Stream[Index].Height);
+    c->WarmIndex = Index;
+    if(c->RTSP.Native)
+      RtspNativePrewarmStream(c,Index >= 0 ? c->Stream[Index].URL : NULL);
+}
@@ -0,0 +1,273 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cctvplexer.h"
+#include "rtp.h"
+#include "sdp.h"
+
+//
+// SDP (RFC 4566) parser for DESCRIBE replies.
+//
+// The SDP can be given in pieces as it arrives, it is split into
+// lines here. Only the first video stream is of interest: its control
+// URI, payload type, codec and clock rate from a=rtpmap, frame rate
+// and the a=fmtp parameters. The parameter sets carried in the fmtp
+// (sprop-parameter-sets for H264, sprop-vps/sps/pps for H265) are
+// decoded into Annex B so they can be given to the decoder before the
+// first packet arrives, which lets the first IDR decode without
+// waiting for the camera to repeat them in band.
+//
+
+enum SdpMedia {
+    MEDIA_SESSION = 0,              // Before the first m= line
+    MEDIA_VIDEO,                    // In the first video stream
+    MEDIA_OTHER,                    // In some other stream
+    MEDIA_DONE,                     // After the first video stream
+};
+
+static const uint8_t StartCode[4] = { 0, 0, 0, 1 };
+
+// Decodes base64 into out, returns the length or -1 if it won't fit
+// or isn't base64
+static int32_t Base64Decode(const char *in,int32_t length,uint8_t *out,int32_t size) {
+    uint32_t bits = 0;
+    int32_t nbits = 0,used = 0;
+
+    for(int32_t i=0; i < length && in[i] != '='; i++) {
+      int32_t c = in[i];
+      int32_t v = c >= 'A' && c <= 'Z' ? c - 'A' :
+                  c >= 'a' && c <= 'z' ? c - 'a' + 26 :
+                  c >= '0' && c <= '9' ? c - '0' + 52 :
+                  c == '+' || c == '-' ? 62 :
+                  c == '/' || c == '_' ? 63 : -1;
+      if(v < 0)
+        return -1;
+      bits = (bits << 6) | v;
+      if((nbits += 6) >= 8) {
+        if(used == size)
+          return -1;
+        nbits -= 8;
+        out[used++] = bits >> nbits;
+      }
+    }
+    return used;
+}
+// Finds Name=value in an fmtp parameter list, returning the value
+// and its length
+static const char *FmtpValue(const char *params,const char *name,int32_t *length) {
+    int32_t len = strlen(name);
+
+    while(*params) {
+      params += strspn(params,"; \t");
+      int32_t end = strcspn(params,";");
+      if(strncasecmp(params,name,len) == 0 && params[len] == '=') {
+        *length = end - len - 1;
+        while(*length && (params[len+*length] == ' ' || params[len+*length] == '\t'))
+          (*length)--;
+        return params + len + 1;
+      }
+      params += end;
+    }
+    return NULL;
+}
+// Adds the comma separated base64 NAL units in Value to the
+// parameter sets
+static void AddParameterSets(Sdp s,const char *value,int32_t length) {
+    while(length > 0) {
+      int32_t len = 0;
+      while(len < length && value[len] != ',')
+        len++;
+      uint8_t *out = s->ParameterSets + s->ParameterSetsLength;
+      int32_t room = SDP_PARAMETER_SETS - s->ParameterSetsLength - sizeof(StartCode);
+      int32_t n = room > 0 ? Base64Decode(value,len,out + sizeof(StartCode),room) : -1;
+      if(n < 0) {
+        printf("SDP: unusable parameter set %.*s\n",len,value);
+      }
+      else if(n > 0) {
+        memcpy(out,StartCode,sizeof(StartCode));
+        s->ParameterSetsLength += n + sizeof(StartCode);
+        s->ParameterSetCount++;
+      }
+      value += len + 1;
+      length -= len + 1;
+    }
+}
+static void Fmtp(Sdp s,const char *params) {
+    // H265 parameter sets have to go in VPS, SPS, PPS order
+    static const char *sets[] = { "sprop-vps","sprop-sps","sprop-pps","sprop-parameter-sets" };
+    const char *value;
+    int32_t length;
+
+    for(int i=0; i < sizeof(sets)/sizeof(sets[0]); i++)
+      if((value = FmtpValue(params,sets[i],&length)) != NULL)
+        AddParameterSets(s,value,length);
+    if((value = FmtpValue(params,"profile-level-id",&length)) != NULL)
+      s->ProfileLevelId = strtol(value,NULL,16);
+    if((value = FmtpValue(params,"sprop-max-don-diff",&length)) != NULL)
+      s->Donl = atoi(value) > 0;
+}
+// An a= line in the video stream, without the a=
+static void Attribute(Sdp s,char *attr) {
+    char *value = strchr(attr,':');
+    if(value == NULL)
+      return;
+    *value++ = 0;
+    if(strcmp(attr,"control") == 0) {
+      free(s->Control);
+      s->Control = strdup(value);
+    }
+    else if(strcmp(attr,"framerate") == 0) {
+      s->FrameRate = strtod(value,NULL);
+    }
+    else if(strcmp(attr,"rtpmap") == 0 || strcmp(attr,"fmtp") == 0) {
+      // The stream may offer several formats, only the first is used
+      char *rest;
+      int32_t pt = strtol(value,&rest,10);
+      if(rest == value || (s->PayloadType >= 0 && pt != s->PayloadType))
+        return;
+      rest += strspn(rest," \t");
+      if(attr[0] == 'f') {
+        Fmtp(s,rest);
+        return;
+      }
+      int32_t len = strcspn(rest,"/");
+      snprintf(s->Encoding,sizeof(s->Encoding),"%.*s",len,rest);
+      s->Codec = RtpCodecFromRtpmap(value);
+      s->ClockRate = rest[len] == '/' ? atoi(rest + len + 1) : 0;
+    }
+}
+static void Line(Sdp s,char *line) {
+    if(line[0] == 0 || line[1] != '=')
+      return;
+    if(line[0] == 'm') {
+      if(s->Media == MEDIA_VIDEO)
+        s->Media = MEDIA_DONE;
+      else if(s->Media != MEDIA_DONE && strncmp(line,"m=video ",8) == 0) {
+        // m=video <port> <proto> <first format> ...
+        s->Media = MEDIA_VIDEO;
+        if(sscanf(line + 8,"%*s %*s %i",&s->PayloadType) != 1)
+          s->PayloadType = -1;
+      }
+      else if(s->Media != MEDIA_DONE)
+        s->Media = MEDIA_OTHER;
+    }
+    else if(line[0] == 'a' && s->Media == MEDIA_VIDEO) {
+      Attribute(s,line + 2);
+    }
+}
+
+//
+// Public interface
+//
+
+Sdp SdpNew(void) {
+    Sdp s = calloc(1,sizeof(struct _Sdp));
+    if(s)
+      SdpReset(s);
+    return s;
+}
+// Gets ready for another SDP
+void SdpReset(Sdp s) {
+    free(s->Control);
+    s->Control = NULL;
+    s->PayloadType = -1;
+    s->Codec = -1;
+    s->Encoding[0] = 0;
+    s->ClockRate = 0;
+    s->Donl = 0;
+    s->ProfileLevelId = -1;
+    s->FrameRate = 0;
+    s->ParameterSetCount = 0;
+    s->ParameterSetsLength = 0;
+    s->Media = MEDIA_SESSION;
+    s->LineUsed = 0;
+    s->LineTooLong = 0;
+}
+void SdpRelease(Sdp s) {
+    if(s == NULL)
+      return;
+    free(s->Control);
+    free(s);
+}
+// Takes the next Length bytes of the SDP, any amount at a time
+void SdpParse(Sdp s,const char *data,int32_t length) {
+    for(int32_t i=0; i < length; i++) {
+      char c = data[i];
+      if(c == '\r' || c == '\n') {
+        if(s->LineTooLong)
+          printf("SDP: ignoring line longer than %i: %.40s...\n",SDP_LINE_SIZE,s->Line);
+        else if(s->LineUsed) {
+          s->Line[s->LineUsed] = 0;
+          Line(s,s->Line);
+        }
+        s->LineUsed = s->LineTooLong = 0;
+      }
+      else if(s->LineUsed < SDP_LINE_SIZE - 1)
+        s->Line[s->LineUsed++] = c;
+      else
+        s->LineTooLong = 1;
+    }
+}
+// The SDP has all arrived, deal with a last line with no line ending
+void SdpEnd(Sdp s) {
+    SdpParse(s,"\n",1);
+}
+// The URL for SETUP and PLAY. Relative controls are relative to Base,
+// the Content-Base or the request URL.
+char *SdpControlURL(Sdp s,const char *base) {
+    char *url;
+    const char *control = s->Control;
+
+    if(control == NULL || strcmp(control,"*") == 0)
+      return strdup(base);
+    if(strncasecmp(control,"rtsp://",7) == 0 || strncasecmp(control,"rtsps://",8) == 0)
+      return strdup(control);
+    if(asprintf(&url,"%s%s%s",base,base[0] && base[strlen(base)-1] == '/' ? "" : "/",control) < 0)
+      return NULL;
+    return url;
+}
+// Sets up depacketizer Depack for the stream. Codec is what to assume
+// if the SDP doesn't say. Returns -1 if the stream can't be used.
+int SdpApply(Sdp s,void *Depack,const char *Name,VideoCodec Codec) {
+    if(s->Media != MEDIA_VIDEO && s->Media != MEDIA_DONE) {
+      printf("Camera %s: no video in SDP\n",Name);
+      return -1;
+    }
+    if(s->Encoding[0] && s->Codec < 0) {
+      printf("Camera %s: unsupported video %s\n",Name,s->Encoding);
+      return -1;
+    }
+    if(s->Codec >= 0)
+      Codec = s->Codec;
+    printf("Camera %s: %s",Name,Codec == CODEC_H265 ? "H265" : "H264");
+    if(s->ProfileLevelId >= 0)
+      printf(" profile %i level %i.%i",s->ProfileLevelId >> 16,(s->ProfileLevelId & 0xff) / 10,
+             (s->ProfileLevelId & 0xff) % 10);
+    if(s->FrameRate > 0)
+      printf(" %g fps",s->FrameRate);
+    printf(", %i parameter sets from SDP\n",s->ParameterSetCount);
+    RtpDepackSetCodec(Depack,Codec,s->Donl);
+    if(s->ParameterSetsLength)
+      RtpDepackSetParameterSets(Depack,s->ParameterSets,s->ParameterSetsLength);
+    return 0;
+}
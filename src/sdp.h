@@ -0,0 +1,53 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _SDP_H_INCLUDED_
+#define _SDP_H_INCLUDED_
+
+#define SDP_LINE_SIZE       2048
+#define SDP_PARAMETER_SETS  1024    // Room for the Annex B parameter sets
+
+typedef struct _Sdp *Sdp;
+
+// What the SDP says about the first video stream
+struct _Sdp {
+    char    *Control;               // a=control as given, NULL if none
+    int32_t  PayloadType;           // From the m= line, -1 if none
+    int32_t  Codec;                 // From a=rtpmap, -1 if not known
+    char     Encoding[32];          // a=rtpmap encoding name, empty if none
+    int32_t  ClockRate;
+    int32_t  Donl;                  // H265 sprop-max-don-diff > 0
+    int32_t  ProfileLevelId;        // H264 profile-level-id, -1 if not given
+    double   FrameRate;             // a=framerate, 0 if not given
+    int32_t  ParameterSetCount;
+    int32_t  ParameterSetsLength;
+    uint8_t  ParameterSets[SDP_PARAMETER_SETS];
+    // Parser state
+    int32_t  Media;                 // Which part of the SDP the lines are in
+    int32_t  LineUsed;
+    int32_t  LineTooLong;
+    char     Line[SDP_LINE_SIZE];
+};
+
+Sdp   SdpNew(void);
+void  SdpReset(Sdp);
+void  SdpRelease(Sdp);
+void  SdpParse(Sdp,const char *,int32_t);
+void  SdpEnd(Sdp);
+char *SdpControlURL(Sdp,const char *);
+// Need cctvplexer.h
+int   SdpApply(Sdp,void *,const char *,VideoCodec);
+#endif
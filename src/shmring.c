@@ -0,0 +1,214 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "shmring.h"
+
+//
+// The helper side is meant to be linked into stream helpers, so this
+// depends on nothing else in cctvplexer. One side writes Head and the
+// other Tail, which makes the ring safe without locks as long as
+// there is only one of each.
+//
+
+struct _ShmRing {
+    int       FD;
+    int       EventFD;
+    ShmHeader Header;
+    uint8_t  *Records;
+    uint32_t  Mask;
+    size_t    Mapped;
+    uint64_t  Tail;                 // Parent's copy of Tail
+    uint32_t  Peeked;               // Ring bytes of the unit from ShmRingPeek
+};
+
+static inline uint32_t RecordSize(uint32_t Length) {
+    return (sizeof(struct _ShmRecord) + Length + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+}
+static ShmRing Map(int FD,int EventFD,size_t Mapped) {
+    ShmRing r = calloc(1,sizeof(struct _ShmRing));
+    if(r == NULL)
+      return NULL;
+    r->Header = mmap(NULL,Mapped,PROT_READ|PROT_WRITE,MAP_SHARED,FD,0);
+    if(r->Header == MAP_FAILED) {
+      printf("Couldn't map the stream ring: %s\n",strerror(errno));
+      free(r);
+      return NULL;
+    }
+    r->FD = FD;
+    r->EventFD = EventFD;
+    r->Mapped = Mapped;
+    return r;
+}
+// Creates a ring for Size bytes of records, rounded up to a power of two
+ShmRing ShmRingNew(const char *Name,int32_t Size) {
+    uint32_t size = 4096;
+    size_t mapped;
+    int fd, efd;
+    ShmRing r;
+
+    while(size < Size)
+      size <<= 1;
+    mapped = sizeof(struct _ShmHeader) + size;
+    if( (fd = memfd_create(Name,MFD_CLOEXEC)) < 0 ) {
+      printf("Couldn't create the stream ring for %s: %s\n",Name,strerror(errno));
+      return NULL;
+    }
+    if( ftruncate(fd,mapped) < 0 || (efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ) {
+      printf("Couldn't set up the stream ring for %s: %s\n",Name,strerror(errno));
+      close(fd);
+      return NULL;
+    }
+    if( (r = Map(fd,efd,mapped)) == NULL ) {
+      close(fd);
+      close(efd);
+      return NULL;
+    }
+    r->Header->Magic = SHM_MAGIC;
+    r->Header->Version = SHM_VERSION;
+    r->Header->Size = size;
+    r->Header->HeaderSize = sizeof(struct _ShmHeader);
+    r->Records = (uint8_t *) r->Header + sizeof(struct _ShmHeader);
+    r->Mask = size - 1;
+    return r;
+}
+void ShmRingClose(ShmRing r) {
+    if(r == NULL)
+      return;
+    munmap(r->Header,r->Mapped);
+    close(r->FD);
+    close(r->EventFD);
+    free(r);
+}
+int ShmRingFD(ShmRing r) {
+    return r->FD;
+}
+// Readable when the helper has written something
+int ShmRingEventFD(ShmRing r) {
+    return r->EventFD;
+}
+uint64_t ShmRingDropped(ShmRing r) {
+    return __atomic_load_n(&r->Header->Dropped,__ATOMIC_RELAXED);
+}
+// Fills in Unit with the oldest unit in the ring, returns zero if
+// there isn't one. Nothing the helper has written is trusted, the
+// parent's own size is used and every record has to lie within what
+// has been written. Returns -1 if one doesn't, the ring is no use
+// after that.
+int ShmRingPeek(ShmRing r,ShmUnit Unit) {
+    uint64_t head = __atomic_load_n(&r->Header->Head,__ATOMIC_ACQUIRE);
+    uint32_t size = r->Mask + 1;
+    struct _ShmRecord rec;
+
+    if(head - r->Tail > size)
+      return -1;
+    while(r->Tail != head) {
+      uint32_t at = r->Tail & r->Mask;
+      // Read once, the helper could change it after it has been checked
+      memcpy(&rec,r->Records + at,sizeof(rec));
+      __atomic_signal_fence(__ATOMIC_SEQ_CST);
+      if(rec.Length == SHM_WRAP) {
+        if(head - r->Tail < size - at)
+          return -1;
+        r->Tail += size - at;
+        __atomic_store_n(&r->Header->Tail,r->Tail,__ATOMIC_RELEASE);
+        continue;
+      }
+      if(rec.Length > size - at - sizeof(rec) || RecordSize(rec.Length) > head - r->Tail)
+        return -1;
+      Unit->Data = r->Records + at + sizeof(rec);
+      Unit->Length = rec.Length;
+      Unit->Flags = rec.Flags;
+      Unit->PTS = rec.PTS;
+      r->Peeked = RecordSize(rec.Length);
+      return 1;
+    }
+    return 0;
+}
+// Gives the space of the unit from ShmRingPeek back to the helper
+void ShmRingPop(ShmRing r) {
+    r->Tail += r->Peeked;
+    r->Peeked = 0;
+    __atomic_store_n(&r->Header->Tail,r->Tail,__ATOMIC_RELEASE);
+}
+// Maps a ring inherited from the parent
+ShmRing ShmRingAttach(int FD,int EventFD) {
+    struct _ShmHeader header;
+    ShmRing r;
+
+    if(pread(FD,&header,sizeof(header),0) != sizeof(header) ||
+       header.Magic != SHM_MAGIC || header.Version != SHM_VERSION ||
+       (header.Size & (header.Size - 1)) != 0) {
+      fprintf(stderr,"Not a stream ring\n");
+      return NULL;
+    }
+    if( (r = Map(FD,EventFD,header.HeaderSize + header.Size)) == NULL )
+      return NULL;
+    r->Records = (uint8_t *) r->Header + header.HeaderSize;
+    r->Mask = header.Size - 1;
+    return r;
+}
+// Maps the ring named in the environment
+ShmRing ShmRingAttachEnv(void) {
+    const char *fd = getenv(SHM_ENV_FD);
+    const char *efd = getenv(SHM_ENV_EVENTFD);
+
+    if(fd == NULL || efd == NULL) {
+      fprintf(stderr,"%s and %s aren't set\n",SHM_ENV_FD,SHM_ENV_EVENTFD);
+      return NULL;
+    }
+    return ShmRingAttach(atoi(fd),atoi(efd));
+}
+// Adds a unit of Length bytes to the ring and tells the parent. If
+// there isn't room it is dropped, the helper mustn't wait on the
+// parent. Returns zero when it is dropped.
+int ShmRingWrite(ShmRing r,const uint8_t *Data,int32_t Length,int64_t PTS,uint32_t Flags) {
+    uint64_t head = r->Header->Head;
+    uint64_t tail = __atomic_load_n(&r->Header->Tail,__ATOMIC_ACQUIRE);
+    uint32_t at = head & r->Mask;
+    uint32_t size = RecordSize(Length);
+    uint32_t skip = r->Header->Size - at < size ? r->Header->Size - at : 0;
+    uint64_t one = 1;
+    ShmRecord rec;
+
+    if(Length < 0 || head + skip + size - tail > r->Header->Size) {
+      __atomic_add_fetch(&r->Header->Dropped,1,__ATOMIC_RELAXED);
+      return 0;
+    }
+    if(skip) {
+      ((ShmRecord) (r->Records + at))->Length = SHM_WRAP;
+      head += skip;
+      at = 0;
+    }
+    rec = (ShmRecord) (r->Records + at);
+    rec->Length = Length;
+    rec->Flags = Flags;
+    rec->PTS = PTS;
+    memcpy(rec + 1,Data,Length);
+    __atomic_store_n(&r->Header->Head,head + size,__ATOMIC_RELEASE);
+    if(write(r->EventFD,&one,sizeof(one)) < 0 && errno != EAGAIN)
+      return 0;
+    return 1;
+}
@@ -0,0 +1,81 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _SHMRING_H_INCLUDED_
+#define _SHMRING_H_INCLUDED_
+
+//
+// Shared memory ring a stream helper writes access units into.
+//
+// The ring is a memfd the parent creates and the helper inherits,
+// along with an eventfd the helper writes to after each unit. Their
+// descriptor numbers are passed in the environment. Each unit is a
+// record header followed by the Annex B data, padded to a multiple of
+// SHM_ALIGN. A record that won't fit before the end of the ring is
+// written at the start, after a wrap record.
+//
+#define SHM_ENV_FD          "CCTV_SHM_FD"
+#define SHM_ENV_EVENTFD     "CCTV_SHM_EVENTFD"
+#define SHM_MAGIC           0x56544343      // "CCTV"
+#define SHM_VERSION         1
+#define SHM_ALIGN           16
+#define SHM_WRAP            0xffffffff      // Record length, skip to the start
+
+// Record flags
+#define SHM_KEY             1               // Decoding can start here
+
+typedef struct _ShmRing   *ShmRing;
+typedef struct _ShmUnit   *ShmUnit;
+typedef struct _ShmHeader *ShmHeader;
+typedef struct _ShmRecord *ShmRecord;
+
+// At the start of the memfd. Head is only written by the helper,
+// Tail only by the parent, both are byte counts that never wrap.
+struct _ShmHeader {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t Size;                          // Bytes of records, a power of two
+    uint32_t HeaderSize;                    // Where the records start
+    uint64_t Dropped;                       // Units the helper had no room for
+    uint64_t Head __attribute__((aligned(64)));
+    uint64_t Tail __attribute__((aligned(64)));
+};
+struct _ShmRecord {
+    uint32_t Length;                        // Of the data, or SHM_WRAP
+    uint32_t Flags;
+    int64_t  PTS;                           // Microseconds
+};
+// A unit read from the ring, valid until ShmRingPop
+struct _ShmUnit {
+    const uint8_t *Data;
+    int32_t  Length;
+    uint32_t Flags;
+    int64_t  PTS;
+};
+
+// Parent
+ShmRing ShmRingNew(const char *,int32_t);
+void    ShmRingClose(ShmRing);
+int     ShmRingFD(ShmRing);
+int     ShmRingEventFD(ShmRing);
+int     ShmRingPeek(ShmRing,ShmUnit);
+void    ShmRingPop(ShmRing);
+uint64_t ShmRingDropped(ShmRing);
+// Helper
+ShmRing ShmRingAttach(int,int);
+ShmRing ShmRingAttachEnv(void);
+int     ShmRingWrite(ShmRing,const uint8_t *,int32_t,int64_t,uint32_t);
+#endif
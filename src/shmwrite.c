@@ -0,0 +1,119 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+//
+// Reference writer for the shared memory stream transport. It reads
+// an Annex B stream on stdin, splits it into access units and writes
+// them into the ring it inherited from cctvplexer, e.g.
+//
+//   Command = "/bin/sh",
+//   Args    = [ "-c", "ffmpeg -i rtsp://camera/stream -c copy -f h264 - | shmwrite h264" ],
+//   HelperTransport = "shm"
+//
+// Units are timestamped when they arrive, or at fps if that is given.
+// A helper that knows the real PTS should link shmring.o and call
+// ShmRingWrite itself, which also saves the trip through the pipe.
+//
+//   shmwrite [h264|h265] [fps]
+//
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "cctvplexer.h"
+#include "nal.h"
+#include "annexb.h"
+#include "shmring.h"
+
+#define READ_SIZE   (64*1024)
+#define MAX_UNIT    (4*1024*1024)
+
+static ShmRing Ring;
+static VideoCodec Codec = CODEC_H264;
+static double Fps;
+static uint64_t Units;
+
+static int64_t NowUS(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+static void Write(const uint8_t *data,int32_t length,int key) {
+    int64_t pts = Fps > 0 ? (int64_t) (Units * 1000000 / Fps) : NowUS();
+    if(length > 0 && !ShmRingWrite(Ring,data,length,pts,key ? SHM_KEY : 0))
+      fprintf(stderr,"shmwrite: no room for a %i byte unit\n",length);
+    Units++;
+}
+int main(int ac,char *av[]) {
+    if(ac > 1 && (strcmp(av[1],"h265") == 0 || strcmp(av[1],"hevc") == 0))
+      Codec = CODEC_H265;
+    if(ac > 2)
+      Fps = atof(av[2]);
+    if( (Ring = ShmRingAttachEnv()) == NULL )
+      return 1;
+
+    int32_t header = NalHeaderLength(Codec);
+    uint8_t *data = malloc(MAX_UNIT + READ_SIZE);
+    if(data == NULL) {
+      fprintf(stderr,"shmwrite: no memory for the read buffer\n");
+      return 1;
+    }
+    int32_t length = 0;         // In data
+    int32_t scanned = 0;        // Where the next start code search begins
+    int picture = 0, key = 0;   // What the unit at the front has
+    ssize_t got;
+
+    while( (got = read(0,data + length,READ_SIZE)) > 0 ) {
+      length += got;
+      for(;;) {
+        const uint8_t *end = data + length;
+        const uint8_t *p = AnnexBFindStart(data + scanned,end);
+        if(end - p < ANNEXB_START_LENGTH + header + 1) {
+          int32_t next = p == end ? length - (ANNEXB_START_LENGTH - 1) : p - data;
+          if(next > scanned)
+            scanned = next;
+          break;
+        }
+        const uint8_t *nal = p + ANNEXB_START_LENGTH;
+        int32_t at = p - data;
+        while(at > 0 && data[at-1] == 0)
+          at--;
+        if(picture && NalStartsAccessUnit(Codec,nal,nal + header,1)) {
+          Write(data,at,key);
+          memmove(data,data + at,length - at);
+          length -= at;
+          nal -= at;
+          picture = key = 0;
+        }
+        if(NalPicture(Codec,nal))
+          picture = 1;
+        if(NalRandomAccess(Codec,nal,nal + header,1))
+          key = 1;
+        scanned = nal + header - data;
+      }
+      // Nothing that big is video, start again
+      if(length > MAX_UNIT) {
+        fprintf(stderr,"shmwrite: no access unit ends in %i bytes\n",length);
+        length = scanned = picture = key = 0;
+      }
+    }
+    Write(data,length,key);
+    return 0;
+}
@@ -0,0 +1,279 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+//
+// io_uring ingest. Each source always has a read posted into
+// a buffer supplied by its GetBuffer function. When a read
+// completes the buffer is passed to Complete and the next read
+// is posted straight away. All the completions and all the new
+// reads for every source are handled with a single io_uring_enter
+// so a busy camera doesn't cost a wakeup plus a read() per chunk.
+//
+// Only one read is ever outstanding per source, two reads on
+// the same pipe could complete out of order.
+//
+// This talks to the kernel directly rather than pulling in
+// liburing. It has no dependencies on the rest of the plexer
+// so that it can be benchmarked on its own.
+//
+
+struct _UringSource {
+    Uring          Ring;
+    int            FD;
+    struct iovec   IOV;
+    int32_t        Pending;             // A read is posted
+    int32_t        Starved;             // GetBuffer had nothing to give
+    UringGetBuffer GetBuffer;
+    UringComplete  Complete;
+    void          *Data;
+    UringSource    Next;
+};
+struct _Uring {
+    int       FD;
+    uint32_t  Flags;                    // Setup flags
+    // Submission queue
+    void     *SQRing;
+    size_t    SQRingSize;
+    uint32_t *SQHead;
+    uint32_t *SQTail;
+    uint32_t *SQMask;
+    uint32_t *SQFlags;
+    uint32_t *SQArray;
+    struct io_uring_sqe *SQEs;
+    size_t    SQEsSize;
+    uint32_t  ToSubmit;
+    // Completion queue
+    void     *CQRing;
+    size_t    CQRingSize;
+    uint32_t *CQHead;
+    uint32_t *CQTail;
+    uint32_t *CQMask;
+    struct io_uring_cqe *CQEs;
+    // Everything being read
+    UringSource Sources;
+    uint64_t  Syscalls;                 // io_uring_enter calls
+};
+
+static int SysSetup(uint32_t entries,struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup,entries,p);
+}
+static int SysEnter(int fd,uint32_t submit,uint32_t complete,uint32_t flags) {
+    return syscall(__NR_io_uring_enter,fd,submit,complete,flags,NULL,0);
+}
+// Creates a ring with room for Entries reads. If SQPoll is set
+// the kernel polls the submission queue so submitting doesn't
+// need a syscall at all (needs privileges on older kernels).
+// Returns NULL if the kernel doesn't support io_uring.
+Uring UringNew(uint32_t Entries,int SQPoll) {
+    struct io_uring_params p;
+    Uring r = calloc(1,sizeof(struct _Uring));
+    if(r == NULL)
+      return NULL;
+    memset(&p,0,sizeof(p));
+    if(SQPoll) {
+      p.flags = IORING_SETUP_SQPOLL;
+      p.sq_thread_idle = 1000;
+    }
+    r->FD = SysSetup(Entries,&p);
+    if(r->FD < 0 && SQPoll) {
+      printf("io_uring SQPOLL unavailable (%s), trying without\n",strerror(errno));
+      memset(&p,0,sizeof(p));
+      r->FD = SysSetup(Entries,&p);
+    }
+    if(r->FD < 0) {
+      printf("io_uring unavailable: %s\n",strerror(errno));
+      free(r);
+      return NULL;
+    }
+    r->Flags = p.flags;
+    // Map the rings
+    r->SQRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->CQRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->SQEsSize   = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->SQRing = mmap(NULL,r->SQRingSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->FD,IORING_OFF_SQ_RING);
+    r->CQRing = mmap(NULL,r->CQRingSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->FD,IORING_OFF_CQ_RING);
+    r->SQEs   = mmap(NULL,r->SQEsSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->FD,IORING_OFF_SQES);
+    if(r->SQRing == MAP_FAILED || r->CQRing == MAP_FAILED || r->SQEs == MAP_FAILED) {
+      printf("Unable to map io_uring: %s\n",strerror(errno));
+      UringRelease(r);
+      return NULL;
+    }
+    r->SQHead  = r->SQRing + p.sq_off.head;
+    r->SQTail  = r->SQRing + p.sq_off.tail;
+    r->SQMask  = r->SQRing + p.sq_off.ring_mask;
+    r->SQFlags = r->SQRing + p.sq_off.flags;
+    r->SQArray = r->SQRing + p.sq_off.array;
+    r->CQHead  = r->CQRing + p.cq_off.head;
+    r->CQTail  = r->CQRing + p.cq_off.tail;
+    r->CQMask  = r->CQRing + p.cq_off.ring_mask;
+    r->CQEs    = r->CQRing + p.cq_off.cqes;
+    return r;
+}
+void UringRelease(Uring Ring) {
+    if(Ring == NULL)
+      return;
+    if(Ring->SQRing && Ring->SQRing != MAP_FAILED)
+      munmap(Ring->SQRing,Ring->SQRingSize);
+    if(Ring->CQRing && Ring->CQRing != MAP_FAILED)
+      munmap(Ring->CQRing,Ring->CQRingSize);
+    if(Ring->SQEs && Ring->SQEs != MAP_FAILED)
+      munmap(Ring->SQEs,Ring->SQEsSize);
+    if(Ring->FD >= 0)
+      close(Ring->FD);
+    while(Ring->Sources) {
+      UringSource s = Ring->Sources;
+      Ring->Sources = s->Next;
+      free(s);
+    }
+    free(Ring);
+}
+// The ring fd becomes readable when there are completions
+int UringGetFD(Uring Ring) {
+    return Ring ? Ring->FD : -1;
+}
+uint64_t UringSyscalls(Uring Ring) {
+    return Ring ? Ring->Syscalls : 0;
+}
+// Queue a read for a source. Doesn't submit it.
+static int PostRead(UringSource s) {
+    Uring r = s->Ring;
+    int32_t length = 0;
+    uint32_t tail = *r->SQTail;
+
+    if(tail - __atomic_load_n(r->SQHead,__ATOMIC_ACQUIRE) > *r->SQMask) {
+      s->Starved = 1;
+      return 0;
+    }
+    if( (s->IOV.iov_base = s->GetBuffer(s->Data,&length)) == NULL ) {
+      s->Starved = 1;
+      return 0;
+    }
+    s->IOV.iov_len = length;
+    uint32_t idx = tail & *r->SQMask;
+    struct io_uring_sqe *sqe = &r->SQEs[idx];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = s->FD;
+    sqe->addr = (uint64_t) (uintptr_t) &s->IOV;
+    sqe->len = 1;
+    sqe->off = 0;                       // Pipes don't have an offset
+    sqe->user_data = (uint64_t) (uintptr_t) s;
+    r->SQArray[idx] = idx;
+    __atomic_store_n(r->SQTail,tail+1,__ATOMIC_RELEASE);
+    r->ToSubmit++;
+    s->Pending = 1;
+    s->Starved = 0;
+    return 1;
+}
+// Tell the kernel about queued reads
+static void Submit(Uring r) {
+    if(r->ToSubmit == 0)
+      return;
+    if(r->Flags & IORING_SETUP_SQPOLL) {
+      // The kernel thread picks them up unless it has gone to sleep
+      r->ToSubmit = 0;
+      if( (__atomic_load_n(r->SQFlags,__ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) == 0 )
+        return;
+      r->Syscalls++;
+      SysEnter(r->FD,0,0,IORING_ENTER_SQ_WAKEUP);
+      return;
+    }
+    r->Syscalls++;
+    int n = SysEnter(r->FD,r->ToSubmit,0,0);
+    if(n < 0) {
+      perror("io_uring_enter");
+      return;
+    }
+    r->ToSubmit -= n;
+}
+// Start reading from FD
+UringSource UringAddSource(Uring Ring,int FD,UringGetBuffer GetBuffer,UringComplete Complete,void *Data) {
+    if(Ring == NULL)
+      return NULL;
+    UringSource s = calloc(1,sizeof(struct _UringSource));
+    if(s == NULL)
+      return NULL;
+    s->Ring = Ring;
+    s->FD = FD;
+    s->GetBuffer = GetBuffer;
+    s->Complete = Complete;
+    s->Data = Data;
+    s->Next = Ring->Sources;
+    Ring->Sources = s;
+    PostRead(s);
+    Submit(Ring);
+    return s;
+}
+static void RemoveSource(Uring r,UringSource s) {
+    for(UringSource *sp = &r->Sources; *sp; sp = &(*sp)->Next) {
+      if(*sp == s) {
+        *sp = s->Next;
+        free(s);
+        return;
+      }
+    }
+}
+// Hand over completed reads, post new ones and submit them.
+// Returns the number of sources that are waiting for a buffer,
+// the caller should call again shortly if it isn't zero.
+int UringProcess(Uring Ring) {
+    Uring r = Ring;
+    int starved = 0;
+    if(r == NULL)
+      return 0;
+    uint32_t head = *r->CQHead;
+    uint32_t tail = __atomic_load_n(r->CQTail,__ATOMIC_ACQUIRE);
+    for(; head != tail; head++) {
+      struct io_uring_cqe *cqe = &r->CQEs[head & *r->CQMask];
+      UringSource s = (UringSource) (uintptr_t) cqe->user_data;
+      int32_t res = cqe->res;
+      void *buffer = s->IOV.iov_base;
+      s->Pending = 0;
+      if(res <= 0) {
+        // The source has ended so forget about it before telling
+        // the owner, who will most likely close the fd
+        void *data = s->Data;
+        UringComplete complete = s->Complete;
+        RemoveSource(r,s);
+        complete(data,buffer,res);
+        continue;
+      }
+      s->Complete(s->Data,buffer,res);
+      PostRead(s);
+    }
+    __atomic_store_n(r->CQHead,head,__ATOMIC_RELEASE);
+    // Try again for anything that couldn't get a buffer
+    for(UringSource s = r->Sources; s; s = s->Next) {
+      if(s->Starved && !s->Pending)
+        PostRead(s);
+      starved += s->Starved;
+    }
+    Submit(r);
+    return starved;
+}
@@ -0,0 +1,35 @@
+/* 
+    Copyright (C) 2020  Terry Sanders
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef _URING_H_INCLUDED_
+#define _URING_H_INCLUDED_
+
+typedef struct _Uring       *Uring;
+typedef struct _UringSource *UringSource;
+
+// Supplies a buffer to read into and sets its length. NULL if none are free
+typedef void *(*UringGetBuffer)(void *,int32_t *);
+// Called with the buffer and the result of the read. A result <= 0
+// means the source has ended (or failed) and has been removed.
+typedef void  (*UringComplete)(void *,void *,int32_t);
+
+Uring UringNew(uint32_t,int);
+void  UringRelease(Uring);
+int   UringGetFD(Uring);
+UringSource UringAddSource(Uring,int,UringGetBuffer,UringComplete,void *);
+int   UringProcess(Uring);
+uint64_t UringSyscalls(Uring);
+#endif